@@ -41,6 +41,7 @@
 #define LIBVBUCKET_VBUCKET_H 1
 
 #include <stddef.h>
+#include <stdint.h>
 #include "visibility.h"
 
 #ifdef __cplusplus
@@ -60,9 +61,45 @@ extern "C" {
      */
     typedef enum {
         VBUCKET_DISTRIBUTION_VBUCKET = 0,
-        VBUCKET_DISTRIBUTION_KETAMA = 1
+        VBUCKET_DISTRIBUTION_KETAMA = 1,
+        VBUCKET_DISTRIBUTION_JUMP = 2,
+        VBUCKET_DISTRIBUTION_MAGLEV = 3
     } VBUCKET_DISTRIBUTION_TYPE;
 
+    /**
+     * One segment of a key which is stored in several buffers. It has
+     * the same layout as struct iovec.
+     */
+    typedef struct {
+        const void *iov_base;
+        size_t iov_len;
+    } vbucket_iovec_t;
+
+    /**
+     * A task of a parallel continuum build and the executor which runs
+     * a batch of them. The executor must run task(args[i]) for every
+     * i < ntasks, on any threads and in any order, and only return when
+     * all of them are done.
+     */
+    typedef void (*vbucket_task_fn)(void *arg);
+    typedef void (*vbucket_executor_fn)(void *cookie, vbucket_task_fn task,
+                                        void *const *args, int ntasks);
+
+    struct vbucket_config_stream_st;
+
+    /**
+     * Opaque parser of a stream of configs.
+     */
+    typedef struct vbucket_config_stream_st* VBUCKET_CONFIG_STREAM;
+
+    /**
+     * Called with every config read from a stream. status is 0 if the
+     * config parsed and -1 if not, vbucket_get_error_message() of the
+     * handle tells why. The callback owns the handle and must destroy it.
+     */
+    typedef void (*vbucket_stream_fn)(void *cookie, VBUCKET_CONFIG_HANDLE config,
+                                      int status);
+
     /**
      * \addtogroup cfgcmp
      * @{
@@ -142,6 +179,104 @@ extern "C" {
                               const char *data,
                               const char *peername);
 
+    /**
+     * Parse a vbucket configuration from memory which doesn't need to be
+     * zero terminated, like a network buffer. It is read in place.
+     * @param handle the vbucket config handle to store the result
+     * @param data the JSON body
+     * @param size the number of bytes of data
+     * @param peername a string, representing address of local peer
+     *                 (usually 127.0.0.1)
+     * @return 0 for success, the appropriate error code otherwise
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_config_parse_buffer(VBUCKET_CONFIG_HANDLE handle,
+                                    const void *data,
+                                    size_t size,
+                                    const char *peername);
+
+    /**
+     * Read the rev of a configuration and the fingerprint of its bytes
+     * without parsing it, to drop a config which is older than or the
+     * same as the one in use before paying for a parse. Without a
+     * fingerprint only the bytes up to the rev are checked, the rest of
+     * the JSON may still be invalid. With one the whole document is
+     * scanned to find where it ends.
+     * @param data the JSON body, it doesn't need to be zero terminated
+     * @param size the number of bytes of data
+     * @param rev set to the top level "rev", or -1 if there is none
+     * @param fingerprint set to the fingerprint of the JSON document in
+     *                    data, without the white space around it and
+     *                    anything after it. It is the same as
+     *                    vbucket_config_get_fingerprint() of a config
+     *                    parsed from data, whatever way it was parsed.
+     * @return 0 for success, -1 if data is not JSON
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_config_peek(const void *data, size_t size,
+                            int64_t *rev, uint64_t *fingerprint);
+
+    /**
+     * Parse a vbucket configuration which replaces a previous one. The
+     * result is the same as with vbucket_config_parse2(), but a ketama
+     * continuum is built incrementally: the points of the servers which
+     * were already in the previous config are reused from it, so only the
+     * added servers are hashed.
+     * @param handle the vbucket config handle to store the result
+     * @param previous the config being replaced, or NULL. It is only
+     *                 read and must stay valid until the call returns.
+     * @param data_source what kind of datasource to parse
+     * @param data A zero terminated string representing the data to parse.
+     * @param peername a string, representing address of local peer
+     *                 (usually 127.0.0.1)
+     * @return 0 for success, the appropriate error code otherwise
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_config_parse_update(VBUCKET_CONFIG_HANDLE handle,
+                                    VBUCKET_CONFIG_HANDLE previous,
+                                    vbucket_source_t data_source,
+                                    const char *data,
+                                    const char *peername);
+
+    /**
+     * Create a parser for a stream of configs, like the streaming bucket
+     * config of a cluster, where every JSON document is followed by a
+     * "\n\n\n\n" separator. The stream is fed in chunks of any size as
+     * they arrive and each config is parsed while it is received.
+     * @param peername a string, representing address of local peer
+     *                 (usually 127.0.0.1), it is copied
+     * @param callback called with the handle of every config read
+     * @param cookie passed to the callback
+     * @return the stream or NULL if there is no more memory
+     */
+    LIBVBUCKET_PUBLIC_API
+    VBUCKET_CONFIG_STREAM vbucket_config_stream_create(const char *peername,
+                                                       vbucket_stream_fn callback,
+                                                       void *cookie);
+
+    /**
+     * Feed the next chunk of a stream. The callback is called for every
+     * config which ends in it, before the call returns. A config is
+     * reported as soon as its JSON document is complete, a separator
+     * ends a document which isn't and the rest of a broken document is
+     * skipped up to the next separator.
+     * @param stream the stream
+     * @param data the bytes received
+     * @param size the number of bytes
+     * @return 0 for success, -1 if there is no more memory
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_config_stream_feed(VBUCKET_CONFIG_STREAM stream,
+                                   const void *data, size_t size);
+
+    /**
+     * Destroy a stream, a config which is only partly read is dropped.
+     *
+     * @param stream the stream
+     */
+    LIBVBUCKET_PUBLIC_API
+    void vbucket_config_stream_destroy(VBUCKET_CONFIG_STREAM stream);
+
     LIBVBUCKET_PUBLIC_API
     const char *vbucket_get_error_message(VBUCKET_CONFIG_HANDLE handle);
 
@@ -149,6 +284,12 @@ extern "C" {
     /**
      * Create an instance of vbucket config from a file.
      *
+     * A regular file is mapped into memory and parsed in place, the parse
+     * fails if its size or modification time changed meanwhile. Replace
+     * a config file by renaming a new one over it: truncating a mapped
+     * file while it is parsed raises SIGBUS. Pipes and other files which
+     * can't be mapped are read in chunks.
+     *
      * @param filename the vbucket config to parse
      */
     LIBVBUCKET_PUBLIC_API
@@ -247,6 +388,23 @@ extern "C" {
     LIBVBUCKET_PUBLIC_API
     const char *vbucket_config_get_password(VBUCKET_CONFIG_HANDLE h);
 
+    /**
+     * Get the top level "rev" of the config.
+     *
+     * @return the rev or -1 if the config has none.
+     */
+    LIBVBUCKET_PUBLIC_API
+    int64_t vbucket_config_get_rev(VBUCKET_CONFIG_HANDLE h);
+
+    /**
+     * Get the fingerprint of the JSON the config was parsed from. Equal
+     * bytes have equal fingerprints, it combines their crc32 and length.
+     *
+     * @return the fingerprint, see vbucket_config_peek().
+     */
+    LIBVBUCKET_PUBLIC_API
+    uint64_t vbucket_config_get_fingerprint(VBUCKET_CONFIG_HANDLE h);
+
     /**
      * Get the server at the given index.
      *
@@ -281,13 +439,146 @@ extern "C" {
 
     /**
      * Get the distribution type. Currently can be or "vbucket" (for
-     * eventually persisted nodes) either "ketama" (for plain memcached
-     * nodes).
+     * eventually persisted nodes) either "ketama", "jump" or "maglev" (for
+     * plain memcached nodes).
      *
      * @return a member of VBUCKET_DISTRIBUTION_TYPE enum.
      */
     LIBVBUCKET_PUBLIC_API
     VBUCKET_DISTRIBUTION_TYPE vbucket_config_get_distribution_type(VBUCKET_CONFIG_HANDLE vb);
+    /**
+     * Get the share of the key hash space which is mapped to every
+     * server: the fraction of the continuum for ketama distribution and
+     * the fraction of reachable vbuckets it is master for otherwise. Keys
+     * spread over the servers in these proportions when their hashes are
+     * uniform.
+     *
+     * @param h the vbucket config
+     * @param shares array with an element for every server
+     *
+     * @return zero on success
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_config_get_server_shares(VBUCKET_CONFIG_HANDLE h, double *shares);
+
+    /**
+     * Enable a cache of key to server lookups for ketama distribution.
+     * Hot keys then skip the key hash and the continuum search, and get
+     * the same server as without the cache. The cache has a fixed number
+     * of 64 byte slots and is safe to use from several threads. Keys
+     * longer than 48 bytes aren't cached. Builds with compilers that
+     * have no GCC style atomics guard the slots with one lock, so the
+     * cache works there but saves little.
+     *
+     * @param h the vbucket config
+     * @param nslots number of cached keys, rounded up to a power of two
+     *
+     * @return zero on success, -1 if the config isn't using ketama
+     *         distribution, already has a cache or there is no memory
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_config_enable_key_cache(VBUCKET_CONFIG_HANDLE h, size_t nslots);
+
+    /**
+     * Set the size of the index in front of the ketama continuum. The
+     * index has 2^bits entries, one for every slice of the key hash space
+     * by its top bits, and answers most lookups without searching the
+     * continuum. By default the size is picked from the number of
+     * continuum points; the index is rebuilt along with the continuum.
+     * A parsed config frees its old index, so this must be called before
+     * the handle is shared with threads doing lookups. On failure the
+     * old index stays in use.
+     *
+     * @param h the vbucket config
+     * @param bits index size in bits, up to 24, 0 to disable the index
+     *             or -1 to pick the size automatically
+     *
+     * @return zero on success, -1 if bits is too big or there is no memory
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_config_set_ketama_index_bits(VBUCKET_CONFIG_HANDLE h, int bits);
+
+    /**
+     * Stop mapping keys to a server for ketama distribution, for example
+     * while it doesn't answer. Its keys go to the server they would map
+     * to if it was removed from the config, without rebuilding the
+     * continuum; that is fastest with fallbacks enabled. Ejecting and
+     * restoring servers is safe while other threads map keys.
+     *
+     * @param h the vbucket config
+     * @param server_idx the server to eject
+     *
+     * @return zero on success, -1 if the config isn't using ketama
+     *         distribution, the server doesn't exist or is the last one
+     *         which isn't ejected
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_ketama_eject(VBUCKET_CONFIG_HANDLE h, int server_idx);
+
+    /**
+     * Map keys to an ejected server again.
+     *
+     * @return zero on success, -1 if the config isn't using ketama
+     *         distribution or the server doesn't exist
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_ketama_restore(VBUCKET_CONFIG_HANDLE h, int server_idx);
+
+    /**
+     * Check if a server is ejected.
+     *
+     * @return non-zero if the server is ejected
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_ketama_is_ejected(VBUCKET_CONFIG_HANDLE h, int server_idx);
+
+    /**
+     * Keep the next distinct servers of every ketama continuum point, for
+     * vbucket_get_ketama_fallback(). They take nfallbacks * 4 bytes per
+     * point and are rebuilt along with the continuum. A parsed config
+     * frees its old search arrays, so this must be called before the
+     * handle is shared with threads doing lookups. On failure the old
+     * fallbacks stay in use.
+     *
+     * @param h the vbucket config
+     * @param nfallbacks number of fallbacks, up to 8, 0 to drop them
+     *
+     * @return zero on success, -1 if nfallbacks is out of range or there
+     *         is no memory
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_config_set_ketama_fallbacks(VBUCKET_CONFIG_HANDLE h, int nfallbacks);
+
+    /**
+     * Build the ketama continuum of the following parses in parallel.
+     * The servers are hashed and their points sorted in nthreads tasks
+     * and the sorted runs are merged in parallel; the continuum is the
+     * same as the one built on a single thread.
+     *
+     * @param h the vbucket config
+     * @param nthreads number of tasks, 1 builds on the calling thread
+     * @param executor runs the tasks, or NULL to run them on threads
+     *                 started for every build
+     * @param cookie passed on to the executor
+     *
+     * @return zero on success, -1 if nthreads is out of range or there
+     *         is no executor on a platform without threads
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_config_set_build_threads(VBUCKET_CONFIG_HANDLE h, int nthreads,
+                                         vbucket_executor_fn executor,
+                                         void *cookie);
+
+    /**
+     * Get the number of lookups answered from and missed by the key cache.
+     * Threads count in separate stripes which are summed here, so the
+     * totals are exact but may miss lookups still running meanwhile.
+     *
+     * @return zero on success, -1 if the cache isn't enabled
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_config_get_key_cache_stats(VBUCKET_CONFIG_HANDLE h,
+                                           uint64_t *hits, uint64_t *misses);
     /**
      * @}
      */
@@ -315,6 +606,69 @@ extern "C" {
     int vbucket_map(VBUCKET_CONFIG_HANDLE h, const void *key, size_t nkey,
                     int *vbucket_id, int *server_idx);
 
+    /**
+     * Hash the key with the function used by the current distribution
+     * type. The result can be kept and passed to vbucket_map_hashed()
+     * to route the same key again (retries, replica reads, or after
+     * vbucket_found_incorrect_master()) without rehashing it.
+     *
+     * @param h the vbucket config
+     * @param key pointer to the beginning of the key
+     * @param nkey the size of the key
+     *
+     * @return the key hash
+     */
+    LIBVBUCKET_PUBLIC_API
+    uint32_t vbucket_hash_key(VBUCKET_CONFIG_HANDLE h,
+                              const void *key, size_t nkey);
+
+    /**
+     * Same as vbucket_hash_key() for a key given as a list of segments.
+     *
+     * @param h the vbucket config
+     * @param iov the key segments
+     * @param niov the number of segments
+     *
+     * @return the key hash
+     */
+    LIBVBUCKET_PUBLIC_API
+    uint32_t vbucket_hash_keyv(VBUCKET_CONFIG_HANDLE h,
+                               const vbucket_iovec_t *iov, int niov);
+
+    /**
+     * Map a key hash computed by vbucket_hash_key() to server index. The
+     * hash is only valid for configs with the same distribution type.
+     *
+     * @param h the vbucket config
+     * @param hash the key hash
+     * @param vbucket_id the vbucket identifier when vbucket distribution is
+     *                   used or zero otherwise, may be NULL.
+     * @param server_idx the server index
+     *
+     * @return zero on success
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_map_hashed(VBUCKET_CONFIG_HANDLE h, uint32_t hash,
+                           int *vbucket_id, int *server_idx);
+
+    /**
+     * Map many key hashes computed by vbucket_hash_key() at once, with
+     * the same results as vbucket_map_hashed(). For ketama distribution
+     * the continuum searches of the keys are done side by side, so they
+     * wait for memory together instead of one after the other.
+     *
+     * @param h the vbucket config
+     * @param hashes the key hashes
+     * @param n the number of hashes
+     * @param vbucket_ids receives the vbucket of every key, may be NULL
+     * @param server_idxs receives the server of every key, may be NULL
+     *
+     * @return zero on success
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_map_hashes(VBUCKET_CONFIG_HANDLE h, const uint32_t *hashes,
+                           size_t n, int *vbucket_ids, int *server_idxs);
+
     /**
      * Get the vbucket number for the given key.
      *
@@ -328,6 +682,83 @@ extern "C" {
     int vbucket_get_vbucket_by_key(VBUCKET_CONFIG_HANDLE h,
                                    const void *key, size_t nkey);
 
+    /**
+     * Map a key given as a list of segments to server index. The result
+     * is the same as for vbucket_map() on the concatenated segments, but
+     * they are hashed in place.
+     *
+     * @param h the vbucket config
+     * @param iov the key segments
+     * @param niov the number of segments
+     * @param vbucket_id the vbucket identifier when vbucket distribution is
+     *                   used or zero otherwise, may be NULL.
+     * @param server_idx the server index
+     *
+     * @return zero on success
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_mapv(VBUCKET_CONFIG_HANDLE h, const vbucket_iovec_t *iov,
+                     int niov, int *vbucket_id, int *server_idx);
+
+    /**
+     * Map many keys at once. The keys are hashed several at a time, so
+     * this is faster than calling vbucket_map() for every key of a large
+     * multi-get. It is aware about current distribution type.
+     *
+     * @param h the vbucket config
+     * @param keys array of pointers to the beginning of the keys
+     * @param nkeys array with the size of each key
+     * @param n the number of keys
+     * @param vbucket_ids array of n elements to store the vbucket
+     *                    identifier of each key (zero when vbucket
+     *                    distribution isn't used), or NULL
+     * @param server_idxs array of n elements to store the master server
+     *                    index of each key, or NULL
+     *
+     * @return zero on success
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_get_vbuckets_by_keys(VBUCKET_CONFIG_HANDLE h,
+                                     const void * const *keys,
+                                     const size_t *nkeys,
+                                     size_t n,
+                                     int *vbucket_ids,
+                                     int *server_idxs);
+
+    /**
+     * Get the vbucket number for the key given as a list of segments.
+     *
+     * @param h the vbucket config
+     * @param iov the key segments
+     * @param niov the number of segments
+     *
+     * @return a key
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_get_vbucket_by_keyv(VBUCKET_CONFIG_HANDLE h,
+                                    const vbucket_iovec_t *iov, int niov);
+
+    /**
+     * Build a key which maps to the given vbucket by appending a short
+     * suffix of printable characters to the prefix. It works without
+     * searching, so it is suitable to generate data sets covering every
+     * vbucket. Only CRC based hash algorithms are supported.
+     *
+     * @param h the vbucket config
+     * @param vbucket the vbucket id the key should map to
+     * @param prefix the beginning of the key
+     * @param nprefix the size of the prefix
+     * @param buf buffer to store the key, it may be the prefix itself
+     * @param nbuf the size of the buffer, at least nprefix + 8 bytes.
+     *             The key is zero terminated if there is room for it.
+     *
+     * @return the size of the key or -1 if no key can be generated
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_generate_key(VBUCKET_CONFIG_HANDLE h, int vbucket,
+                             const char *prefix, size_t nprefix,
+                             char *buf, size_t nbuf);
+
     /**
      * Get the master server for the given vbucket.
      *
@@ -351,6 +782,38 @@ extern "C" {
     LIBVBUCKET_PUBLIC_API
     int vbucket_get_replica(VBUCKET_CONFIG_HANDLE h, int id, int n);
 
+    /**
+     * Get a given fallback server of a key for ketama distribution. The
+     * fallbacks are the distinct servers which follow the key's server
+     * clockwise on the continuum, which is where its key moves when the
+     * servers before it are gone. They have to be enabled with
+     * vbucket_config_set_ketama_fallbacks().
+     *
+     * @param h the vbucket config
+     * @param hash the key hash from vbucket_hash_key()
+     * @param n the fallback number, 0 is the first server after the
+     *          one vbucket_map() returns
+     *
+     * @return the server ID, or -1 if there is no such fallback
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_get_ketama_fallback(VBUCKET_CONFIG_HANDLE h, uint32_t hash, int n);
+
+    /**
+     * Get all the fallback servers of a key for ketama distribution, in
+     * order, with a single continuum search.
+     *
+     * @param h the vbucket config
+     * @param hash the key hash from vbucket_hash_key()
+     * @param servers array which receives the server IDs
+     * @param nservers size of the array
+     *
+     * @return the number of servers stored, -1 if fallbacks aren't enabled
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_get_ketama_fallbacks(VBUCKET_CONFIG_HANDLE h, uint32_t hash,
+                                     int *servers, int nservers);
+
     /**
      * @}
      */
@@ -380,6 +843,63 @@ extern "C" {
     LIBVBUCKET_PUBLIC_API
     void vbucket_free_diff(VBUCKET_CONFIG_DIFF *diff);
 
+    /**
+     * Compute the fraction of the key hash space that maps to another
+     * server in the "to" config than in the "from" one, to size the data
+     * transfer and the cache misses of a topology change before it is
+     * applied. Servers are matched by name, so reordering them moves
+     * nothing. The configs must use the same distribution and hash
+     * algorithm.
+     *
+     * Vbucket maps compare the masters of every vbucket, also between
+     * maps of different sizes. Ketama walks the two continua side by
+     * side and counts the arcs that change owner, taking ejected servers
+     * into account. Maglev does the same with the slots of the tables.
+     * These three are exact.
+     *
+     * For jump consistent hash the result is only an estimate, the
+     * fraction a uniform hash would move: 1 - (servers keeping their
+     * bucket) / (larger number of servers). Which keys move depends on
+     * the jump points of every hash, which would take a walk over the
+     * whole 32 bit hash space to count, so the actual fraction of a jump
+     * config may differ slightly. Use
+     * vbucket_config_count_remapped_keys() on a sample of real keys when
+     * the exact figure matters.
+     *
+     * @param from the current vbucket config
+     * @param to the new vbucket config
+     * @param fraction where to store the fraction, between 0 and 1
+     *
+     * @return zero on success, -1 if the configs can't be compared or
+     *         there is no memory
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_config_get_remap_fraction(VBUCKET_CONFIG_HANDLE from,
+                                          VBUCKET_CONFIG_HANDLE to,
+                                          double *fraction);
+
+    /**
+     * Count the keys of a sample that map to another server in the "to"
+     * config than in the "from" one. Servers are matched by name, the
+     * configs may use any distribution.
+     *
+     * @param from the current vbucket config
+     * @param to the new vbucket config
+     * @param keys the keys
+     * @param nkeys the sizes of the keys
+     * @param n the number of keys
+     * @param nmoved where to store the number of keys that move
+     *
+     * @return zero on success, -1 if there is no memory
+     */
+    LIBVBUCKET_PUBLIC_API
+    int vbucket_config_count_remapped_keys(VBUCKET_CONFIG_HANDLE from,
+                                           VBUCKET_CONFIG_HANDLE to,
+                                           const void * const *keys,
+                                           const size_t *nkeys,
+                                           size_t n,
+                                           size_t *nmoved);
+
     /**
      * @}
      */
@@ -5,8 +5,22 @@
  * src/usr.bin/cksum/crc32.c.
  */
 
+#include <string.h>
 #include "hash.h"
 
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define HAVE_CRC32_PCLMUL 1
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define HAVE_CRC32_ARMV8 1
+#include <arm_acle.h>
+#endif
+
 static const uint32_t crc32tab[256] = {
     0x00000000, 0x77073096, 0xee0e612c, 0x990951ba,
     0x076dc419, 0x706af48f, 0xe963a535, 0x9e6495a3,
@@ -74,13 +88,463 @@ static const uint32_t crc32tab[256] = {
     0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d,
 };
 
+/* crc32tab8[k][n] is the crc of byte n followed by k zero bytes */
+static uint32_t crc32tab8[8][256];
+
+/*
+ * crc32suffix[j] is how flipping bit j of the suffix written by
+ * hash_crc32_suffix changes the crc. The low nibble of every suffix byte
+ * is free, the rest is CRC32_SUFFIX_BASE.
+ */
+#define CRC32_SUFFIX_BASE 0x40
+static uint32_t crc32suffix[4 * HASH_CRC32_SUFFIX_LENGTH];
+
+typedef uint32_t (*crc32_kernel_t)(uint32_t crc, const unsigned char *buf,
+                                   size_t len);
+
+static uint32_t crc32_bytewise(uint32_t crc, const unsigned char *buf,
+                               size_t len)
+{
+    size_t x;
+
+    for (x= 0; x < len; x++)
+        crc= (crc >> 8) ^ crc32tab[(crc ^ buf[x]) & 0xff];
+
+    return crc;
+}
+
+/*
+ * Slicing-by-8: eight independent table lookups per 8 input bytes
+ * instead of a serial chain of eight. Words are assembled byte by byte
+ * so that it is correct regardless of alignment and endianness.
+ */
+static uint32_t crc32_slice8(uint32_t crc, const unsigned char *buf,
+                             size_t len)
+{
+    uint32_t lo, hi;
+
+    while (len >= 8) {
+        lo = crc ^ ((uint32_t)buf[0] | ((uint32_t)buf[1] << 8) |
+                    ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24));
+        hi = (uint32_t)buf[4] | ((uint32_t)buf[5] << 8) |
+             ((uint32_t)buf[6] << 16) | ((uint32_t)buf[7] << 24);
+        crc = crc32tab8[7][lo & 0xff] ^
+              crc32tab8[6][(lo >> 8) & 0xff] ^
+              crc32tab8[5][(lo >> 16) & 0xff] ^
+              crc32tab8[4][lo >> 24] ^
+              crc32tab8[3][hi & 0xff] ^
+              crc32tab8[2][(hi >> 8) & 0xff] ^
+              crc32tab8[1][(hi >> 16) & 0xff] ^
+              crc32tab8[0][hi >> 24];
+        buf += 8;
+        len -= 8;
+    }
+
+    return crc32_bytewise(crc, buf, len);
+}
+
+#ifdef HAVE_CRC32_PCLMUL
+/*
+ * Carry-less multiplication folding, see "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction" (Intel, 2009). The
+ * constants are for the bit-reflected IEEE polynomial used above. Only
+ * whole 16 byte blocks are folded, the tail goes to slicing-by-8.
+ */
+__attribute__((target("sse2,pclmul")))
+static uint32_t crc32_pclmul(uint32_t crc, const unsigned char *buf,
+                             size_t len)
+{
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) =
+        { 0x0154442bd4ULL, 0x01c6e41596ULL };
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) =
+        { 0x01751997d0ULL, 0x00ccaa009eULL };
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) =
+        { 0x0163cd6124ULL, 0x0000000000ULL };
+    static const uint64_t poly[2] __attribute__((aligned(16))) =
+        { 0x01db710641ULL, 0x01f7011641ULL };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    if (len < 64) {
+        return crc32_slice8(crc, buf, len);
+    }
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    buf += 64;
+    len -= 64;
+
+    /* fold four 128 bit lanes in parallel */
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buf += 64;
+        len -= 64;
+    }
+
+    /* fold the four lanes into one */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* remaining whole 16 byte blocks */
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    /* 128 -> 64 bits */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    crc = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+
+    return crc32_slice8(crc, buf, len);
+}
+
+static int cpu_has_pclmul(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0) {
+        return 0;
+    }
+    return (ecx & bit_PCLMUL) != 0 && (edx & bit_SSE2) != 0;
+}
+#endif
+
+#ifdef HAVE_CRC32_ARMV8
+/*
+ * The ARMv8 CRC32 extension implements exactly this (IEEE) polynomial,
+ * so eight bytes are consumed per instruction. It is a mandatory part of
+ * ARMv8.1 and is only compiled in when the target guarantees it.
+ */
+static uint32_t crc32_armv8(uint32_t crc, const unsigned char *buf,
+                            size_t len)
+{
+    uint64_t word;
+
+    while (len >= 8) {
+        memcpy(&word, buf, sizeof(word));
+        crc = __crc32d(crc, word);
+        buf += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = __crc32b(crc, *buf);
+        ++buf;
+        --len;
+    }
+
+    return crc;
+}
+#endif
+
+static uint32_t crc32_resolve(uint32_t crc, const unsigned char *buf,
+                              size_t len);
+
+static crc32_kernel_t crc32_kernel = crc32_resolve;
+
+/*
+ * Build the slicing tables and pick the best kernel for this CPU. It is
+ * idempotent, so a race between the load-time constructor and a first
+ * caller only does the same work twice.
+ */
+static void crc32_init(void)
+{
+    uint32_t crc;
+    int n, k;
+
+    for (n = 0; n < 256; ++n) {
+        crc = crc32tab[n];
+        crc32tab8[0][n] = crc;
+        for (k = 1; k < 8; ++k) {
+            crc = (crc >> 8) ^ crc32tab[crc & 0xff];
+            crc32tab8[k][n] = crc;
+        }
+    }
+
+    /* crc is linear, so with a zero register only the flipped bit counts */
+    for (n = 0; n < 4 * HASH_CRC32_SUFFIX_LENGTH; ++n) {
+        unsigned char unit[HASH_CRC32_SUFFIX_LENGTH] = { 0 };
+        unit[n / 4] = (unsigned char)(1 << (n % 4));
+        crc32suffix[n] = crc32_bytewise(0, unit, sizeof(unit));
+    }
+
+#if defined(HAVE_CRC32_ARMV8)
+    crc32_kernel = crc32_armv8;
+#elif defined(HAVE_CRC32_PCLMUL)
+    crc32_kernel = cpu_has_pclmul() ? crc32_pclmul : crc32_slice8;
+#else
+    crc32_kernel = crc32_slice8;
+#endif
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((constructor))
+static void crc32_init_at_load(void)
+{
+    crc32_init();
+}
+#endif
+
+static uint32_t crc32_resolve(uint32_t crc, const unsigned char *buf,
+                              size_t len)
+{
+    crc32_init();
+    return crc32_kernel(crc, buf, len);
+}
+
+uint32_t hash_crc32_update(uint32_t crc, const char *key, size_t key_length)
+{
+    return crc32_kernel(crc, (const unsigned char *)key, key_length);
+}
+
 uint32_t hash_crc32(const char *key, size_t key_length)
 {
-    uint64_t x;
+    uint32_t crc= hash_crc32_update(UINT32_MAX, key, key_length);
+
+    return ((~crc) >> 16) & 0x7fff;
+}
+
+/*
+ * All 32 bits of the crc, rotated so that the low 15 bits are the value
+ * hash_crc32 returns. Maps of up to 32768 vbuckets therefore send every
+ * key to the same vbucket in both modes, larger maps get the extra bits.
+ */
+static uint32_t crc32_wide(uint32_t crc)
+{
+    crc = ~crc;
+    return (crc >> 16) | (crc << 16);
+}
+
+uint32_t hash_crc32_wide(const char *key, size_t key_length)
+{
+    return crc32_wide(hash_crc32_update(UINT32_MAX, key, key_length));
+}
+
+static uint32_t crc32_iov(const vbucket_iovec_t *iov, int niov)
+{
     uint32_t crc= UINT32_MAX;
+    int ii;
 
-    for (x= 0; x < key_length; x++)
-        crc= (crc >> 8) ^ crc32tab[(crc ^ (uint64_t)key[x]) & 0xff];
+    for (ii= 0; ii < niov; ii++)
+        crc= hash_crc32_update(crc, iov[ii].iov_base, iov[ii].iov_len);
 
-    return ((~crc) >> 16) & 0x7fff;
+    return crc;
+}
+
+uint32_t hash_crc32_iov(const vbucket_iovec_t *iov, int niov)
+{
+    return ((~crc32_iov(iov, niov)) >> 16) & 0x7fff;
+}
+
+uint32_t hash_crc32_wide_iov(const vbucket_iovec_t *iov, int niov)
+{
+    return crc32_wide(crc32_iov(iov, niov));
+}
+
+#define CRC32_LANES 4
+
+/*
+ * Slicing-by-8 over several keys in lock-step. The crc of one key is a
+ * serial chain of dependent lookups, running a few chains side by side
+ * lets the CPU overlap them.
+ */
+static void crc32_slice8_lanes(uint32_t *crc, const unsigned char **buf,
+                               size_t len)
+{
+    uint32_t lo, hi;
+    int ll;
+
+    while (len >= 8) {
+        for (ll = 0; ll < CRC32_LANES; ++ll) {
+            const unsigned char *p = buf[ll];
+            lo = crc[ll] ^ ((uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+                            ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+            hi = (uint32_t)p[4] | ((uint32_t)p[5] << 8) |
+                 ((uint32_t)p[6] << 16) | ((uint32_t)p[7] << 24);
+            crc[ll] = crc32tab8[7][lo & 0xff] ^
+                      crc32tab8[6][(lo >> 8) & 0xff] ^
+                      crc32tab8[5][(lo >> 16) & 0xff] ^
+                      crc32tab8[4][lo >> 24] ^
+                      crc32tab8[3][hi & 0xff] ^
+                      crc32tab8[2][(hi >> 8) & 0xff] ^
+                      crc32tab8[1][(hi >> 16) & 0xff] ^
+                      crc32tab8[0][hi >> 24];
+            buf[ll] = p + 8;
+        }
+        len -= 8;
+    }
+}
+
+static void crc32_multi(const char * const *keys, const size_t *key_lengths,
+                        size_t nkeys, uint32_t *result)
+{
+    const unsigned char *buf[CRC32_LANES];
+    uint32_t crc[CRC32_LANES];
+    size_t ii, common;
+    int ll;
+
+    if (crc32_kernel == crc32_resolve) {
+        crc32_init();
+    }
+
+    for (ii = 0; ii + CRC32_LANES <= nkeys; ii += CRC32_LANES) {
+        common = key_lengths[ii];
+        for (ll = 1; ll < CRC32_LANES; ++ll) {
+            if (key_lengths[ii + ll] < common) {
+                common = key_lengths[ii + ll];
+            }
+        }
+        common &= ~(size_t)7;
+#ifdef HAVE_CRC32_PCLMUL
+        /* folding is faster than any table walk once keys are long */
+        if (crc32_kernel == crc32_pclmul && common >= 64) {
+            common = 0;
+        }
+#endif
+#ifdef HAVE_CRC32_ARMV8
+        common = 0;
+#endif
+        for (ll = 0; ll < CRC32_LANES; ++ll) {
+            crc[ll] = UINT32_MAX;
+            buf[ll] = (const unsigned char *)keys[ii + ll];
+        }
+        crc32_slice8_lanes(crc, buf, common);
+        for (ll = 0; ll < CRC32_LANES; ++ll) {
+            result[ii + ll] = crc32_kernel(crc[ll], buf[ll],
+                                           key_lengths[ii + ll] - common);
+        }
+    }
+    for (; ii < nkeys; ++ii) {
+        result[ii] = hash_crc32_update(UINT32_MAX, keys[ii], key_lengths[ii]);
+    }
+}
+
+void hash_crc32_multi(const char * const *keys, const size_t *key_lengths,
+                      size_t nkeys, uint32_t *result)
+{
+    size_t ii;
+
+    crc32_multi(keys, key_lengths, nkeys, result);
+    for (ii = 0; ii < nkeys; ++ii) {
+        result[ii] = ((~result[ii]) >> 16) & 0x7fff;
+    }
+}
+
+void hash_crc32_wide_multi(const char * const *keys, const size_t *key_lengths,
+                           size_t nkeys, uint32_t *result)
+{
+    size_t ii;
+
+    crc32_multi(keys, key_lengths, nkeys, result);
+    for (ii = 0; ii < nkeys; ++ii) {
+        result[ii] = crc32_wide(result[ii]);
+    }
+}
+
+int hash_crc32_suffix(const char *key, size_t key_length,
+                      uint32_t mask, uint32_t value, char *suffix)
+{
+    /* one equation per constrained bit of the final crc: coefficients of
+     * the free suffix bits and the right hand side in the top bit */
+    uint64_t rows[32];
+    uint64_t row;
+    uint32_t crc, solution = 0;
+    int pivots[32];
+    int nrows = 0, bit, jj, ii, pivot;
+
+    if (crc32_kernel == crc32_resolve) {
+        crc32_init();
+    }
+
+    memset(suffix, CRC32_SUFFIX_BASE, HASH_CRC32_SUFFIX_LENGTH);
+    crc = ~crc32_kernel(crc32_kernel(UINT32_MAX, (const unsigned char *)key,
+                                     key_length),
+                        (const unsigned char *)suffix,
+                        HASH_CRC32_SUFFIX_LENGTH);
+
+    for (bit = 0; bit < 32; ++bit) {
+        if ((mask >> bit) & 1) {
+            row = (uint64_t)(((crc ^ value) >> bit) & 1) << 32;
+            for (jj = 0; jj < 4 * HASH_CRC32_SUFFIX_LENGTH; ++jj) {
+                row |= (uint64_t)((crc32suffix[jj] >> bit) & 1) << jj;
+            }
+            rows[nrows++] = row;
+        }
+    }
+
+    /* gauss-jordan elimination over GF(2), free variables stay zero */
+    for (ii = 0; ii < nrows; ++ii) {
+        for (pivot = 0; pivot < 32; ++pivot) {
+            if ((rows[ii] >> pivot) & 1) {
+                break;
+            }
+        }
+        pivots[ii] = pivot;
+        if (pivot == 32) {
+            if (rows[ii] >> 32) {
+                return -1;
+            }
+            continue;
+        }
+        for (jj = 0; jj < nrows; ++jj) {
+            if (jj != ii && ((rows[jj] >> pivot) & 1)) {
+                rows[jj] ^= rows[ii];
+            }
+        }
+    }
+    for (ii = 0; ii < nrows; ++ii) {
+        if (pivots[ii] < 32 && (rows[ii] >> 32)) {
+            solution |= (uint32_t)1 << pivots[ii];
+        }
+    }
+
+    for (jj = 0; jj < HASH_CRC32_SUFFIX_LENGTH; ++jj) {
+        suffix[jj] = (char)(CRC32_SUFFIX_BASE | ((solution >> (4 * jj)) & 0xf));
+    }
+    return 0;
 }
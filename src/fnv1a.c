@@ -0,0 +1,36 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* 32 bit FNV-1a hash, see http://www.isthe.com/chongo/tech/comp/fnv/ */
+
+#include "hash.h"
+
+#define FNV_32_INIT  2166136261UL
+#define FNV_32_PRIME 16777619UL
+
+static uint32_t fnv1a_update(uint32_t hash, const unsigned char *key,
+                             size_t key_length)
+{
+    size_t x;
+
+    for (x= 0; x < key_length; x++) {
+        hash ^= key[x];
+        hash *= FNV_32_PRIME;
+    }
+
+    return hash;
+}
+
+uint32_t hash_fnv1a(const char *key, size_t key_length)
+{
+    return fnv1a_update(FNV_32_INIT, (const unsigned char *)key, key_length);
+}
+
+uint32_t hash_fnv1a_iov(const vbucket_iovec_t *iov, int niov)
+{
+    uint32_t hash= FNV_32_INIT;
+    int ii;
+
+    for (ii= 0; ii < niov; ii++)
+        hash= fnv1a_update(hash, iov[ii].iov_base, iov[ii].iov_len);
+
+    return hash;
+}
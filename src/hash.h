@@ -20,10 +20,54 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <stdio.h>
+#include <libvbucket/vbucket.h>
+
+typedef struct {
+    uint32_t state[4];
+    uint64_t length;            /* bytes hashed so far */
+    unsigned char buffer[64];   /* incomplete block */
+} hash_md5_ctx_t;
+
+typedef uint32_t (*hash_key_fn)(const char *key, size_t key_length);
+typedef uint32_t (*hash_key_iov_fn)(const vbucket_iovec_t *iov, int niov);
 
 uint32_t hash_crc32(const char *key, size_t key_length);
+/* raw crc32 register update, start from UINT32_MAX and invert at the end */
+uint32_t hash_crc32_update(uint32_t crc, const char *key, size_t key_length);
+/* same as hash_crc32 for every key, but several keys are hashed at once */
+void hash_crc32_multi(const char * const *keys, const size_t *key_lengths,
+                      size_t nkeys, uint32_t *result);
+uint32_t hash_crc32_iov(const vbucket_iovec_t *iov, int niov);
+/* all 32 crc bits, the low 15 bits are the same as for hash_crc32 */
+uint32_t hash_crc32_wide(const char *key, size_t key_length);
+uint32_t hash_crc32_wide_iov(const vbucket_iovec_t *iov, int niov);
+void hash_crc32_wide_multi(const char * const *keys, const size_t *key_lengths,
+                           size_t nkeys, uint32_t *result);
+/*
+ * Pick HASH_CRC32_SUFFIX_LENGTH printable bytes so that the inverted crc
+ * of key followed by them has the bits of value wherever mask is set.
+ */
+#define HASH_CRC32_SUFFIX_LENGTH 8
+int hash_crc32_suffix(const char *key, size_t key_length,
+                      uint32_t mask, uint32_t value, char *suffix);
 uint32_t hash_ketama(const char *key, size_t key_length);
+uint32_t hash_ketama_iov(const vbucket_iovec_t *iov, int niov);
+void hash_ketama_multi(const char * const *keys, const size_t *key_lengths,
+                       size_t nkeys, uint32_t *result);
 void hash_md5(const char *key, size_t key_length, unsigned char *result);
+/* same as hash_md5 for every key, short keys are hashed four or eight at a time */
+void hash_md5_multi(const char * const *keys, const size_t *key_lengths,
+                    size_t nkeys, unsigned char (*result)[16]);
+uint32_t hash_fnv1a(const char *key, size_t key_length);
+uint32_t hash_fnv1a_iov(const vbucket_iovec_t *iov, int niov);
+uint32_t hash_murmur3(const char *key, size_t key_length);
+uint32_t hash_murmur3_iov(const vbucket_iovec_t *iov, int niov);
+
+/* streaming md5 with the context owned by the caller, no allocation */
+void hash_md5_ctx_init(hash_md5_ctx_t *ctx);
+void hash_md5_ctx_update(hash_md5_ctx_t *ctx, const char *key,
+                         size_t key_length);
+void hash_md5_ctx_final(hash_md5_ctx_t *ctx, unsigned char *result);
 
 void* hash_md5_update(void *ctx, const char *key, size_t key_length);
 void hash_md5_final(void *ctx, unsigned char *result);
@@ -0,0 +1,518 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "jsonsax.h"
+
+enum {
+    STATE_VALUE,            /* a value */
+    STATE_VALUE_OR_END,     /* a value or ']' after '[' */
+    STATE_KEY,              /* a key after ',' */
+    STATE_KEY_OR_END,       /* a key or '}' after '{' */
+    STATE_COLON,
+    STATE_NEXT,             /* ',' or the end of the container */
+    STATE_STRING,
+    STATE_ESCAPE,           /* after a backslash in a string */
+    STATE_UNICODE,          /* in the hex digits of a \u escape */
+    STATE_NUMBER,
+    STATE_LITERAL,
+    STATE_DONE,
+    STATE_ERROR
+};
+
+/* where a number is in -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)? */
+enum {
+    NUMBER_MINUS,
+    NUMBER_ZERO,
+    NUMBER_INTEGER,
+    NUMBER_DOT,
+    NUMBER_FRACTION,
+    NUMBER_E,
+    NUMBER_E_SIGN,
+    NUMBER_EXPONENT
+};
+
+#define skipping(sax) ((sax)->skip_depth >= 0)
+#define is_digit(c) ((c) >= '0' && (c) <= '9')
+
+void json_sax_init(json_sax_t *sax, const json_sax_callbacks_t *callbacks, void *ctx)
+{
+    memset(sax, 0, sizeof(json_sax_t));
+    sax->callbacks = callbacks;
+    sax->ctx = ctx;
+    sax->state = STATE_VALUE;
+    sax->skip_depth = -1;
+}
+
+void json_sax_destroy(json_sax_t *sax)
+{
+    free(sax->buf);
+    sax->buf = NULL;
+    sax->nbuf = sax->sbuf = 0;
+}
+
+/* append to the token, which always stays NUL terminated */
+static int append(json_sax_t *sax, const char *data, size_t n)
+{
+    if (sax->nbuf + n + 1 > sax->sbuf) {
+        size_t size = sax->sbuf ? sax->sbuf : 64;
+        char *buf;
+
+        while (size < sax->nbuf + n + 1) {
+            size *= 2;
+        }
+        buf = realloc(sax->buf, size);
+        if (buf == NULL) {
+            return -1;
+        }
+        sax->buf = buf;
+        sax->sbuf = size;
+    }
+    memcpy(sax->buf + sax->nbuf, data, n);
+    sax->nbuf += n;
+    sax->buf[sax->nbuf] = '\0';
+    return 0;
+}
+
+static int append_utf8(json_sax_t *sax, uint32_t code)
+{
+    char utf8[4];
+    size_t n;
+
+    if (code < 0x80) {
+        utf8[0] = (char)code;
+        n = 1;
+    } else if (code < 0x800) {
+        utf8[0] = (char)(0xc0 | (code >> 6));
+        utf8[1] = (char)(0x80 | (code & 0x3f));
+        n = 2;
+    } else if (code < 0x10000) {
+        utf8[0] = (char)(0xe0 | (code >> 12));
+        utf8[1] = (char)(0x80 | ((code >> 6) & 0x3f));
+        utf8[2] = (char)(0x80 | (code & 0x3f));
+        n = 3;
+    } else {
+        utf8[0] = (char)(0xf0 | (code >> 18));
+        utf8[1] = (char)(0x80 | ((code >> 12) & 0x3f));
+        utf8[2] = (char)(0x80 | ((code >> 6) & 0x3f));
+        utf8[3] = (char)(0x80 | (code & 0x3f));
+        n = 4;
+    }
+    return append(sax, utf8, n);
+}
+
+/* a value ended, skipping ends with the value it started at */
+static void value_end(json_sax_t *sax)
+{
+    if (sax->skip_depth == sax->depth) {
+        sax->skip_depth = -1;
+    }
+    sax->state = sax->depth == 0 ? STATE_DONE : STATE_NEXT;
+}
+
+static int open_container(json_sax_t *sax, char c)
+{
+    int rc = 0;
+
+    if (sax->depth == JSON_SAX_MAX_DEPTH) {
+        return -1;
+    }
+    if (!skipping(sax)) {
+        if (c == '{' && sax->callbacks->start_object) {
+            rc = sax->callbacks->start_object(sax->ctx);
+        } else if (c == '[' && sax->callbacks->start_array) {
+            rc = sax->callbacks->start_array(sax->ctx);
+        }
+        if (rc < 0) {
+            return -1;
+        }
+        if (rc == JSON_SAX_SKIP) {
+            sax->skip_depth = sax->depth;
+        }
+    }
+    sax->containers[sax->depth++] = c;
+    sax->state = c == '{' ? STATE_KEY_OR_END : STATE_VALUE_OR_END;
+    return 0;
+}
+
+static int close_container(json_sax_t *sax, char c)
+{
+    int rc = 0;
+
+    if (sax->containers[sax->depth - 1] != (c == '}' ? '{' : '[')) {
+        return -1;
+    }
+    --sax->depth;
+    if (!skipping(sax)) {
+        if (c == '}' && sax->callbacks->end_object) {
+            rc = sax->callbacks->end_object(sax->ctx);
+        } else if (c == ']' && sax->callbacks->end_array) {
+            rc = sax->callbacks->end_array(sax->ctx);
+        }
+        if (rc < 0) {
+            return -1;
+        }
+    }
+    value_end(sax);
+    return 0;
+}
+
+static int start_value(json_sax_t *sax, char c)
+{
+    switch (c) {
+    case '{':
+    case '[':
+        return open_container(sax, c);
+    case '"':
+        sax->is_key = 0;
+        sax->nbuf = 0;
+        sax->state = STATE_STRING;
+        return skipping(sax) ? 0 : append(sax, "", 0);
+    case 't':
+        sax->literal = "rue";
+        sax->literal_value = JSON_SAX_TRUE;
+        sax->state = STATE_LITERAL;
+        return 0;
+    case 'f':
+        sax->literal = "alse";
+        sax->literal_value = JSON_SAX_FALSE;
+        sax->state = STATE_LITERAL;
+        return 0;
+    case 'n':
+        sax->literal = "ull";
+        sax->literal_value = JSON_SAX_NULL;
+        sax->state = STATE_LITERAL;
+        return 0;
+    }
+    if (c != '-' && !is_digit(c)) {
+        return -1;
+    }
+    sax->negative = c == '-';
+    sax->mantissa = 0;
+    sax->ndigits = 0;
+    sax->nbuf = 0;
+    if (c == '-') {
+        sax->number_state = NUMBER_MINUS;
+    } else {
+        sax->number_state = c == '0' ? NUMBER_ZERO : NUMBER_INTEGER;
+        sax->mantissa = c - '0';
+        sax->ndigits = 1;
+    }
+    sax->state = STATE_NUMBER;
+    return skipping(sax) ? 0 : append(sax, &c, 1);
+}
+
+static int string_end(json_sax_t *sax)
+{
+    int rc = 0;
+
+    if (sax->high_surrogate) {
+        return -1;
+    }
+    if (sax->is_key) {
+        if (!skipping(sax) && sax->callbacks->key) {
+            rc = sax->callbacks->key(sax->ctx, sax->buf, sax->nbuf);
+            if (rc < 0) {
+                return -1;
+            }
+            if (rc == JSON_SAX_SKIP) {
+                sax->skip_depth = sax->depth;
+            }
+        }
+        sax->state = STATE_COLON;
+        return 0;
+    }
+    if (!skipping(sax) && sax->callbacks->string &&
+        sax->callbacks->string(sax->ctx, sax->buf, sax->nbuf) < 0) {
+        return -1;
+    }
+    value_end(sax);
+    return 0;
+}
+
+static int escape(json_sax_t *sax, char c)
+{
+    static const char from[] = "\"\\/bfnrt";
+    static const char to[] = "\"\\/\b\f\n\r\t";
+    const char *match;
+
+    if (c == 'u') {
+        sax->code = 0;
+        sax->ndigits = 0;
+        sax->state = STATE_UNICODE;
+        return 0;
+    }
+    match = c != '\0' ? strchr(from, c) : NULL;
+    if (match == NULL || sax->high_surrogate) {
+        return -1;
+    }
+    sax->state = STATE_STRING;
+    return skipping(sax) ? 0 : append(sax, to + (match - from), 1);
+}
+
+static int unicode_digit(json_sax_t *sax, char c)
+{
+    uint32_t code;
+
+    if (is_digit(c)) {
+        sax->code = sax->code * 16 + (c - '0');
+    } else if (c >= 'a' && c <= 'f') {
+        sax->code = sax->code * 16 + (c - 'a' + 10);
+    } else if (c >= 'A' && c <= 'F') {
+        sax->code = sax->code * 16 + (c - 'A' + 10);
+    } else {
+        return -1;
+    }
+    if (++sax->ndigits < 4) {
+        return 0;
+    }
+
+    sax->state = STATE_STRING;
+    code = sax->code;
+    if (sax->high_surrogate) {
+        if (code < 0xdc00 || code > 0xdfff) {
+            return -1;
+        }
+        code = 0x10000 + ((sax->high_surrogate - 0xd800) << 10) + (code - 0xdc00);
+        sax->high_surrogate = 0;
+    } else if (code >= 0xd800 && code <= 0xdbff) {
+        /* the low half must be the very next escape */
+        sax->high_surrogate = code;
+        return 0;
+    } else if (code >= 0xdc00 && code <= 0xdfff) {
+        return -1;
+    }
+    return skipping(sax) ? 0 : append_utf8(sax, code);
+}
+
+static int number_end(json_sax_t *sax)
+{
+    double value;
+
+    if (sax->number_state == NUMBER_MINUS || sax->number_state == NUMBER_DOT ||
+        sax->number_state == NUMBER_E || sax->number_state == NUMBER_E_SIGN) {
+        return -1;
+    }
+    if (!skipping(sax) && sax->callbacks->number) {
+        /* plain integers are exact in a double up to 15 digits */
+        if (sax->number_state <= NUMBER_INTEGER && sax->ndigits <= 15) {
+            value = (double)sax->mantissa;
+            if (sax->negative) {
+                value = -value;
+            }
+        } else {
+            value = strtod(sax->buf, NULL);
+        }
+        if (sax->callbacks->number(sax->ctx, value) < 0) {
+            return -1;
+        }
+    }
+    value_end(sax);
+    return 0;
+}
+
+/* returns 1 if c is part of the number, 0 if it ends it, -1 if invalid */
+static int number_char(json_sax_t *sax, char c)
+{
+    switch (sax->number_state) {
+    case NUMBER_MINUS:
+        if (!is_digit(c)) {
+            return -1;
+        }
+        sax->number_state = c == '0' ? NUMBER_ZERO : NUMBER_INTEGER;
+        sax->mantissa = c - '0';
+        sax->ndigits = 1;
+        return 1;
+    case NUMBER_ZERO:
+    case NUMBER_INTEGER:
+        if (is_digit(c)) {
+            if (sax->number_state == NUMBER_ZERO) {
+                return -1;
+            }
+            sax->mantissa = sax->mantissa * 10 + (c - '0');
+            ++sax->ndigits;
+            return 1;
+        }
+        /* fall through */
+    case NUMBER_FRACTION:
+        if (is_digit(c)) {
+            return 1;
+        }
+        if (c == '.' && sax->number_state != NUMBER_FRACTION) {
+            sax->number_state = NUMBER_DOT;
+            return 1;
+        }
+        if (c == 'e' || c == 'E') {
+            sax->number_state = NUMBER_E;
+            return 1;
+        }
+        return 0;
+    case NUMBER_DOT:
+        if (!is_digit(c)) {
+            return -1;
+        }
+        sax->number_state = NUMBER_FRACTION;
+        return 1;
+    case NUMBER_E:
+        if (c == '+' || c == '-') {
+            sax->number_state = NUMBER_E_SIGN;
+            return 1;
+        }
+        /* fall through */
+    case NUMBER_E_SIGN:
+        if (!is_digit(c)) {
+            return -1;
+        }
+        sax->number_state = NUMBER_EXPONENT;
+        return 1;
+    default:
+        return is_digit(c) ? 1 : 0;
+    }
+}
+
+int json_sax_feed(json_sax_t *sax, const char *data, size_t n, size_t *nused)
+{
+    const char *p = data, *end = data + n, *start;
+    int rc = 0;
+
+    while (p < end && rc == 0) {
+        char c = *p;
+
+        switch (sax->state) {
+        case STATE_STRING:
+            /* copy the plain run up to the next quote or escape at once */
+            start = p;
+            while (p < end && *p != '"' && *p != '\\') {
+                ++p;
+            }
+            if (p > start && sax->high_surrogate) {
+                rc = -1;
+            } else if (p > start && !skipping(sax)) {
+                rc = append(sax, start, p - start);
+            }
+            if (rc == 0 && p < end) {
+                if (*p == '"') {
+                    rc = string_end(sax);
+                } else {
+                    sax->state = STATE_ESCAPE;
+                }
+                ++p;
+            }
+            continue;
+        case STATE_ESCAPE:
+            rc = escape(sax, c);
+            break;
+        case STATE_UNICODE:
+            rc = unicode_digit(sax, c);
+            break;
+        case STATE_NUMBER:
+            rc = number_char(sax, c);
+            if (rc == 1) {
+                rc = skipping(sax) ? 0 : append(sax, &c, 1);
+                break;
+            }
+            if (rc == 0) {
+                /* the byte after the number is read in the next state */
+                rc = number_end(sax);
+            }
+            continue;
+        case STATE_LITERAL:
+            if (c != *sax->literal) {
+                rc = -1;
+            } else if (*++sax->literal == '\0') {
+                if (!skipping(sax) && sax->callbacks->literal &&
+                    sax->callbacks->literal(sax->ctx, sax->literal_value) < 0) {
+                    rc = -1;
+                } else {
+                    value_end(sax);
+                }
+            }
+            break;
+        case STATE_DONE:
+            *nused = p - data;
+            return 1;
+        case STATE_ERROR:
+            return -1;
+        default:
+            if ((unsigned char)c <= ' ') {
+                break;
+            }
+            switch (sax->state) {
+            case STATE_VALUE_OR_END:
+                if (c == ']') {
+                    rc = close_container(sax, c);
+                    break;
+                }
+                /* fall through */
+            case STATE_VALUE:
+                rc = start_value(sax, c);
+                break;
+            case STATE_KEY_OR_END:
+                if (c == '}') {
+                    rc = close_container(sax, c);
+                    break;
+                }
+                /* fall through */
+            case STATE_KEY:
+                if (c != '"') {
+                    rc = -1;
+                    break;
+                }
+                sax->is_key = 1;
+                sax->nbuf = 0;
+                sax->state = STATE_STRING;
+                rc = skipping(sax) ? 0 : append(sax, "", 0);
+                break;
+            case STATE_COLON:
+                if (c != ':') {
+                    rc = -1;
+                    break;
+                }
+                sax->state = STATE_VALUE;
+                break;
+            case STATE_NEXT:
+                if (c == ',') {
+                    sax->state = sax->containers[sax->depth - 1] == '{' ?
+                        STATE_KEY : STATE_VALUE;
+                } else if (c == '}' || c == ']') {
+                    rc = close_container(sax, c);
+                } else {
+                    rc = -1;
+                }
+                break;
+            }
+        }
+        ++p;
+    }
+
+    if (rc != 0) {
+        sax->state = STATE_ERROR;
+        return -1;
+    }
+    *nused = p - data;
+    return sax->state == STATE_DONE ? 1 : 0;
+}
+
+int json_sax_finish(json_sax_t *sax)
+{
+    /* a number is only known to end with the input */
+    if (sax->state == STATE_NUMBER && number_end(sax) != 0) {
+        sax->state = STATE_ERROR;
+    }
+    return sax->state == STATE_DONE ? 1 : -1;
+}
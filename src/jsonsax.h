@@ -0,0 +1,89 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef LIBVBUCKET_JSONSAX_H
+#define LIBVBUCKET_JSONSAX_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * An event driven JSON parser: it reports the tokens of a document to
+ * callbacks as it reads them, without building a tree. The input can be
+ * fed in pieces of any size.
+ */
+
+#define JSON_SAX_MAX_DEPTH 64
+
+/* return value of a callback to skip what it was called for */
+#define JSON_SAX_SKIP 1
+
+#define JSON_SAX_NULL 0
+#define JSON_SAX_FALSE 1
+#define JSON_SAX_TRUE 2
+
+/*
+ * A negative return value stops the parser. JSON_SAX_SKIP returned by
+ * key() skips the value of the key, by start_object() or start_array()
+ * the contents of the container and its end_object() or end_array(), so
+ * skipped values cost no callbacks and no copies of their strings.
+ * Strings are unescaped to UTF-8 and NUL terminated, they are only valid
+ * during the callback.
+ */
+typedef struct {
+    int (*start_object)(void *ctx);
+    int (*end_object)(void *ctx);
+    int (*start_array)(void *ctx);
+    int (*end_array)(void *ctx);
+    int (*key)(void *ctx, const char *key, size_t nkey);
+    int (*string)(void *ctx, const char *value, size_t nvalue);
+    int (*number)(void *ctx, double value);
+    int (*literal)(void *ctx, int literal);
+} json_sax_callbacks_t;
+
+typedef struct {
+    const json_sax_callbacks_t *callbacks;
+    void *ctx;
+    int state;                  /* what the parser expects next */
+    int depth;
+    char containers[JSON_SAX_MAX_DEPTH];    /* '{' or '[' of every level */
+    int skip_depth;             /* skipping until a value ends here, or -1 */
+    int is_key;                 /* the string is a key */
+    char *buf;                  /* string or number being read */
+    size_t nbuf;
+    size_t sbuf;
+    uint32_t code;              /* \u escape being read */
+    uint32_t high_surrogate;
+    int ndigits;
+    int number_state;
+    int negative;
+    uint64_t mantissa;          /* of plain integers, exact up to 15 digits */
+    const char *literal;        /* rest of true, false or null to match */
+    int literal_value;
+} json_sax_t;
+
+void json_sax_init(json_sax_t *sax, const json_sax_callbacks_t *callbacks, void *ctx);
+/*
+ * Parse the next n bytes. Returns 1 once a whole document is parsed,
+ * with *nused set to the bytes it took, 0 if it needs more data and -1
+ * on a syntax error or if a callback stopped the parser.
+ */
+int json_sax_feed(json_sax_t *sax, const char *data, size_t n, size_t *nused);
+/* end of input: returns 1 if the document is complete, -1 otherwise */
+int json_sax_finish(json_sax_t *sax);
+void json_sax_destroy(json_sax_t *sax);
+
+#endif
@@ -2,27 +2,15 @@
 #include <stdlib.h>
 #include "hash.h"
 
-/* This library uses the reference MD5 implementation from [RFC1321] */
-#define PROTOTYPES 1
-#include "rfc1321/md5c.c"
-#undef  PROTOTYPES
-
-void hash_md5(const char *key, size_t key_length, unsigned char *result)
-{
-    MD5_CTX ctx;
-
-    MD5Init(&ctx);
-    MD5Update(&ctx, (unsigned char *)key, key_length);
-    MD5Final(result, &ctx);
-}
+#define KETAMA_BATCH_SIZE 64
 
 void* hash_md5_update(void *ctx, const char *key, size_t key_length)
 {
     if (ctx == NULL) {
-        ctx = calloc(1, sizeof(MD5_CTX));
-        MD5Init(ctx);
+        ctx = calloc(1, sizeof(hash_md5_ctx_t));
+        hash_md5_ctx_init(ctx);
     }
-    MD5Update(ctx, (unsigned char *)key, key_length);
+    hash_md5_ctx_update(ctx, key, key_length);
     return ctx;
 }
 
@@ -31,18 +19,53 @@ void hash_md5_final(void *ctx, unsigned char *result)
     if (ctx == NULL) {
         return;
     }
-    MD5Final(result, ctx);
+    hash_md5_ctx_final(ctx, result);
     free(ctx);
 }
 
+static uint32_t ketama_point(const unsigned char *digest)
+{
+    return (uint32_t) ( (digest[3] << 24)
+                       |(digest[2] << 16)
+                       |(digest[1] << 8)
+                       | digest[0]);
+}
+
 uint32_t hash_ketama(const char *key, size_t key_length)
 {
     unsigned char digest[16];
 
     hash_md5(key, key_length, digest);
 
-    return (uint32_t) ( (digest[3] << 24)
-                       |(digest[2] << 16)
-                       |(digest[1] << 8)
-                       | digest[0]);
+    return ketama_point(digest);
+}
+
+uint32_t hash_ketama_iov(const vbucket_iovec_t *iov, int niov)
+{
+    unsigned char digest[16];
+    hash_md5_ctx_t ctx;
+    int ii;
+
+    hash_md5_ctx_init(&ctx);
+    for (ii = 0; ii < niov; ++ii) {
+        hash_md5_ctx_update(&ctx, iov[ii].iov_base, iov[ii].iov_len);
+    }
+    hash_md5_ctx_final(&ctx, digest);
+
+    return ketama_point(digest);
+}
+
+void hash_ketama_multi(const char * const *keys, const size_t *key_lengths,
+                       size_t nkeys, uint32_t *result)
+{
+    unsigned char digests[KETAMA_BATCH_SIZE][16];
+    size_t ii, jj, nbatch;
+
+    for (ii = 0; ii < nkeys; ii += nbatch) {
+        nbatch = nkeys - ii < KETAMA_BATCH_SIZE ? nkeys - ii : KETAMA_BATCH_SIZE;
+        hash_md5_multi(keys + ii, key_lengths + ii, nbatch, digests);
+        for (jj = 0; jj < nbatch; ++jj) {
+            result[ii + jj] = ketama_point(digests[jj]);
+        }
+    }
 }
@@ -0,0 +1,442 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * MD5 message digest as described in RFC 1321. The compression function
+ * is fully unrolled and reads little-endian words straight from the
+ * input. hash_md5_multi() runs independent messages through one vector
+ * compression function, four with SSE2 or eight with AVX2 when the CPU
+ * has it, which is what the ketama continuum build and batched key
+ * lookups need: lots of short strings.
+ */
+
+#include <string.h>
+#include "hash.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define HAVE_MD5_SSE2 1
+#include <emmintrin.h>
+#endif
+
+/* the AVX2 kernel is built for any x86 target and picked at run time */
+#if defined(HAVE_MD5_SSE2) && (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define HAVE_MD5_AVX2 1
+#include <immintrin.h>
+#endif
+
+/* longest message hash_md5_multi() pads itself, fits two blocks */
+#define MD5_MULTI_MAX_LENGTH (128 - 9)
+
+/* round functions as in RFC 1321 with fewer operations for F and G */
+#define MD5_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD5_G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define MD5_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5_I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+/* the 64 steps: round function, registers, message word, constant, shift */
+#define MD5_BODY(STEP, F, G, H, I) \
+    STEP(F, a, b, c, d,  0, 0xd76aa478,  7) \
+    STEP(F, d, a, b, c,  1, 0xe8c7b756, 12) \
+    STEP(F, c, d, a, b,  2, 0x242070db, 17) \
+    STEP(F, b, c, d, a,  3, 0xc1bdceee, 22) \
+    STEP(F, a, b, c, d,  4, 0xf57c0faf,  7) \
+    STEP(F, d, a, b, c,  5, 0x4787c62a, 12) \
+    STEP(F, c, d, a, b,  6, 0xa8304613, 17) \
+    STEP(F, b, c, d, a,  7, 0xfd469501, 22) \
+    STEP(F, a, b, c, d,  8, 0x698098d8,  7) \
+    STEP(F, d, a, b, c,  9, 0x8b44f7af, 12) \
+    STEP(F, c, d, a, b, 10, 0xffff5bb1, 17) \
+    STEP(F, b, c, d, a, 11, 0x895cd7be, 22) \
+    STEP(F, a, b, c, d, 12, 0x6b901122,  7) \
+    STEP(F, d, a, b, c, 13, 0xfd987193, 12) \
+    STEP(F, c, d, a, b, 14, 0xa679438e, 17) \
+    STEP(F, b, c, d, a, 15, 0x49b40821, 22) \
+    STEP(G, a, b, c, d,  1, 0xf61e2562,  5) \
+    STEP(G, d, a, b, c,  6, 0xc040b340,  9) \
+    STEP(G, c, d, a, b, 11, 0x265e5a51, 14) \
+    STEP(G, b, c, d, a,  0, 0xe9b6c7aa, 20) \
+    STEP(G, a, b, c, d,  5, 0xd62f105d,  5) \
+    STEP(G, d, a, b, c, 10, 0x02441453,  9) \
+    STEP(G, c, d, a, b, 15, 0xd8a1e681, 14) \
+    STEP(G, b, c, d, a,  4, 0xe7d3fbc8, 20) \
+    STEP(G, a, b, c, d,  9, 0x21e1cde6,  5) \
+    STEP(G, d, a, b, c, 14, 0xc33707d6,  9) \
+    STEP(G, c, d, a, b,  3, 0xf4d50d87, 14) \
+    STEP(G, b, c, d, a,  8, 0x455a14ed, 20) \
+    STEP(G, a, b, c, d, 13, 0xa9e3e905,  5) \
+    STEP(G, d, a, b, c,  2, 0xfcefa3f8,  9) \
+    STEP(G, c, d, a, b,  7, 0x676f02d9, 14) \
+    STEP(G, b, c, d, a, 12, 0x8d2a4c8a, 20) \
+    STEP(H, a, b, c, d,  5, 0xfffa3942,  4) \
+    STEP(H, d, a, b, c,  8, 0x8771f681, 11) \
+    STEP(H, c, d, a, b, 11, 0x6d9d6122, 16) \
+    STEP(H, b, c, d, a, 14, 0xfde5380c, 23) \
+    STEP(H, a, b, c, d,  1, 0xa4beea44,  4) \
+    STEP(H, d, a, b, c,  4, 0x4bdecfa9, 11) \
+    STEP(H, c, d, a, b,  7, 0xf6bb4b60, 16) \
+    STEP(H, b, c, d, a, 10, 0xbebfbc70, 23) \
+    STEP(H, a, b, c, d, 13, 0x289b7ec6,  4) \
+    STEP(H, d, a, b, c,  0, 0xeaa127fa, 11) \
+    STEP(H, c, d, a, b,  3, 0xd4ef3085, 16) \
+    STEP(H, b, c, d, a,  6, 0x04881d05, 23) \
+    STEP(H, a, b, c, d,  9, 0xd9d4d039,  4) \
+    STEP(H, d, a, b, c, 12, 0xe6db99e5, 11) \
+    STEP(H, c, d, a, b, 15, 0x1fa27cf8, 16) \
+    STEP(H, b, c, d, a,  2, 0xc4ac5665, 23) \
+    STEP(I, a, b, c, d,  0, 0xf4292244,  6) \
+    STEP(I, d, a, b, c,  7, 0x432aff97, 10) \
+    STEP(I, c, d, a, b, 14, 0xab9423a7, 15) \
+    STEP(I, b, c, d, a,  5, 0xfc93a039, 21) \
+    STEP(I, a, b, c, d, 12, 0x655b59c3,  6) \
+    STEP(I, d, a, b, c,  3, 0x8f0ccc92, 10) \
+    STEP(I, c, d, a, b, 10, 0xffeff47d, 15) \
+    STEP(I, b, c, d, a,  1, 0x85845dd1, 21) \
+    STEP(I, a, b, c, d,  8, 0x6fa87e4f,  6) \
+    STEP(I, d, a, b, c, 15, 0xfe2ce6e0, 10) \
+    STEP(I, c, d, a, b,  6, 0xa3014314, 15) \
+    STEP(I, b, c, d, a, 13, 0x4e0811a1, 21) \
+    STEP(I, a, b, c, d,  4, 0xf7537e82,  6) \
+    STEP(I, d, a, b, c, 11, 0xbd3af235, 10) \
+    STEP(I, c, d, a, b,  2, 0x2ad7d2bb, 15) \
+    STEP(I, b, c, d, a,  9, 0xeb86d391, 21)
+
+#define MD5_SCALAR_STEP(f, a, b, c, d, k, t, s) \
+    (a) += f((b), (c), (d)) + X[k] + (uint32_t)(t); \
+    (a) = ((a) << (s)) | ((a) >> (32 - (s))); \
+    (a) += (b);
+
+static uint32_t load_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void store_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static void md5_compress(uint32_t *state, const unsigned char *block,
+                         size_t nblocks)
+{
+    uint32_t X[16];
+    uint32_t a, b, c, d;
+    int ii;
+
+    while (nblocks-- > 0) {
+        for (ii = 0; ii < 16; ++ii) {
+            X[ii] = load_le32(block + ii * 4);
+        }
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+
+        MD5_BODY(MD5_SCALAR_STEP, MD5_F, MD5_G, MD5_H, MD5_I)
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        block += 64;
+    }
+}
+
+void hash_md5_ctx_init(hash_md5_ctx_t *ctx)
+{
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->length = 0;
+}
+
+void hash_md5_ctx_update(hash_md5_ctx_t *ctx, const char *key,
+                         size_t key_length)
+{
+    const unsigned char *input = (const unsigned char *)key;
+    size_t used = (size_t)(ctx->length & 63);
+    size_t nn;
+
+    ctx->length += key_length;
+
+    if (used > 0) {
+        nn = 64 - used;
+        if (key_length < nn) {
+            memcpy(ctx->buffer + used, input, key_length);
+            return;
+        }
+        memcpy(ctx->buffer + used, input, nn);
+        md5_compress(ctx->state, ctx->buffer, 1);
+        input += nn;
+        key_length -= nn;
+    }
+
+    md5_compress(ctx->state, input, key_length / 64);
+    input += key_length & ~(size_t)63;
+    key_length &= 63;
+    memcpy(ctx->buffer, input, key_length);
+}
+
+void hash_md5_ctx_final(hash_md5_ctx_t *ctx, unsigned char *result)
+{
+    size_t used = (size_t)(ctx->length & 63);
+    uint64_t bits = ctx->length << 3;
+    int ii;
+
+    ctx->buffer[used++] = 0x80;
+    if (used > 56) {
+        memset(ctx->buffer + used, 0, 64 - used);
+        md5_compress(ctx->state, ctx->buffer, 1);
+        used = 0;
+    }
+    memset(ctx->buffer + used, 0, 56 - used);
+    store_le32(ctx->buffer + 56, (uint32_t)bits);
+    store_le32(ctx->buffer + 60, (uint32_t)(bits >> 32));
+    md5_compress(ctx->state, ctx->buffer, 1);
+
+    for (ii = 0; ii < 4; ++ii) {
+        store_le32(result + ii * 4, ctx->state[ii]);
+    }
+}
+
+void hash_md5(const char *key, size_t key_length, unsigned char *result)
+{
+    hash_md5_ctx_t ctx;
+
+    hash_md5_ctx_init(&ctx);
+    hash_md5_ctx_update(&ctx, key, key_length);
+    hash_md5_ctx_final(&ctx, result);
+}
+
+#ifdef HAVE_MD5_SSE2
+/*
+ * Pad every message of at most MD5_MULTI_MAX_LENGTH bytes into its own
+ * two blocks. The second block of a message which needs only one is all
+ * zeros, it goes through the lanes but never into the state.
+ */
+static int md5_multi_pad(const char * const *keys, const size_t *key_lengths,
+                         int nlanes, unsigned char (*blocks)[128], int *nblocks)
+{
+    uint64_t bits;
+    int ll, maxblocks = 1;
+
+    for (ll = 0; ll < nlanes; ++ll) {
+        size_t len = key_lengths[ll];
+        nblocks[ll] = len + 9 > 64 ? 2 : 1;
+        if (nblocks[ll] > maxblocks) {
+            maxblocks = nblocks[ll];
+        }
+        memcpy(blocks[ll], keys[ll], len);
+        blocks[ll][len] = 0x80;
+        memset(blocks[ll] + len + 1, 0, 128 - len - 1);
+        bits = (uint64_t)len << 3;
+        store_le32(blocks[ll] + nblocks[ll] * 64 - 8, (uint32_t)bits);
+        store_le32(blocks[ll] + nblocks[ll] * 64 - 4, (uint32_t)(bits >> 32));
+    }
+    return maxblocks;
+}
+
+#define MD5_V_F(x, y, z) \
+    _mm_xor_si128((z), _mm_and_si128((x), _mm_xor_si128((y), (z))))
+#define MD5_V_G(x, y, z) \
+    _mm_xor_si128((y), _mm_and_si128((z), _mm_xor_si128((x), (y))))
+#define MD5_V_H(x, y, z) \
+    _mm_xor_si128(_mm_xor_si128((x), (y)), (z))
+#define MD5_V_I(x, y, z) \
+    _mm_xor_si128((y), _mm_or_si128((x), _mm_xor_si128((z), ones)))
+
+#define MD5_VECTOR_STEP(f, a, b, c, d, k, t, s) \
+    (a) = _mm_add_epi32(_mm_add_epi32((a), f((b), (c), (d))), \
+                        _mm_add_epi32(X[k], _mm_set1_epi32((int)(t)))); \
+    (a) = _mm_or_si128(_mm_slli_epi32((a), (s)), \
+                       _mm_srli_epi32((a), 32 - (s))); \
+    (a) = _mm_add_epi32((a), (b));
+
+/*
+ * Hash four messages of at most MD5_MULTI_MAX_LENGTH bytes, one per
+ * 32 bit lane. Lanes which need one block less keep their state by
+ * masking the second block's update.
+ */
+static void md5_multi4(const char * const *keys, const size_t *key_lengths,
+                       unsigned char (*result)[16])
+{
+    unsigned char blocks[4][128];
+    uint32_t out[4][4];
+    int nblocks[4];
+    const __m128i ones = _mm_set1_epi32(-1);
+    __m128i X[16];
+    __m128i state[4], keep;
+    __m128i a, b, c, d;
+    int ll, ii, bb, maxblocks;
+
+    maxblocks = md5_multi_pad(keys, key_lengths, 4, blocks, nblocks);
+
+    state[0] = _mm_set1_epi32(0x67452301);
+    state[1] = _mm_set1_epi32((int)0xefcdab89);
+    state[2] = _mm_set1_epi32((int)0x98badcfe);
+    state[3] = _mm_set1_epi32(0x10325476);
+
+    for (bb = 0; bb < maxblocks; ++bb) {
+        for (ii = 0; ii < 16; ++ii) {
+            X[ii] = _mm_set_epi32((int)load_le32(blocks[3] + bb * 64 + ii * 4),
+                                  (int)load_le32(blocks[2] + bb * 64 + ii * 4),
+                                  (int)load_le32(blocks[1] + bb * 64 + ii * 4),
+                                  (int)load_le32(blocks[0] + bb * 64 + ii * 4));
+        }
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+
+        MD5_BODY(MD5_VECTOR_STEP, MD5_V_F, MD5_V_G, MD5_V_H, MD5_V_I)
+
+        /* all-ones in the lanes whose message has this block */
+        keep = _mm_set_epi32(nblocks[3] > bb ? -1 : 0, nblocks[2] > bb ? -1 : 0,
+                             nblocks[1] > bb ? -1 : 0, nblocks[0] > bb ? -1 : 0);
+        state[0] = _mm_add_epi32(state[0], _mm_and_si128(a, keep));
+        state[1] = _mm_add_epi32(state[1], _mm_and_si128(b, keep));
+        state[2] = _mm_add_epi32(state[2], _mm_and_si128(c, keep));
+        state[3] = _mm_add_epi32(state[3], _mm_and_si128(d, keep));
+    }
+
+    for (ii = 0; ii < 4; ++ii) {
+        _mm_storeu_si128((__m128i *)out[ii], state[ii]);
+    }
+    for (ll = 0; ll < 4; ++ll) {
+        for (ii = 0; ii < 4; ++ii) {
+            store_le32(result[ll] + ii * 4, out[ii][ll]);
+        }
+    }
+}
+#endif
+
+#ifdef HAVE_MD5_AVX2
+#define MD5_Y_F(x, y, z) \
+    _mm256_xor_si256((z), _mm256_and_si256((x), _mm256_xor_si256((y), (z))))
+#define MD5_Y_G(x, y, z) \
+    _mm256_xor_si256((y), _mm256_and_si256((z), _mm256_xor_si256((x), (y))))
+#define MD5_Y_H(x, y, z) \
+    _mm256_xor_si256(_mm256_xor_si256((x), (y)), (z))
+#define MD5_Y_I(x, y, z) \
+    _mm256_xor_si256((y), _mm256_or_si256((x), _mm256_xor_si256((z), ones)))
+
+#define MD5_AVX2_STEP(f, a, b, c, d, k, t, s) \
+    (a) = _mm256_add_epi32(_mm256_add_epi32((a), f((b), (c), (d))), \
+                           _mm256_add_epi32(X[k], _mm256_set1_epi32((int)(t)))); \
+    (a) = _mm256_or_si256(_mm256_slli_epi32((a), (s)), \
+                          _mm256_srli_epi32((a), 32 - (s))); \
+    (a) = _mm256_add_epi32((a), (b));
+
+/* md5_multi4() with eight lanes, only called when the CPU has AVX2 */
+__attribute__((target("avx2")))
+static void md5_multi8(const char * const *keys, const size_t *key_lengths,
+                       unsigned char (*result)[16])
+{
+    unsigned char blocks[8][128];
+    uint32_t out[4][8];
+    int nblocks[8];
+    const __m256i ones = _mm256_set1_epi32(-1);
+    __m256i X[16];
+    __m256i state[4], keep;
+    __m256i a, b, c, d;
+    int ll, ii, bb, maxblocks;
+
+    maxblocks = md5_multi_pad(keys, key_lengths, 8, blocks, nblocks);
+
+    state[0] = _mm256_set1_epi32(0x67452301);
+    state[1] = _mm256_set1_epi32((int)0xefcdab89);
+    state[2] = _mm256_set1_epi32((int)0x98badcfe);
+    state[3] = _mm256_set1_epi32(0x10325476);
+
+    for (bb = 0; bb < maxblocks; ++bb) {
+        for (ii = 0; ii < 16; ++ii) {
+            X[ii] = _mm256_set_epi32((int)load_le32(blocks[7] + bb * 64 + ii * 4),
+                                     (int)load_le32(blocks[6] + bb * 64 + ii * 4),
+                                     (int)load_le32(blocks[5] + bb * 64 + ii * 4),
+                                     (int)load_le32(blocks[4] + bb * 64 + ii * 4),
+                                     (int)load_le32(blocks[3] + bb * 64 + ii * 4),
+                                     (int)load_le32(blocks[2] + bb * 64 + ii * 4),
+                                     (int)load_le32(blocks[1] + bb * 64 + ii * 4),
+                                     (int)load_le32(blocks[0] + bb * 64 + ii * 4));
+        }
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+
+        MD5_BODY(MD5_AVX2_STEP, MD5_Y_F, MD5_Y_G, MD5_Y_H, MD5_Y_I)
+
+        keep = _mm256_set_epi32(nblocks[7] > bb ? -1 : 0, nblocks[6] > bb ? -1 : 0,
+                                nblocks[5] > bb ? -1 : 0, nblocks[4] > bb ? -1 : 0,
+                                nblocks[3] > bb ? -1 : 0, nblocks[2] > bb ? -1 : 0,
+                                nblocks[1] > bb ? -1 : 0, nblocks[0] > bb ? -1 : 0);
+        state[0] = _mm256_add_epi32(state[0], _mm256_and_si256(a, keep));
+        state[1] = _mm256_add_epi32(state[1], _mm256_and_si256(b, keep));
+        state[2] = _mm256_add_epi32(state[2], _mm256_and_si256(c, keep));
+        state[3] = _mm256_add_epi32(state[3], _mm256_and_si256(d, keep));
+    }
+
+    for (ii = 0; ii < 4; ++ii) {
+        _mm256_storeu_si256((__m256i *)out[ii], state[ii]);
+    }
+    for (ll = 0; ll < 8; ++ll) {
+        for (ii = 0; ii < 4; ++ii) {
+            store_le32(result[ll] + ii * 4, out[ii][ll]);
+        }
+    }
+}
+#endif
+
+#ifdef HAVE_MD5_SSE2
+typedef void (*md5_multi_fn)(const char * const *keys, const size_t *key_lengths,
+                             unsigned char (*result)[16]);
+
+/*
+ * Hash the keys from ii on in groups of nlanes with a vector kernel, a
+ * group with a key too long for it goes one key at a time. Returns the
+ * index of the keys left over for a narrower kernel.
+ */
+static size_t md5_multi_groups(md5_multi_fn kernel, int nlanes,
+                               const char * const *keys, const size_t *key_lengths,
+                               size_t ii, size_t nkeys, unsigned char (*result)[16])
+{
+    int ll;
+
+    for (; ii + nlanes <= nkeys; ii += nlanes) {
+        for (ll = 0; ll < nlanes; ++ll) {
+            if (key_lengths[ii + ll] > MD5_MULTI_MAX_LENGTH) {
+                break;
+            }
+        }
+        if (ll == nlanes) {
+            kernel(keys + ii, key_lengths + ii, result + ii);
+        } else {
+            for (ll = 0; ll < nlanes; ++ll) {
+                hash_md5(keys[ii + ll], key_lengths[ii + ll], result[ii + ll]);
+            }
+        }
+    }
+    return ii;
+}
+#endif
+
+void hash_md5_multi(const char * const *keys, const size_t *key_lengths,
+                    size_t nkeys, unsigned char (*result)[16])
+{
+    size_t ii = 0;
+
+#ifdef HAVE_MD5_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        ii = md5_multi_groups(md5_multi8, 8, keys, key_lengths, ii, nkeys, result);
+    }
+#endif
+#ifdef HAVE_MD5_SSE2
+    ii = md5_multi_groups(md5_multi4, 4, keys, key_lengths, ii, nkeys, result);
+#endif
+    for (; ii < nkeys; ++ii) {
+        hash_md5(keys[ii], key_lengths[ii], result[ii]);
+    }
+}
@@ -0,0 +1,96 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* MurmurHash3 x86_32 with zero seed. MurmurHash3 was written by Austin
+ * Appleby and placed in the public domain.
+ */
+
+#include "hash.h"
+
+#define ROTL32(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+
+struct murmur3_st {
+    uint32_t hash;
+    uint32_t tail;      /* pending bytes which don't form a block yet */
+    size_t length;      /* total number of bytes seen */
+};
+
+static uint32_t murmur3_block(uint32_t k1)
+{
+    k1 *= 0xcc9e2d51;
+    k1 = ROTL32(k1, 15);
+    k1 *= 0x1b873593;
+    return k1;
+}
+
+static void murmur3_update(struct murmur3_st *st, const unsigned char *key,
+                           size_t key_length)
+{
+    uint32_t k1;
+
+    /* complete the block left over from the previous segment */
+    while ((st->length & 3) != 0 && key_length > 0) {
+        st->tail |= (uint32_t)*key << (8 * (st->length & 3));
+        ++st->length;
+        ++key;
+        --key_length;
+        if ((st->length & 3) == 0) {
+            st->hash ^= murmur3_block(st->tail);
+            st->hash = ROTL32(st->hash, 13);
+            st->hash = st->hash * 5 + 0xe6546b64;
+            st->tail = 0;
+        }
+    }
+
+    while (key_length >= 4) {
+        k1 = (uint32_t)key[0] | ((uint32_t)key[1] << 8) |
+             ((uint32_t)key[2] << 16) | ((uint32_t)key[3] << 24);
+        st->hash ^= murmur3_block(k1);
+        st->hash = ROTL32(st->hash, 13);
+        st->hash = st->hash * 5 + 0xe6546b64;
+        st->length += 4;
+        key += 4;
+        key_length -= 4;
+    }
+
+    while (key_length > 0) {
+        st->tail |= (uint32_t)*key << (8 * (st->length & 3));
+        ++st->length;
+        ++key;
+        --key_length;
+    }
+}
+
+static uint32_t murmur3_final(struct murmur3_st *st)
+{
+    uint32_t hash = st->hash;
+
+    if ((st->length & 3) != 0) {
+        hash ^= murmur3_block(st->tail);
+    }
+    hash ^= (uint32_t)st->length;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+uint32_t hash_murmur3(const char *key, size_t key_length)
+{
+    struct murmur3_st st = { 0, 0, 0 };
+
+    murmur3_update(&st, (const unsigned char *)key, key_length);
+    return murmur3_final(&st);
+}
+
+uint32_t hash_murmur3_iov(const vbucket_iovec_t *iov, int niov)
+{
+    struct murmur3_st st = { 0, 0, 0 };
+    int ii;
+
+    for (ii = 0; ii < niov; ++ii) {
+        murmur3_update(&st, iov[ii].iov_base, iov[ii].iov_len);
+    }
+    return murmur3_final(&st);
+}
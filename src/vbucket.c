@@ -15,20 +15,40 @@
  *   limitations under the License.
  */
 #include <assert.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <errno.h>
+#include <limits.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
-#include "cJSON.h"
 #include "hash.h"
+#include "jsonsax.h"
 #include <libvbucket/vbucket.h>
 
 #define MAX_CONFIG_SIZE 100 * 1048576
+#define READ_CHUNK_SIZE 65536
 #define MAX_VBUCKETS 65536
 #define MAX_REPLICAS 4
 #define MAX_AUTHORITY_SIZE 100
+#define MAP_BATCH_SIZE 64
+#define MAX_KEY_CACHE_SERVERS 0xffff
+#define CACHE_LINE_SIZE 64
+#define KEY_CACHE_STRIPES 64
+#define KETAMA_INDEX_MAX_BITS 24
+#define KETAMA_INDEX_AUTO_MAX_BITS 18
+#define KETAMA_INDEX_DIRECT 0x80000000U
+#define KETAMA_INDEX_SEARCH 0x7fffffffU
+#define KETAMA_INDEX_SCAN 8
+#define MAX_BUILD_THREADS 64
+#define MAX_KETAMA_FALLBACKS 8
+#define MAGLEV_MIN_ENTRIES_PER_SERVER 100
 #define STRINGIFY_(X) #X
 #define STRINGIFY(X) STRINGIFY_(X)
 
@@ -38,6 +58,7 @@ struct server_st {
     char *couchdb_api_base;
     int config_node;        /* non-zero if server struct describes node,
                                which is listening */
+    double weight;          /* capacity for ketama, 1 if not given */
 };
 
 struct vbucket_st {
@@ -49,6 +70,189 @@ struct continuum_item_st {
     uint32_t point;     /* point on the ketama continuum */
 };
 
+#if defined(__GNUC__) || defined(__clang__)
+#define prefetch(p) __builtin_prefetch(p)
+#else
+#define prefetch(p) ((void)0)
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define HAVE_ATOMICS 1
+#define atomic_load_64(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define atomic_store_64(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define atomic_incr_int(p) __atomic_fetch_add((p), 1, __ATOMIC_RELAXED)
+#define atomic_incr_64(p) __atomic_fetch_add((p), 1, __ATOMIC_RELAXED)
+#define atomic_or_64(p, v) __atomic_fetch_or((p), (v), __ATOMIC_RELAXED)
+#define atomic_and_64(p, v) __atomic_fetch_and((p), (v), __ATOMIC_RELAXED)
+#define atomic_load_int(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define atomic_add_int(p, v) __atomic_add_fetch((p), (v), __ATOMIC_RELAXED)
+#define atomic_load_acquire_64(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_store_release_64(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define atomic_cas_acquire_64(p, old, v) \
+    __atomic_compare_exchange_n((p), &(old), (v), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)
+#define atomic_fence_acquire() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#else
+/*
+ * Without compiler atomics the words ketama ejection and the key cache
+ * share between threads are only touched under one process wide lock,
+ * so both still work, just slower.
+ */
+#ifdef _WIN32
+#include <windows.h>
+static SRWLOCK shared_word_lock = SRWLOCK_INIT;
+#define lock_shared_words() AcquireSRWLockExclusive(&shared_word_lock)
+#define unlock_shared_words() ReleaseSRWLockExclusive(&shared_word_lock)
+#else
+static pthread_mutex_t shared_word_lock = PTHREAD_MUTEX_INITIALIZER;
+#define lock_shared_words() pthread_mutex_lock(&shared_word_lock)
+#define unlock_shared_words() pthread_mutex_unlock(&shared_word_lock)
+#endif
+
+static uint64_t atomic_load_64(const uint64_t *p)
+{
+    uint64_t v;
+
+    lock_shared_words();
+    v = *p;
+    unlock_shared_words();
+    return v;
+}
+
+static void atomic_store_64(uint64_t *p, uint64_t v)
+{
+    lock_shared_words();
+    *p = v;
+    unlock_shared_words();
+}
+
+static uint64_t atomic_incr_64(uint64_t *p)
+{
+    uint64_t old;
+
+    lock_shared_words();
+    old = (*p)++;
+    unlock_shared_words();
+    return old;
+}
+
+/* swaps in v if *p is *old, else sets *old to *p */
+static int atomic_cas_64(uint64_t *p, uint64_t *old, uint64_t v)
+{
+    int swapped;
+
+    lock_shared_words();
+    swapped = *p == *old;
+    if (swapped) {
+        *p = v;
+    } else {
+        *old = *p;
+    }
+    unlock_shared_words();
+    return swapped;
+}
+
+/* taking the lock orders memory like a full fence */
+static void atomic_fence(void)
+{
+    lock_shared_words();
+    unlock_shared_words();
+}
+
+#define atomic_load_acquire_64(p) atomic_load_64(p)
+#define atomic_store_release_64(p, v) atomic_store_64((p), (v))
+#define atomic_cas_acquire_64(p, old, v) atomic_cas_64((p), &(old), (v))
+#define atomic_fence_acquire() atomic_fence()
+
+static uint64_t atomic_or_64(uint64_t *p, uint64_t v)
+{
+    uint64_t old;
+
+    lock_shared_words();
+    old = *p;
+    *p = old | v;
+    unlock_shared_words();
+    return old;
+}
+
+static uint64_t atomic_and_64(uint64_t *p, uint64_t v)
+{
+    uint64_t old;
+
+    lock_shared_words();
+    old = *p;
+    *p = old & v;
+    unlock_shared_words();
+    return old;
+}
+
+static int atomic_load_int(const int *p)
+{
+    int v;
+
+    lock_shared_words();
+    v = *p;
+    unlock_shared_words();
+    return v;
+}
+
+static int atomic_add_int(int *p, int v)
+{
+    int sum;
+
+    lock_shared_words();
+    sum = *p += v;
+    unlock_shared_words();
+    return sum;
+}
+#endif
+
+/*
+ * Direct mapped cache of ketama lookups, picked by FNV-1a of the key. A
+ * slot is one cache line holding the key itself, so a hit is always the
+ * server the continuum gives, and the key's continuum hash, so ejected
+ * servers are skipped without hashing the key again. Keys longer than
+ * KEY_CACHE_MAX_KEY bytes aren't cached.
+ *
+ * Slots are shared without locks through a sequence number in the state
+ * word: a writer makes it odd, fills the slot and makes it even again,
+ * a reader only takes what it read between two equal even values. A
+ * writer which finds the slot being written leaves it alone.
+ *
+ *   state bits 63..32  sequence number
+ *   state bits 31..24  key length
+ *   state bits 15..0   server index + 1, so zero is empty
+ *
+ * The continuum is built while parsing, before a cache can be enabled,
+ * and never rebuilt, so entries don't go stale.
+ *
+ * Every thread counts its hits and misses in a stripe of its own cache
+ * line, picked round robin the first time it uses a cache, so threads
+ * don't bounce one line of counters between them. The counters are
+ * bumped with atomic adds, which keeps them exact when more than
+ * KEY_CACHE_STRIPES threads end up sharing stripes.
+ */
+struct key_cache_stats_st {
+    uint64_t hits;
+    uint64_t misses;
+    char pad[CACHE_LINE_SIZE - 2 * sizeof(uint64_t)];
+};
+
+#define KEY_CACHE_MAX_KEY 48
+
+struct key_cache_slot_st {
+    uint64_t state;
+    uint64_t digest;
+    uint64_t key[KEY_CACHE_MAX_KEY / 8];    /* zero padded */
+};
+
+struct key_cache_st {
+    void *slots_mem;                        /* backs the slots below */
+    struct key_cache_slot_st *slots;
+    uint32_t mask;
+    void *stats_mem;                        /* backs the stripes below */
+    struct key_cache_stats_st *stats;       /* KEY_CACHE_STRIPES of them */
+};
+
 struct vbucket_config_st {
     char *errmsg;
     VBUCKET_DISTRIBUTION_TYPE distribution;
@@ -60,11 +264,54 @@ struct vbucket_config_st {
     char *password;
     int num_continuum;                      /* count of continuum points */
     struct continuum_item_st *continuum;    /* ketama continuum */
+    void *search_mem;                   /* backs the two arrays below */
+    uint32_t *search_points;            /* continuum points, Eytzinger order */
+    uint32_t *search_servers;           /* their servers, [0] owns the wrap */
+    int32_t *search_fallbacks;          /* next distinct servers of a slot */
+    int ketama_fallbacks;               /* fallbacks kept for every point */
+    uint64_t *ejected;                  /* bit per server skipped by ketama */
+    int num_ejected;
+    uint32_t *maglev_table;             /* server of every maglev slot */
+    uint32_t maglev_size;               /* prime number of maglev slots */
+    uint32_t *ketama_index;             /* continuum slices by top digest bits */
+    int ketama_index_bits;              /* wanted size, -1 picks one, 0 is off */
+    int ketama_index_shift;
     struct server_st *servers;
     struct vbucket_st *fvbuckets;
     struct vbucket_st *vbuckets;
     const char *localhost;              /* replacement for $HOST placeholder */
+    VBUCKET_CONFIG_HANDLE previous;     /* config to reuse while parsing */
     size_t nlocalhost;
+    hash_key_fn hash;                   /* key hash used by the locator */
+    hash_key_iov_fn hash_iov;
+    struct key_cache_st *key_cache;     /* optional ketama lookup cache */
+    int build_threads;                  /* tasks of a continuum build */
+    vbucket_executor_fn build_executor; /* runs them, NULL for own threads */
+    void *build_cookie;
+    int64_t rev;                        /* "rev" of the config, -1 if none */
+    uint64_t fingerprint;               /* of the JSON it was parsed from */
+};
+
+/*
+ * Values of "hashAlgorithm" and the key hash they select for each
+ * locator, jump and maglev use the full 32 bit hashes like ketama. NULL
+ * means the algorithm can't be used with that locator.
+ */
+struct hash_algorithm_st {
+    const char *name;
+    hash_key_fn vbucket_hash;
+    hash_key_iov_fn vbucket_hash_iov;
+    hash_key_fn ketama_hash;
+    hash_key_iov_fn ketama_hash_iov;
+};
+
+static const struct hash_algorithm_st hash_algorithms[] = {
+    { "crc", hash_crc32, hash_crc32_iov, NULL, NULL },
+    { "crc-wide", hash_crc32_wide, hash_crc32_wide_iov, hash_crc32_wide, hash_crc32_wide_iov },
+    { "md5", NULL, NULL, hash_ketama, hash_ketama_iov },
+    { "fnv1a", hash_fnv1a, hash_fnv1a_iov, hash_fnv1a, hash_fnv1a_iov },
+    { "murmur3", hash_murmur3, hash_murmur3_iov, hash_murmur3, hash_murmur3_iov },
+    { NULL, NULL, NULL, NULL, NULL }
 };
 
 static char *errstr = NULL;
@@ -73,55 +320,636 @@ const char *vbucket_get_error() {
     return errstr;
 }
 
-static int continuum_item_cmp(const void *t1, const void *t2)
+/*
+ * Lay the sorted continuum out as an implicit binary search tree in
+ * breadth first (Eytzinger) order: the children of slot k are 2k and
+ * 2k + 1, so the top levels share a few cache lines and the 16 slots
+ * four levels below k are one cache line that can be prefetched.
+ */
+struct ketama_search_st {
+    void *mem;                  /* backs the arrays */
+    uint32_t *points;
+    uint32_t *servers;
+    int32_t *fallbacks;
+};
+
+static int eytzinger_fill(VBUCKET_CONFIG_HANDLE vb, const struct ketama_search_st *search,
+                          const struct continuum_item_st *sorted,
+                          const int32_t *fallbacks, int ii, int kk)
+{
+    int nf = vb->ketama_fallbacks;
+
+    if (kk <= vb->num_continuum) {
+        ii = eytzinger_fill(vb, search, sorted, fallbacks, ii, 2 * kk);
+        search->points[kk] = sorted[ii].point;
+        search->servers[kk] = sorted[ii].index;
+        if (fallbacks) {
+            memcpy(search->fallbacks + kk * nf, fallbacks + ii * nf,
+                   nf * sizeof(int32_t));
+        }
+        ii = eytzinger_fill(vb, search, sorted, fallbacks, ii + 1, 2 * kk + 1);
+    }
+    return ii;
+}
+
+/*
+ * For every point of the sorted continuum list the next distinct servers
+ * clockwise after its own, -1 when there are no more servers. The list
+ * of a point is its server followed by the list of the next point
+ * without that server, so walking the ring backwards builds them all;
+ * the second lap starts with the lists of the wrap around right.
+ */
+static int32_t *ketama_fallback_lists(VBUCKET_CONFIG_HANDLE vb)
 {
-    const struct continuum_item_st *ct1 = t1, *ct2 = t2;
+    int nf = vb->ketama_fallbacks, nn = vb->num_continuum;
+    int32_t *lists = malloc((size_t)nn * nf * sizeof(int32_t));
+    int32_t list[MAX_KETAMA_FALLBACKS + 1], next[MAX_KETAMA_FALLBACKS + 1];
+    int ii, jj, kk, lap;
 
-    if (ct1->point == ct2->point) {
-        return 0;
-    } else if (ct1->point > ct2->point) {
-        return 1;
+    if (lists == NULL) {
+        return NULL;
+    }
+    for (jj = 0; jj <= nf; ++jj) {
+        list[jj] = -1;
+    }
+    for (lap = 0; lap < 2; ++lap) {
+        for (ii = nn - 1; ii >= 0; --ii) {
+            int32_t server = (int32_t)vb->continuum[ii].index;
+            if (lap == 1) {
+                /* the list so far starts at the next point */
+                for (jj = 0, kk = 0; jj <= nf && kk < nf; ++jj) {
+                    if (list[jj] != server) {
+                        lists[ii * nf + kk++] = list[jj];
+                    }
+                }
+                while (kk < nf) {
+                    lists[ii * nf + kk++] = -1;
+                }
+            }
+            next[0] = server;
+            for (jj = 0, kk = 1; jj <= nf && kk <= nf; ++jj) {
+                if (list[jj] != server) {
+                    next[kk++] = list[jj];
+                }
+            }
+            while (kk <= nf) {
+                next[kk++] = -1;
+            }
+            memcpy(list, next, sizeof(list));
+        }
+    }
+    return lists;
+}
+
+/* build the search arrays aside, the old ones stay in place on failure */
+static int update_ketama_search(VBUCKET_CONFIG_HANDLE vb)
+{
+    struct ketama_search_st search;
+    size_t npoints = vb->num_continuum + 1;
+    int nf = vb->num_continuum > 0 ? vb->ketama_fallbacks : 0;
+    int32_t *fallbacks = NULL;
+
+    search.mem = malloc(CACHE_LINE_SIZE + npoints * (2 + nf) * sizeof(uint32_t));
+    if (search.mem == NULL ||
+        (nf > 0 && (fallbacks = ketama_fallback_lists(vb)) == NULL)) {
+        free(search.mem);
+        return -1;
+    }
+    search.points = (uint32_t *)(((uintptr_t)search.mem + CACHE_LINE_SIZE - 1) &
+                                 ~(uintptr_t)(CACHE_LINE_SIZE - 1));
+    search.servers = search.points + npoints;
+    search.fallbacks = NULL;
+    search.points[0] = 0;
+    /* slot 0 is where a search past the last point ends up */
+    search.servers[0] = vb->num_continuum > 0 ? vb->continuum[0].index : 0;
+    if (fallbacks) {
+        search.fallbacks = (int32_t *)(search.servers + npoints);
+        memcpy(search.fallbacks, fallbacks, nf * sizeof(int32_t));
+    }
+    eytzinger_fill(vb, &search, vb->continuum, fallbacks, 0, 1);
+    free(fallbacks);
+
+    free(vb->search_mem);
+    vb->search_mem = search.mem;
+    vb->search_points = search.points;
+    vb->search_servers = search.servers;
+    vb->search_fallbacks = search.fallbacks;
+    return 0;
+}
+
+/*
+ * Split the digest space into 2^bits slices by the top bits of the
+ * digest. An entry holds the server directly when the whole slice maps
+ * to one server, else the first continuum point a digest of the slice
+ * can land on, so a lookup only scans a few points from there. Slices
+ * with more points than that are left to the full search.
+ */
+static int update_ketama_index(VBUCKET_CONFIG_HANDLE vb)
+{
+    const struct continuum_item_st *continuum = vb->continuum;
+    uint32_t *index = NULL;
+    int bits = vb->ketama_index_bits, nn = vb->num_continuum;
+    int lo = 0, hi = 0, ii;
+    uint32_t last_server;
+    uint64_t ss, nslices;
+
+    if (bits < 0) {
+        /* about four slices per point, most of them direct */
+        bits = 8;
+        while (bits < KETAMA_INDEX_AUTO_MAX_BITS && (1 << bits) < 4 * nn) {
+            ++bits;
+        }
+    }
+    if (bits > 0 && nn > 0) {
+        nslices = (uint64_t)1 << bits;
+        index = malloc(nslices * sizeof(uint32_t));
+        if (index == NULL) {
+            return -1;
+        }
+        for (ss = 0; ss < nslices; ++ss) {
+            uint64_t last = ((ss + 1) << (32 - bits)) - 1;
+            while (lo < nn && continuum[lo].point < (ss << (32 - bits))) {
+                ++lo;
+            }
+            if (hi < lo) {
+                hi = lo;
+            }
+            while (hi < nn && continuum[hi].point < last) {
+                ++hi;
+            }
+            /* digests of the slice map to the points lo..hi, where nn
+             * wraps around to the first point */
+            if (hi - lo > KETAMA_INDEX_SCAN) {
+                index[ss] = KETAMA_INDEX_SEARCH;
+                continue;
+            }
+            last_server = continuum[hi < nn ? hi : 0].index;
+            index[ss] = KETAMA_INDEX_DIRECT | last_server;
+            for (ii = lo; ii < hi; ++ii) {
+                if (continuum[ii].index != last_server) {
+                    index[ss] = lo;
+                    break;
+                }
+            }
+        }
+    }
+    free(vb->ketama_index);
+    vb->ketama_index = index;
+    vb->ketama_index_shift = 32 - bits;
+    return 0;
+}
+
+/*
+ * Total weight of the servers, or zero when they all weigh the same and
+ * so keep the classic 40 hashes each.
+ */
+static double ketama_total_weight(VBUCKET_CONFIG_HANDLE vb)
+{
+    double total = 0;
+    int weighted = 0, ii;
+
+    for (ii = 0; ii < vb->num_servers; ++ii) {
+        total += vb->servers[ii].weight;
+        weighted |= vb->servers[ii].weight != vb->servers[0].weight;
+    }
+    return weighted ? total : 0;
+}
+
+/*
+ * Number of 4-point hashes of a server on the continuum: its share of 40
+ * per server, rounded down like libmemcached does.
+ */
+static int ketama_num_hashes(VBUCKET_CONFIG_HANDLE vb, int ss, double total)
+{
+    if (total == 0) {
+        return 40;
+    }
+    return (int)floor(vb->servers[ss].weight / total * 40 * vb->num_servers + 0.0000000001);
+}
+
+/* append the 4 * nhashes points of server ss */
+static struct continuum_item_st *
+ketama_server_points(VBUCKET_CONFIG_HANDLE vb, int ss, int nhashes,
+                     struct continuum_item_st *item)
+{
+    char host[40][MAX_AUTHORITY_SIZE+10];
+    const char *hosts[40];
+    size_t nhosts[40];
+    unsigned char digests[40][16];
+    int hh, nn, done;
+
+    /* 40 hashes at a time, 4 numbers per hash */
+    for (done = 0; done < nhashes; done += 40) {
+        int batch = nhashes - done < 40 ? nhashes - done : 40;
+        for (hh = 0; hh < batch; ++hh) {
+            nhosts[hh] = snprintf(host[hh], MAX_AUTHORITY_SIZE+10, "%s-%u",
+                                  vb->servers[ss].authority, done + hh);
+            hosts[hh] = host[hh];
+        }
+        hash_md5_multi(hosts, nhosts, batch, digests);
+        for (hh = 0; hh < batch; ++hh) {
+            unsigned char *digest = digests[hh];
+            for (nn = 0; nn < 4; ++nn, ++item) {
+                item->index = ss;
+                item->point = ((uint32_t) (digest[3 + nn * 4] & 0xFF) << 24)
+                            | ((uint32_t) (digest[2 + nn * 4] & 0xFF) << 16)
+                            | ((uint32_t) (digest[1 + nn * 4] & 0xFF) << 8)
+                            | (digest[0 + nn * 4] & 0xFF);
+            }
+        }
+    }
+    return item;
+}
+
+/*
+ * LSD radix sort by point, a byte per pass. It is stable, so points
+ * which collide stay in server order, whatever the C library's qsort
+ * would have done with them.
+ */
+static void sort_continuum(struct continuum_item_st *items,
+                           struct continuum_item_st *tmp, int nitems)
+{
+    size_t counts[4][256];
+    struct continuum_item_st *from = items, *to = tmp, *swap;
+    int ii, bb, shift;
+
+    memset(counts, 0, sizeof(counts));
+    for (ii = 0; ii < nitems; ++ii) {
+        for (bb = 0; bb < 4; ++bb) {
+            ++counts[bb][(items[ii].point >> (bb * 8)) & 0xff];
+        }
+    }
+    for (bb = 0, shift = 0; bb < 4; ++bb, shift += 8) {
+        size_t offset = 0, count;
+        for (ii = 0; ii < 256; ++ii) {
+            count = counts[bb][ii];
+            counts[bb][ii] = offset;
+            offset += count;
+        }
+        for (ii = 0; ii < nitems; ++ii) {
+            to[counts[bb][(from[ii].point >> shift) & 0xff]++] = from[ii];
+        }
+        swap = from;
+        from = to;
+        to = swap;
+    }
+    /* an even number of passes leaves the result in items */
+}
+
+/*
+ * Map the servers of the previous continuum to the servers of this one
+ * by authority, both lists are sorted by it. A server keeps its points
+ * only if it has the same number of hashes in both, -1 otherwise.
+ */
+static void ketama_reuse_servers(VBUCKET_CONFIG_HANDLE vb,
+                                 VBUCKET_CONFIG_HANDLE prev,
+                                 int *reuse, char *reused)
+{
+    double total = ketama_total_weight(vb), prev_total = ketama_total_weight(prev);
+    int ii = 0, jj = 0, cmp;
+
+    while (jj < prev->num_servers) {
+        reuse[jj] = -1;
+        cmp = ii < vb->num_servers ?
+            strcmp(vb->servers[ii].authority, prev->servers[jj].authority) : 1;
+        if (cmp < 0) {
+            ++ii;
+            continue;
+        }
+        if (cmp == 0 && ketama_num_hashes(vb, ii, total) ==
+                        ketama_num_hashes(prev, jj, prev_total)) {
+            reuse[jj] = ii;
+            reused[ii] = 1;
+        }
+        if (cmp == 0) {
+            ++ii;
+        }
+        ++jj;
+    }
+}
+
+/*
+ * A task of a continuum build: either hash the servers first..last-1 not
+ * reused and sort their points in items, or merge two sorted runs.
+ */
+struct build_task_st {
+    VBUCKET_CONFIG_HANDLE vb;
+    const char *reused;
+    double total;
+    int first, last;
+    struct continuum_item_st *items, *tmp;
+    int nitems;
+    const struct continuum_item_st *left, *right;
+    int nleft, nright;
+};
+
+static void hash_servers_task(void *arg)
+{
+    struct build_task_st *task = arg;
+    struct continuum_item_st *item = task->items;
+    int ss;
+
+    for (ss = task->first; ss < task->last; ++ss) {
+        if (!task->reused[ss]) {
+            item = ketama_server_points(task->vb, ss,
+                                        ketama_num_hashes(task->vb, ss, task->total),
+                                        item);
+        }
+    }
+    sort_continuum(task->items, task->tmp, task->nitems);
+}
+
+/* runs hold lower servers on the left, so ties take the left one */
+static void merge_runs_task(void *arg)
+{
+    struct build_task_st *task = arg;
+    const struct continuum_item_st *left = task->left, *right = task->right;
+    const struct continuum_item_st *left_end = left + task->nleft;
+    const struct continuum_item_st *right_end = right + task->nright;
+    struct continuum_item_st *out = task->items;
+
+    while (left < left_end && right < right_end) {
+        *out++ = right->point < left->point ? *right++ : *left++;
+    }
+    while (left < left_end) {
+        *out++ = *left++;
+    }
+    while (right < right_end) {
+        *out++ = *right++;
+    }
+}
+
+#ifndef _WIN32
+struct build_thread_st {
+    vbucket_task_fn fn;
+    void *arg;
+};
+
+static void *build_thread(void *arg)
+{
+    struct build_thread_st *thread = arg;
+    thread->fn(thread->arg);
+    return NULL;
+}
+#endif
+
+static void run_build_tasks(VBUCKET_CONFIG_HANDLE vb, vbucket_task_fn fn,
+                            struct build_task_st *tasks, int ntasks)
+{
+    void *args[MAX_BUILD_THREADS];
+#ifndef _WIN32
+    struct build_thread_st threads[MAX_BUILD_THREADS];
+    pthread_t tids[MAX_BUILD_THREADS];
+#endif
+    int ii;
+
+    if (ntasks == 1) {
+        fn(&tasks[0]);
+    } else if (vb->build_executor) {
+        for (ii = 0; ii < ntasks; ++ii) {
+            args[ii] = &tasks[ii];
+        }
+        vb->build_executor(vb->build_cookie, fn, args, ntasks);
     } else {
+#ifndef _WIN32
+        for (ii = 1; ii < ntasks; ++ii) {
+            threads[ii].fn = fn;
+            threads[ii].arg = &tasks[ii];
+            if (pthread_create(&tids[ii], NULL, build_thread, &threads[ii]) != 0) {
+                fn(&tasks[ii]);
+                tids[ii] = pthread_self();
+            }
+        }
+        fn(&tasks[0]);
+        for (ii = 1; ii < ntasks; ++ii) {
+            if (!pthread_equal(tids[ii], pthread_self())) {
+                pthread_join(tids[ii], NULL);
+            }
+        }
+#else
+        for (ii = 0; ii < ntasks; ++ii) {
+            fn(&tasks[ii]);
+        }
+#endif
+    }
+}
+
+/*
+ * Hash the servers which aren't reused into fresh and sort their points.
+ * Every task takes a range of servers with about the same number of
+ * points, then pairs of sorted runs are merged until one is left. The
+ * runs are in server order, so this is the order a single sort gives.
+ * Returns the sorted points, in fresh or in tmp.
+ */
+static struct continuum_item_st *
+build_fresh_points(VBUCKET_CONFIG_HANDLE vb, const char *reused, double total,
+                   struct continuum_item_st *fresh, struct continuum_item_st *tmp,
+                   int nfresh)
+{
+    struct build_task_st tasks[MAX_BUILD_THREADS];
+    struct continuum_item_st *from = fresh, *to = tmp, *swap;
+    int ntasks = vb->build_threads > 1 ? vb->build_threads : 1;
+    int offsets[MAX_BUILD_THREADS], lengths[MAX_BUILD_THREADS];
+    int tt, ss = 0, done = 0, nruns, nmerges;
+
+    if (ntasks > vb->num_servers) {
+        ntasks = vb->num_servers > 0 ? vb->num_servers : 1;
+    }
+    for (tt = 0; tt < ntasks; ++tt) {
+        int goal = (int)((int64_t)nfresh * (tt + 1) / ntasks);
+        memset(&tasks[tt], 0, sizeof(tasks[tt]));
+        tasks[tt].vb = vb;
+        tasks[tt].reused = reused;
+        tasks[tt].total = total;
+        tasks[tt].first = ss;
+        tasks[tt].items = fresh + done;
+        tasks[tt].tmp = tmp + done;
+        while (ss < vb->num_servers && (done < goal || tt == ntasks - 1)) {
+            if (!reused[ss]) {
+                done += 4 * ketama_num_hashes(vb, ss, total);
+            }
+            ++ss;
+        }
+        tasks[tt].last = ss;
+        tasks[tt].nitems = (int)(fresh + done - tasks[tt].items);
+    }
+    run_build_tasks(vb, hash_servers_task, tasks, ntasks);
+
+    /* the items of every task are a sorted run, merge them pairwise */
+    for (tt = 0; tt < ntasks; ++tt) {
+        offsets[tt] = (int)(tasks[tt].items - fresh);
+        lengths[tt] = tasks[tt].nitems;
+    }
+    for (nruns = ntasks; nruns > 1; nruns = nmerges) {
+        for (tt = 0, nmerges = 0; tt < nruns; tt += 2, ++nmerges) {
+            struct build_task_st *merge = &tasks[nmerges];
+            merge->left = from + offsets[tt];
+            merge->nleft = lengths[tt];
+            merge->right = from + offsets[tt] + lengths[tt];
+            merge->nright = tt + 1 < nruns ? lengths[tt + 1] : 0;
+            merge->items = to + offsets[tt];
+        }
+        run_build_tasks(vb, merge_runs_task, tasks, nmerges);
+        for (tt = 0; tt < nmerges; ++tt) {
+            offsets[tt] = offsets[2 * tt];
+            lengths[tt] = tasks[tt].nleft + tasks[tt].nright;
+        }
+        swap = from;
+        from = to;
+        to = swap;
+    }
+    return from;
+}
+
+/*
+ * Build the continuum of vb, which is the points of every server sorted
+ * by point and then by server. With a previous ketama config the points
+ * of servers it already had are taken from its continuum in one pass,
+ * and only the servers it didn't have are hashed and sorted.
+ */
+static int update_ketama_continuum(VBUCKET_CONFIG_HANDLE vb, VBUCKET_CONFIG_HANDLE prev)
+{
+    struct continuum_item_st *new_continuum, *fresh, *sorted;
+    double total = ketama_total_weight(vb);
+    int *reuse = NULL;
+    char *reused;
+    int ss, ii, jj, npoints, nfresh, pp;
+
+    if (prev && (prev->distribution != VBUCKET_DISTRIBUTION_KETAMA ||
+                 prev->continuum == NULL)) {
+        prev = NULL;
+    }
+    reused = calloc(vb->num_servers, sizeof(char));
+    if (prev) {
+        reuse = malloc(prev->num_servers * sizeof(int));
+    }
+    if (reused == NULL || (prev && reuse == NULL)) {
+        free(reused);
+        free(reuse);
+        return -1;
+    }
+    if (prev) {
+        ketama_reuse_servers(vb, prev, reuse, reused);
+    }
+
+    for (ss = 0, npoints = 0, nfresh = 0; ss < vb->num_servers; ++ss) {
+        npoints += 4 * ketama_num_hashes(vb, ss, total);
+        if (!reused[ss]) {
+            nfresh += 4 * ketama_num_hashes(vb, ss, total);
+        }
+    }
+    new_continuum = calloc(npoints + 1, sizeof(struct continuum_item_st));
+    fresh = malloc((2 * nfresh + 1) * sizeof(struct continuum_item_st));
+    if (new_continuum == NULL || fresh == NULL) {
+        free(new_continuum);
+        free(fresh);
+        free(reused);
+        free(reuse);
+        return -1;
+    }
+
+    sorted = build_fresh_points(vb, reused, total, fresh, fresh + nfresh, nfresh);
+
+    /* merge the kept points with the fresh ones, both are sorted */
+    for (ii = 0, jj = 0, pp = 0; pp < npoints; ++pp) {
+        while (prev && jj < prev->num_continuum &&
+               reuse[prev->continuum[jj].index] < 0) {
+            ++jj;
+        }
+        if (prev && jj < prev->num_continuum) {
+            struct continuum_item_st kept = prev->continuum[jj];
+            kept.index = reuse[kept.index];
+            if (ii == nfresh || kept.point < sorted[ii].point ||
+                (kept.point == sorted[ii].point && kept.index < sorted[ii].index)) {
+                new_continuum[pp] = kept;
+                ++jj;
+                continue;
+            }
+        }
+        new_continuum[pp] = sorted[ii++];
+    }
+    free(fresh);
+    free(reused);
+    free(reuse);
+
+    free(vb->continuum);
+    vb->continuum = new_continuum;
+    vb->num_continuum = npoints;
+    if (update_ketama_search(vb) != 0 || update_ketama_index(vb) != 0) {
         return -1;
     }
+    return 0;
 }
 
-static void update_ketama_continuum(VBUCKET_CONFIG_HANDLE vb)
+/*
+ * Fill the maglev lookup table: every server walks its own permutation
+ * of the slots, from an offset by a skip taken from the MD5 of its
+ * authority, and the servers take turns claiming the next free slot of
+ * their permutation until the table is full. Every server ends up with
+ * about the same number of slots, and a server change moves few slots.
+ */
+static int update_maglev_table(VBUCKET_CONFIG_HANDLE vb)
 {
-    char host[MAX_AUTHORITY_SIZE+10] = "";
-    int nhost;
-    int pp, hh, ss, nn;
+    static const uint32_t primes[] = {
+        65537, 131071, 262139, 524287, 1048573, 2097143, 4194301, 0
+    };
+    uint32_t size, filled, ii, *table, *next = NULL, *skip = NULL;
     unsigned char digest[16];
-    struct continuum_item_st *new_continuum, *old_continuum;
+    int ss;
 
-    new_continuum = calloc(160 * vb->num_servers,
-                           sizeof(struct continuum_item_st));
+    ii = 0;
+    while (primes[ii + 1] != 0 &&
+           primes[ii] < (uint32_t)vb->num_servers * MAGLEV_MIN_ENTRIES_PER_SERVER) {
+        ++ii;
+    }
+    size = primes[ii];
+    table = malloc(size * sizeof(uint32_t));
+    next = malloc(vb->num_servers * sizeof(uint32_t));
+    skip = malloc(vb->num_servers * sizeof(uint32_t));
+    if (table == NULL || next == NULL || skip == NULL) {
+        free(table);
+        free(next);
+        free(skip);
+        return -1;
+    }
 
-    /* 40 hashes, 4 numbers per hash = 160 points per server */
-    for (ss = 0, pp = 0; ss < vb->num_servers; ++ss) {
-        /* we can add more points to server which have more memory */
-        for (hh = 0; hh < 40; ++hh) {
-            nhost = snprintf(host, MAX_AUTHORITY_SIZE+10, "%s-%u",
-                             vb->servers[ss].authority, hh);
-            hash_md5(host, nhost, digest);
-            for (nn = 0; nn < 4; ++nn, ++pp) {
-                new_continuum[pp].index = ss;
-                new_continuum[pp].point = ((uint32_t) (digest[3 + nn * 4] & 0xFF) << 24)
-                                        | ((uint32_t) (digest[2 + nn * 4] & 0xFF) << 16)
-                                        | ((uint32_t) (digest[1 + nn * 4] & 0xFF) << 8)
-                                        | (digest[0 + nn * 4] & 0xFF);
+    for (ss = 0; ss < vb->num_servers; ++ss) {
+        hash_md5(vb->servers[ss].authority, strlen(vb->servers[ss].authority), digest);
+        next[ss] = (digest[0] | (digest[1] << 8) | (digest[2] << 16) |
+                    ((uint32_t)digest[3] << 24)) % size;
+        skip[ss] = (digest[4] | (digest[5] << 8) | (digest[6] << 16) |
+                    ((uint32_t)digest[7] << 24)) % (size - 1) + 1;
+    }
+    memset(table, 0xff, size * sizeof(uint32_t));
+    for (filled = 0; filled < size; ) {
+        for (ss = 0; ss < vb->num_servers && filled < size; ++ss) {
+            while (table[next[ss]] != 0xffffffff) {
+                next[ss] = (uint32_t)(((uint64_t)next[ss] + skip[ss]) % size);
             }
+            table[next[ss]] = ss;
+            ++filled;
         }
     }
+    free(next);
+    free(skip);
 
-    qsort(new_continuum, pp, sizeof(struct continuum_item_st), continuum_item_cmp);
+    free(vb->maglev_table);
+    vb->maglev_table = table;
+    vb->maglev_size = size;
+    return 0;
+}
 
-    old_continuum = vb->continuum;
-    vb->continuum = new_continuum;
-    vb->num_continuum = pp;
-    if (old_continuum) {
-        free(old_continuum);
+/* Lamping and Veach, "A Fast, Minimal Memory, Consistent Hash Algorithm" */
+static int jump_consistent_hash(uint64_t key, int num_buckets)
+{
+    int64_t b = -1, j = 0;
+
+    while (j < num_buckets) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (int64_t)((b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
     }
+    return (int)b;
 }
 
 void vbucket_config_destroy(VBUCKET_CONFIG_HANDLE vb) {
@@ -137,6 +965,15 @@ void vbucket_config_destroy(VBUCKET_CONFIG_HANDLE vb) {
     free(vb->fvbuckets);
     free(vb->vbuckets);
     free(vb->continuum);
+    free(vb->search_mem);
+    free(vb->ketama_index);
+    free(vb->maglev_table);
+    free(vb->ejected);
+    if (vb->key_cache) {
+        free(vb->key_cache->slots_mem);
+        free(vb->key_cache->stats_mem);
+        free(vb->key_cache);
+    }
     free(vb->errmsg);
     memset(vb, 0xff, sizeof(struct vbucket_config_st));
     free(vb);
@@ -150,7 +987,7 @@ static char *substitute_localhost_marker(struct vbucket_config_st *vb, char *inp
     if (vb->localhost && (placeholder = strstr(input, "$HOST"))) {
         size_t nprefix = placeholder - input;
         size_t off = 0;
-        result = calloc(ninput + vb->nlocalhost - 5, sizeof(char));
+        result = calloc(ninput + vb->nlocalhost - 5 + 1, sizeof(char));
         if (!result) {
             return NULL;
         }
@@ -164,560 +1001,2045 @@ static char *substitute_localhost_marker(struct vbucket_config_st *vb, char *inp
     return result;
 }
 
-static int populate_servers(struct vbucket_config_st *vb, cJSON *c) {
-    int i;
+/*
+ * Configs are read in a single pass by the event driven parser in
+ * jsonsax.c, without building a tree. The callbacks below keep only the
+ * fields of the schema as they go by: server ids are written straight
+ * into the vbucket maps and every other key is skipped unread. Once the
+ * document ends, the fields are checked in the same order as always.
+ */
 
-    vb->servers = calloc(vb->num_servers, sizeof(struct server_st));
-    if (vb->servers == NULL) {
-        vbucket_config_destroy(vb);
-        vb->errmsg = strdup("Failed to allocate servers array");
-        return -1;
+#define FIELD_MISSING 0
+#define FIELD_WRONG_TYPE 1
+#define FIELD_SET 2
+
+/* what an open container of the config is, bits so keys can list them */
+enum config_scope {
+    SCOPE_ROOT = 1,
+    SCOPE_ENVELOPE = 2,         /* "vBucketServerMap" */
+    SCOPE_SERVER_LIST = 4,
+    SCOPE_BUCKET_MAP = 8,
+    SCOPE_BUCKET_ROW = 16,
+    SCOPE_NODES = 32,
+    SCOPE_NODE = 64,
+    SCOPE_PORTS = 128
+};
+
+/* what a value is, taken from its key or from the array it is in */
+enum config_field {
+    FIELD_NONE,
+    FIELD_ROOT,
+    FIELD_NAME,
+    FIELD_PASSWORD,
+    FIELD_LOCATOR,
+    FIELD_NODES,
+    FIELD_ENVELOPE,
+    FIELD_HASH_ALGORITHM,
+    FIELD_NUM_REPLICAS,
+    FIELD_SERVER_LIST,
+    FIELD_VBUCKET_MAP,
+    FIELD_VBUCKET_MAP_FORWARD,
+    FIELD_SERVER,
+    FIELD_ROW,
+    FIELD_SERVER_ID,
+    FIELD_NODE,
+    FIELD_HOSTNAME,
+    FIELD_PORTS,
+    FIELD_DIRECT,
+    FIELD_COUCH_API_BASE,
+    FIELD_THIS_NODE,
+    FIELD_WEIGHT,
+    FIELD_REV
+};
+
+static const struct config_key_st {
+    int scopes;
+    const char *name;
+    int field;
+} config_keys[] = {
+    { SCOPE_ROOT, "rev", FIELD_REV },
+    { SCOPE_ROOT, "name", FIELD_NAME },
+    { SCOPE_ROOT, "saslPassword", FIELD_PASSWORD },
+    { SCOPE_ROOT, "nodeLocator", FIELD_LOCATOR },
+    { SCOPE_ROOT, "nodes", FIELD_NODES },
+    { SCOPE_ROOT, "vBucketServerMap", FIELD_ENVELOPE },
+    { SCOPE_ROOT | SCOPE_ENVELOPE, "hashAlgorithm", FIELD_HASH_ALGORITHM },
+    { SCOPE_ROOT | SCOPE_ENVELOPE, "numReplicas", FIELD_NUM_REPLICAS },
+    { SCOPE_ROOT | SCOPE_ENVELOPE, "serverList", FIELD_SERVER_LIST },
+    { SCOPE_ROOT | SCOPE_ENVELOPE, "vBucketMap", FIELD_VBUCKET_MAP },
+    { SCOPE_ROOT | SCOPE_ENVELOPE, "vBucketMapForward", FIELD_VBUCKET_MAP_FORWARD },
+    { SCOPE_NODE, "hostname", FIELD_HOSTNAME },
+    { SCOPE_NODE, "ports", FIELD_PORTS },
+    { SCOPE_NODE, "couchApiBase", FIELD_COUCH_API_BASE },
+    { SCOPE_NODE, "thisNode", FIELD_THIS_NODE },
+    { SCOPE_NODE, "weight", FIELD_WEIGHT },
+    { SCOPE_PORTS, "direct", FIELD_DIRECT },
+    { 0, NULL, FIELD_NONE }
+};
+
+/* a "vBucketMap" or "vBucketMapForward", checked once numReplicas is known */
+struct bucket_map_st {
+    int state;
+    struct vbucket_st *rows;
+    int num_rows;
+    int size;
+    int row_length;             /* of the row being read */
+    int min_length;
+    int max_length;
+    int bad_row;                /* a row that isn't an array */
+    int bad_id;                 /* a server id that isn't a number >= -1 */
+    int max_id;
+};
+
+/* the fields of a server map, at the top level or in the envelope */
+struct map_fields_st {
+    int hash_algorithm_state;
+    char *hash_algorithm;
+    int num_replicas_state;
+    int num_replicas;
+    int server_list_state;
+    int bad_server;             /* an item of serverList isn't a string */
+    char **servers;
+    int num_servers;
+    int size_servers;
+    struct bucket_map_st buckets[2];    /* vBucketMap, vBucketMapForward */
+};
+
+/* an item of "nodes" */
+struct node_fields_st {
+    int is_object;
+    int hostname_state;
+    char *hostname;
+    int ports_state;
+    int direct_state;
+    int direct;
+    char *couch_api_base;
+    int this_node;
+    int weight_state;
+    double weight;
+};
+
+#define CONFIG_MAX_DEPTH 4
+
+struct config_parser_st {
+    VBUCKET_CONFIG_HANDLE vb;
+    json_sax_t sax;
+    int depth;
+    struct {
+        int scope;
+        unsigned int seen;      /* fields read, the first of a key counts */
+    } frames[CONFIG_MAX_DEPTH];
+    int field;                  /* of the next value of an object */
+    struct map_fields_st *map;  /* the next map field belongs to */
+    struct bucket_map_st *buckets;  /* the open vbucket map */
+    struct map_fields_st top;
+    struct map_fields_st envelope;
+    int envelope_state;
+    int locator_state;
+    char *locator;
+    int nodes_state;
+    struct node_fields_st *nodes;
+    int num_nodes;
+    int size_nodes;
+    int nomem;
+    uint32_t crc;               /* of the bytes of the document so far */
+    size_t nbytes;
+};
+
+static int config_nomem(struct config_parser_st *p, const char *msg)
+{
+    if (!p->nomem) {
+        p->nomem = 1;
+        free(p->vb->errmsg);
+        p->vb->errmsg = strdup(msg);
     }
-    for (i = 0; i < vb->num_servers; ++i) {
-        char *server;
-        cJSON *jServer = cJSON_GetArrayItem(c, i);
-        if (jServer == NULL || jServer->type != cJSON_String) {
-            vb->errmsg = strdup("Expected array of strings for serverList");
-            return -1;
-        }
-        server = strdup(jServer->valuestring);
-        if (server == NULL) {
-            vb->errmsg = strdup("Failed to allocate storage for server string");
+    return -1;
+}
+
+/* grow an array of items of the given size to hold one more */
+static int grow(void **items, int *size, int count, size_t item_size)
+{
+    void *grown;
+    int new_size;
+
+    if (count < *size) {
+        return 0;
+    }
+    new_size = *size ? *size * 2 : 16;
+    grown = realloc(*items, new_size * item_size);
+    if (grown == NULL) {
+        return -1;
+    }
+    *items = grown;
+    *size = new_size;
+    return 0;
+}
+
+static int value_field(struct config_parser_st *p)
+{
+    if (p->depth == 0) {
+        return FIELD_ROOT;
+    }
+    switch (p->frames[p->depth - 1].scope) {
+    case SCOPE_SERVER_LIST:
+        return FIELD_SERVER;
+    case SCOPE_BUCKET_MAP:
+        return FIELD_ROW;
+    case SCOPE_BUCKET_ROW:
+        return FIELD_SERVER_ID;
+    case SCOPE_NODES:
+        return FIELD_NODE;
+    default:
+        return p->field;
+    }
+}
+
+static struct node_fields_st *current_node(struct config_parser_st *p)
+{
+    return p->nodes + p->num_nodes - 1;
+}
+
+static int push_scope(struct config_parser_st *p, int scope)
+{
+    p->frames[p->depth].scope = scope;
+    p->frames[p->depth].seen = 0;
+    ++p->depth;
+    return 0;
+}
+
+static int add_node(struct config_parser_st *p, int is_object)
+{
+    if (grow((void **)&p->nodes, &p->size_nodes, p->num_nodes,
+             sizeof(struct node_fields_st)) != 0) {
+        return config_nomem(p, "Failed to allocate storage for nodes");
+    }
+    memset(p->nodes + p->num_nodes, 0, sizeof(struct node_fields_st));
+    p->nodes[p->num_nodes++].is_object = is_object;
+    return 0;
+}
+
+static int add_row(struct config_parser_st *p)
+{
+    struct bucket_map_st *b = p->buckets;
+
+    if (grow((void **)&b->rows, &b->size, b->num_rows, sizeof(struct vbucket_st)) != 0) {
+        return config_nomem(p, "Failed to allocate storage for vbucket map");
+    }
+    memset(b->rows + b->num_rows, 0, sizeof(struct vbucket_st));
+    ++b->num_rows;
+    b->row_length = 0;
+    return 0;
+}
+
+/* a value of an unexpected type, remember it for the error it causes */
+static int wrong_type(struct config_parser_st *p, int field)
+{
+    switch (field) {
+    case FIELD_ENVELOPE:
+        p->envelope_state = FIELD_WRONG_TYPE;
+        break;
+    case FIELD_LOCATOR:
+        p->locator_state = FIELD_WRONG_TYPE;
+        break;
+    case FIELD_NODES:
+        p->nodes_state = FIELD_WRONG_TYPE;
+        break;
+    case FIELD_HASH_ALGORITHM:
+        p->map->hash_algorithm_state = FIELD_WRONG_TYPE;
+        break;
+    case FIELD_NUM_REPLICAS:
+        p->map->num_replicas_state = FIELD_WRONG_TYPE;
+        break;
+    case FIELD_SERVER_LIST:
+        p->map->server_list_state = FIELD_WRONG_TYPE;
+        break;
+    case FIELD_VBUCKET_MAP:
+        p->map->buckets[0].state = FIELD_WRONG_TYPE;
+        break;
+    case FIELD_VBUCKET_MAP_FORWARD:
+        p->map->buckets[1].state = FIELD_WRONG_TYPE;
+        break;
+    case FIELD_SERVER:
+        /* still counts for the size of the list */
+        if (grow((void **)&p->map->servers, &p->map->size_servers,
+                 p->map->num_servers, sizeof(char *)) != 0) {
+            return config_nomem(p, "Failed to allocate servers array");
+        }
+        p->map->servers[p->map->num_servers++] = NULL;
+        p->map->bad_server = 1;
+        break;
+    case FIELD_ROW:
+        if (add_row(p) != 0) {
+            return -1;
+        }
+        p->buckets->bad_row = 1;
+        break;
+    case FIELD_SERVER_ID:
+        p->buckets->bad_id = 1;
+        ++p->buckets->row_length;
+        break;
+    case FIELD_NODE:
+        return add_node(p, 0);
+    case FIELD_HOSTNAME:
+        current_node(p)->hostname_state = FIELD_WRONG_TYPE;
+        break;
+    case FIELD_PORTS:
+        current_node(p)->ports_state = FIELD_WRONG_TYPE;
+        break;
+    case FIELD_DIRECT:
+        current_node(p)->direct_state = FIELD_WRONG_TYPE;
+        break;
+    case FIELD_WEIGHT:
+        current_node(p)->weight_state = FIELD_WRONG_TYPE;
+        break;
+    }
+    /* anything else of the wrong type is ignored */
+    return 0;
+}
+
+static int config_start_object(void *ctx)
+{
+    struct config_parser_st *p = ctx;
+    int field = value_field(p);
+
+    switch (field) {
+    case FIELD_ROOT:
+        return push_scope(p, SCOPE_ROOT);
+    case FIELD_ENVELOPE:
+        p->envelope_state = FIELD_SET;
+        return push_scope(p, SCOPE_ENVELOPE);
+    case FIELD_NODE:
+        if (add_node(p, 1) != 0) {
+            return -1;
+        }
+        return push_scope(p, SCOPE_NODE);
+    case FIELD_PORTS:
+        current_node(p)->ports_state = FIELD_SET;
+        return push_scope(p, SCOPE_PORTS);
+    }
+    return wrong_type(p, field) != 0 ? -1 : JSON_SAX_SKIP;
+}
+
+static int config_start_array(void *ctx)
+{
+    struct config_parser_st *p = ctx;
+    int field = value_field(p);
+
+    switch (field) {
+    case FIELD_NODES:
+        p->nodes_state = FIELD_SET;
+        return push_scope(p, SCOPE_NODES);
+    case FIELD_SERVER_LIST:
+        p->map->server_list_state = FIELD_SET;
+        return push_scope(p, SCOPE_SERVER_LIST);
+    case FIELD_VBUCKET_MAP:
+    case FIELD_VBUCKET_MAP_FORWARD:
+        p->buckets = &p->map->buckets[field == FIELD_VBUCKET_MAP ? 0 : 1];
+        p->buckets->state = FIELD_SET;
+        p->buckets->min_length = MAX_REPLICAS + 2;
+        p->buckets->max_length = -1;
+        p->buckets->max_id = -1;
+        return push_scope(p, SCOPE_BUCKET_MAP);
+    case FIELD_ROW:
+        if (add_row(p) != 0) {
+            return -1;
+        }
+        return push_scope(p, SCOPE_BUCKET_ROW);
+    }
+    return wrong_type(p, field) != 0 ? -1 : JSON_SAX_SKIP;
+}
+
+static int config_end_container(void *ctx)
+{
+    struct config_parser_st *p = ctx;
+    struct bucket_map_st *b = p->buckets;
+
+    if (p->frames[--p->depth].scope == SCOPE_BUCKET_ROW) {
+        if (b->row_length < b->min_length) {
+            b->min_length = b->row_length;
+        }
+        if (b->row_length > b->max_length) {
+            b->max_length = b->row_length;
+        }
+    }
+    return 0;
+}
+
+static int config_key(void *ctx, const char *key, size_t nkey)
+{
+    struct config_parser_st *p = ctx;
+    const struct config_key_st *k;
+    int scope = p->frames[p->depth - 1].scope;
+
+    for (k = config_keys; k->name != NULL; ++k) {
+        /* cJSON_GetObjectItem() matched keys ignoring case, the length
+         * check keeps keys with an escaped NUL from matching */
+        if ((k->scopes & scope) && strlen(k->name) == nkey &&
+            strcasecmp(k->name, key) == 0) {
+            break;
+        }
+    }
+    if (k->name == NULL || (p->frames[p->depth - 1].seen & (1U << k->field))) {
+        return JSON_SAX_SKIP;
+    }
+    p->frames[p->depth - 1].seen |= 1U << k->field;
+    p->field = k->field;
+    if (scope == SCOPE_ROOT) {
+        p->map = &p->top;
+    } else if (scope == SCOPE_ENVELOPE) {
+        p->map = &p->envelope;
+    }
+    return 0;
+}
+
+static int config_string(void *ctx, const char *value, size_t nvalue)
+{
+    struct config_parser_st *p = ctx;
+    VBUCKET_CONFIG_HANDLE vb = p->vb;
+    int field = value_field(p);
+    char *copy;
+
+    switch (field) {
+    case FIELD_NAME:
+        if (strcmp(value, "default") == 0) {
+            return 0;
+        }
+        break;
+    case FIELD_PASSWORD:
+    case FIELD_LOCATOR:
+    case FIELD_HASH_ALGORITHM:
+    case FIELD_SERVER:
+    case FIELD_HOSTNAME:
+    case FIELD_COUCH_API_BASE:
+        break;
+    default:
+        return wrong_type(p, field);
+    }
+
+    copy = malloc(nvalue + 1);
+    if (copy == NULL) {
+        return config_nomem(p, "Failed to allocate storage for string");
+    }
+    memcpy(copy, value, nvalue + 1);
+    switch (field) {
+    case FIELD_NAME:
+        vb->user = copy;
+        break;
+    case FIELD_PASSWORD:
+        vb->password = copy;
+        break;
+    case FIELD_LOCATOR:
+        p->locator_state = FIELD_SET;
+        p->locator = copy;
+        break;
+    case FIELD_HASH_ALGORITHM:
+        p->map->hash_algorithm_state = FIELD_SET;
+        p->map->hash_algorithm = copy;
+        break;
+    case FIELD_SERVER:
+        copy = substitute_localhost_marker(vb, copy);
+        if (copy == NULL) {
+            return config_nomem(p, "Failed to allocate storage for server string during $HOST substitution");
+        }
+        if (grow((void **)&p->map->servers, &p->map->size_servers,
+                 p->map->num_servers, sizeof(char *)) != 0) {
+            free(copy);
+            return config_nomem(p, "Failed to allocate servers array");
+        }
+        p->map->servers[p->map->num_servers++] = copy;
+        break;
+    case FIELD_HOSTNAME:
+        current_node(p)->hostname_state = FIELD_SET;
+        current_node(p)->hostname = copy;
+        break;
+    case FIELD_COUCH_API_BASE:
+        current_node(p)->couch_api_base = copy;
+        break;
+    }
+    return 0;
+}
+
+static int config_number(void *ctx, double value)
+{
+    struct config_parser_st *p = ctx;
+    struct bucket_map_st *b = p->buckets;
+    int field = value_field(p);
+    /* casting a number out of the range of int is undefined */
+    int in_range = value >= INT_MIN && value <= INT_MAX;
+    int id;
+
+    if (!in_range && (field == FIELD_NUM_REPLICAS || field == FIELD_DIRECT)) {
+        return wrong_type(p, field);
+    }
+    switch (field) {
+    case FIELD_SERVER_ID:
+        /* an id out of range is reported like any id < -1 */
+        id = in_range ? (int)value : -2;
+        if (b->row_length <= MAX_REPLICAS) {
+            b->rows[b->num_rows - 1].servers[b->row_length] = id;
+        }
+        ++b->row_length;
+        if (id < -1) {
+            b->bad_id = 1;
+        } else if (id > b->max_id) {
+            b->max_id = id;
+        }
+        return 0;
+    case FIELD_NUM_REPLICAS:
+        p->map->num_replicas_state = FIELD_SET;
+        p->map->num_replicas = (int)value;
+        return 0;
+    case FIELD_DIRECT:
+        current_node(p)->direct_state = FIELD_SET;
+        current_node(p)->direct = (int)value;
+        return 0;
+    case FIELD_WEIGHT:
+        current_node(p)->weight_state = FIELD_SET;
+        current_node(p)->weight = value;
+        return 0;
+    case FIELD_REV:
+        if (value >= 0 && value < 9e18) {
+            p->vb->rev = (int64_t)value;
+        }
+        return 0;
+    }
+    return wrong_type(p, field);
+}
+
+static int config_literal(void *ctx, int literal)
+{
+    struct config_parser_st *p = ctx;
+    int field = value_field(p);
+
+    if (field == FIELD_THIS_NODE) {
+        current_node(p)->this_node = literal == JSON_SAX_TRUE;
+        return 0;
+    }
+    return wrong_type(p, field);
+}
+
+static const json_sax_callbacks_t config_callbacks = {
+    config_start_object,
+    config_end_container,
+    config_start_array,
+    config_end_container,
+    config_key,
+    config_string,
+    config_number,
+    config_literal
+};
+
+static void config_parser_init(struct config_parser_st *p, VBUCKET_CONFIG_HANDLE vb)
+{
+    memset(p, 0, sizeof(struct config_parser_st));
+    p->vb = vb;
+    p->map = &p->top;
+    p->crc = UINT32_MAX;
+    json_sax_init(&p->sax, &config_callbacks, p);
+}
+
+/* hash the next bytes of the document for its fingerprint */
+static void config_parser_hash(struct config_parser_st *p, const char *data, size_t size)
+{
+    p->crc = hash_crc32_update(p->crc, data, size);
+    p->nbytes += size;
+}
+
+static void free_map_fields(struct map_fields_st *map)
+{
+    int ii;
+
+    free(map->hash_algorithm);
+    for (ii = 0; ii < map->num_servers; ++ii) {
+        free(map->servers[ii]);
+    }
+    free(map->servers);
+    free(map->buckets[0].rows);
+    free(map->buckets[1].rows);
+}
+
+static void config_parser_destroy(struct config_parser_st *p)
+{
+    int ii;
+
+    free_map_fields(&p->top);
+    free_map_fields(&p->envelope);
+    for (ii = 0; ii < p->num_nodes; ++ii) {
+        free(p->nodes[ii].hostname);
+        free(p->nodes[ii].couch_api_base);
+    }
+    free(p->nodes);
+    free(p->locator);
+    json_sax_destroy(&p->sax);
+}
+
+static int populate_servers(struct vbucket_config_st *vb, struct map_fields_st *map) {
+    int i;
+
+    vb->servers = calloc(map->num_servers, sizeof(struct server_st));
+    if (vb->servers == NULL) {
+        vb->errmsg = strdup("Failed to allocate servers array");
+        return -1;
+    }
+    vb->num_servers = map->num_servers;
+    for (i = 0; i < vb->num_servers; ++i) {
+        vb->servers[i].authority = map->servers[i];
+        map->servers[i] = NULL;
+    }
+    return 0;
+}
+
+static int get_node_authority(struct vbucket_config_st *vb,
+                              const struct node_fields_st *node,
+                              char **out, size_t nbuf)
+{
+    char *colon = NULL;
+    char *buf = *out;
+
+    if (node->hostname_state != FIELD_SET) {
+        vb->errmsg = strdup("Expected string for node's hostname");
+        return -1;
+    }
+    if (node->ports_state != FIELD_SET) {
+        vb->errmsg = strdup("Expected json object for node's ports");
+        return -1;
+    }
+    if (node->direct_state != FIELD_SET) {
+        vb->errmsg = strdup("Expected number for node's direct port");
+        return -1;
+    }
+
+    snprintf(buf, nbuf - 7, "%s", node->hostname);
+    colon = strchr(buf, ':');
+    if (!colon) {
+        colon = buf + strlen(buf);
+    }
+    snprintf(colon, 7, ":%d", node->direct);
+
+    buf = substitute_localhost_marker(vb, buf);
+    if (buf == NULL) {
+        vb->errmsg = strdup("Failed to allocate storage for authority string during $HOST substitution");
+        return -1;
+    }
+    *out = buf;
+    return 0;
+}
+
+static int lookup_server_struct(struct vbucket_config_st *vb,
+                                const struct node_fields_st *node) {
+    char *authority = NULL;
+    int idx = -1, ii;
+
+    authority = calloc(MAX_AUTHORITY_SIZE, sizeof(char));
+    if (authority == NULL) {
+        vb->errmsg = strdup("Failed to allocate storage for authority string");
+        return -1;
+    }
+    if (get_node_authority(vb, node, &authority, MAX_AUTHORITY_SIZE) < 0) {
+        free(authority);
+        return -1;
+    }
+
+    for (ii = 0; ii < vb->num_servers; ++ii) {
+        if (strcmp(vb->servers[ii].authority, authority) == 0) {
+            idx = ii;
+            break;
+        }
+    }
+
+    free(authority);
+    return idx;
+}
+
+static int update_server_info(struct vbucket_config_st *vb, struct config_parser_st *p) {
+    struct node_fields_st *node;
+    int idx, ii;
+
+    for (ii = 0; ii < p->num_nodes; ++ii) {
+        node = p->nodes + ii;
+        if (!node->is_object) {
+            vb->errmsg = strdup("Expected json object for nodes array item");
+            return -1;
+        }
+
+        if (node->hostname_state != FIELD_SET || node->ports_state != FIELD_SET ||
+            node->direct_state != FIELD_SET) {
+            /* a node without a valid authority matches no server */
+            continue;
+        }
+
+        if ((idx = lookup_server_struct(vb, node)) >= 0) {
+            if (node->couch_api_base != NULL) {
+                char *value = substitute_localhost_marker(vb, node->couch_api_base);
+                node->couch_api_base = NULL;
+                if (value == NULL) {
+                    vb->errmsg = strdup("Failed to allocate storage for hostname string during $HOST substitution");
+                    return -1;
+                }
+                free(vb->servers[idx].couchdb_api_base);
+                vb->servers[idx].couchdb_api_base = value;
+            }
+            if (node->hostname != NULL) {
+                char *value = strdup(node->hostname);
+                if (value == NULL) {
+                    vb->errmsg = strdup("Failed to allocate storage for hostname string");
+                    return -1;
+                }
+                value = substitute_localhost_marker(vb, value);
+                if (value == NULL) {
+                    vb->errmsg = strdup("Failed to allocate storage for hostname string during $HOST substitution");
+                    return -1;
+                }
+                free(vb->servers[idx].rest_api_authority);
+                vb->servers[idx].rest_api_authority = value;
+            }
+            if (node->this_node) {
+                vb->servers[idx].config_node = 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int populate_buckets(struct vbucket_config_st *vb, struct bucket_map_st *b, int is_forward)
+{
+    if (b->num_rows < vb->num_vbuckets || b->bad_row ||
+        b->min_length != vb->num_replicas + 1 ||
+        b->max_length != vb->num_replicas + 1) {
+        vb->errmsg = strdup("Expected array of arrays each with numReplicas + 1 ints for vBucketMap");
+        return -1;
+    }
+    if (b->bad_id || b->max_id >= vb->num_servers) {
+        vb->errmsg = strdup("Server ID must be >= -1 and < num_servers");
+        return -1;
+    }
+
+    if (is_forward) {
+        vb->fvbuckets = b->rows;
+    } else {
+        vb->vbuckets = b->rows;
+    }
+    b->rows = NULL;
+    return 0;
+}
+
+static const struct hash_algorithm_st *find_hash_algorithm(const char *name)
+{
+    const struct hash_algorithm_st *alg;
+
+    for (alg = hash_algorithms; alg->name != NULL; ++alg) {
+        if (strcasecmp(alg->name, name) == 0) {
+            return alg;
+        }
+    }
+    return NULL;
+}
+
+/* use the named key hash if the locator supports it */
+static int select_hash_algorithm(VBUCKET_CONFIG_HANDLE vb, const char *name)
+{
+    const struct hash_algorithm_st *alg = find_hash_algorithm(name);
+
+    if (alg == NULL) {
+        return -1;
+    }
+    if (vb->distribution != VBUCKET_DISTRIBUTION_VBUCKET) {
+        if (alg->ketama_hash == NULL) {
+            return -1;
+        }
+        vb->hash = alg->ketama_hash;
+        vb->hash_iov = alg->ketama_hash_iov;
+    } else {
+        if (alg->vbucket_hash == NULL) {
+            return -1;
+        }
+        vb->hash = alg->vbucket_hash;
+        vb->hash_iov = alg->vbucket_hash_iov;
+    }
+    return 0;
+}
+
+/*
+ * Older versions ignored "hashAlgorithm", and ketama clusters sent the
+ * "CRC" of vbucket maps which never selected anything, so the locators
+ * without vbuckets still take it for their default. Any other value must
+ * name a hash the locator supports.
+ */
+static int parse_hash_algorithm(VBUCKET_CONFIG_HANDLE vb,
+                                const struct map_fields_st *map,
+                                const char *default_name)
+{
+    char msg[128];
+
+    if (map->hash_algorithm_state == FIELD_MISSING ||
+        (map->hash_algorithm_state == FIELD_SET &&
+         vb->distribution != VBUCKET_DISTRIBUTION_VBUCKET &&
+         strcasecmp(map->hash_algorithm, "crc") == 0)) {
+        return select_hash_algorithm(vb, default_name);
+    }
+    if (map->hash_algorithm_state != FIELD_SET) {
+        vb->errmsg = strdup("Expected string for hashAlgorithm");
+        return -1;
+    }
+    if (select_hash_algorithm(vb, map->hash_algorithm) != 0) {
+        if (find_hash_algorithm(map->hash_algorithm) == NULL) {
+            snprintf(msg, sizeof(msg), "Unknown hashAlgorithm: \"%.64s\"",
+                     map->hash_algorithm);
+        } else {
+            snprintf(msg, sizeof(msg), "hashAlgorithm \"%s\" can't be used with this nodeLocator",
+                     map->hash_algorithm);
+        }
+        vb->errmsg = strdup(msg);
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_vbucket_config(VBUCKET_CONFIG_HANDLE vb, struct config_parser_st *p)
+{
+    struct map_fields_st *map;
+
+    if (p->envelope_state == FIELD_WRONG_TYPE) {
+        vb->errmsg = strdup("Expected object for vBucketServerMap");
+        return -1;
+    }
+    /* without the envelope the fields are at the top level */
+    map = p->envelope_state == FIELD_SET ? &p->envelope : &p->top;
+
+    if (parse_hash_algorithm(vb, map, "crc") != 0) {
+        return -1;
+    }
+
+    if (map->num_replicas_state != FIELD_SET ||
+        map->num_replicas > MAX_REPLICAS) {
+        vb->errmsg = strdup("Expected number <= " STRINGIFY(MAX_REPLICAS) " for numReplicas");
+        return -1;
+    }
+    vb->num_replicas = map->num_replicas;
+
+    if (map->server_list_state != FIELD_SET) {
+        vb->errmsg = strdup("Expected array for serverList");
+        return -1;
+    }
+    if (map->num_servers == 0) {
+        vb->errmsg = strdup("Empty serverList");
+        return -1;
+    }
+    if (map->bad_server) {
+        vb->errmsg = strdup("Expected array of strings for serverList");
+        return -1;
+    }
+    if (populate_servers(vb, map) != 0) {
+        return -1;
+    }
+    /* optionally update server info using envelop (couchdb_api_base etc.) */
+    if (p->nodes_state == FIELD_WRONG_TYPE) {
+        vb->errmsg = strdup("Expected array for nodes");
+        return -1;
+    }
+    if (update_server_info(vb, p) != 0) {
+        return -1;
+    }
+
+    if (map->buckets[0].state != FIELD_SET) {
+        vb->errmsg = strdup("Expected array for vBucketMap");
+        return -1;
+    }
+    vb->num_vbuckets = map->buckets[0].num_rows;
+    if (vb->num_vbuckets == 0 || (vb->num_vbuckets & (vb->num_vbuckets - 1)) != 0) {
+        vb->errmsg = strdup("Number of vBuckets must be a power of two > 0 and <= " STRINGIFY(MAX_VBUCKETS));
+        return -1;
+    }
+    vb->mask = vb->num_vbuckets - 1;
+    if (populate_buckets(vb, &map->buckets[0], 0) != 0) {
+        return -1;
+    }
+
+    /* vbucket forward map could possibly be null */
+    if (map->buckets[1].state == FIELD_WRONG_TYPE) {
+        vb->errmsg = strdup("Expected array for vBucketMapForward");
+        return -1;
+    }
+    if (map->buckets[1].state == FIELD_SET) {
+        if (populate_buckets(vb, &map->buckets[1], 1) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int server_cmp(const void *s1, const void *s2)
+{
+    return strcmp(((const struct server_st *)s1)->authority,
+                  ((const struct server_st *)s2)->authority);
+}
+
+/* read the servers of the locators without vbuckets from "nodes" */
+static int parse_nodes(VBUCKET_CONFIG_HANDLE vb, struct config_parser_st *p)
+{
+    struct node_fields_st *node;
+    double total_weight = 0;
+    char *buf;
+    int ii;
+
+    if (p->nodes_state != FIELD_SET) {
+        vb->errmsg = strdup("Expected array for nodes");
+        return -1;
+    }
+
+    if (p->num_nodes == 0) {
+        vb->errmsg = strdup("Empty serverList");
+        return -1;
+    }
+    vb->servers = calloc(p->num_nodes, sizeof(struct server_st));
+    if (vb->servers == NULL) {
+        vb->errmsg = strdup("Failed to allocate servers array");
+        return -1;
+    }
+    vb->num_servers = p->num_nodes;
+    for (ii = 0; ii < vb->num_servers; ++ii) {
+        node = p->nodes + ii;
+        if (!node->is_object) {
+            vb->errmsg = strdup("Expected object for nodes array item");
+            return -1;
+        }
+        buf = calloc(MAX_AUTHORITY_SIZE, sizeof(char));
+        if (buf == NULL) {
+            vb->errmsg = strdup("Failed to allocate storage for node authority");
+            return -1;
+        }
+        if (get_node_authority(vb, node, &buf, MAX_AUTHORITY_SIZE) < 0) {
+            free(buf);
+            return -1;
+        }
+        vb->servers[ii].authority = buf;
+        buf = substitute_localhost_marker(vb, node->hostname);
+        node->hostname = NULL;
+        if (buf == NULL) {
+            vb->errmsg = strdup("Failed to allocate storage for hostname string during $HOST substitution");
+            return -1;
+        }
+        vb->servers[ii].rest_api_authority = buf;
+        if (node->weight_state == FIELD_MISSING) {
+            vb->servers[ii].weight = 1;
+        } else if (node->weight_state != FIELD_SET || node->weight < 0) {
+            vb->errmsg = strdup("Expected non-negative number for node's weight");
+            return -1;
+        } else {
+            vb->servers[ii].weight = node->weight;
+        }
+        total_weight += vb->servers[ii].weight;
+    }
+    if (total_weight <= 0) {
+        vb->errmsg = strdup("Expected positive weight for some node");
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_ketama_config(VBUCKET_CONFIG_HANDLE vb, struct config_parser_st *p)
+{
+    if (parse_hash_algorithm(vb, &p->top, "md5") != 0 ||
+        parse_nodes(vb, p) != 0) {
+        return -1;
+    }
+    qsort(vb->servers, vb->num_servers, sizeof(struct server_st), server_cmp);
+
+    vb->ejected = calloc((vb->num_servers + 63) / 64, sizeof(uint64_t));
+    if (vb->ejected == NULL ||
+        update_ketama_continuum(vb, vb->previous) != 0) {
+        vb->errmsg = strdup("Failed to allocate storage for ketama continuum");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Jump consistent hash numbers the servers in the order of the config,
+ * so servers should only be added or removed at the end of the list.
+ */
+static int parse_jump_config(VBUCKET_CONFIG_HANDLE vb, struct config_parser_st *p)
+{
+    if (parse_hash_algorithm(vb, &p->top, "murmur3") != 0 ||
+        parse_nodes(vb, p) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_maglev_config(VBUCKET_CONFIG_HANDLE vb, struct config_parser_st *p)
+{
+    if (parse_hash_algorithm(vb, &p->top, "murmur3") != 0 ||
+        parse_nodes(vb, p) != 0) {
+        return -1;
+    }
+    qsort(vb->servers, vb->num_servers, sizeof(struct server_st), server_cmp);
+
+    if (update_maglev_table(vb) != 0) {
+        vb->errmsg = strdup("Failed to allocate storage for maglev table");
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_config(VBUCKET_CONFIG_HANDLE handle, struct config_parser_st *p)
+{
+    /* by default it uses vbucket distribution to map keys to servers */
+    handle->distribution = VBUCKET_DISTRIBUTION_VBUCKET;
+
+    if (p->locator_state == FIELD_MISSING) {
+        /* special case: it migth be config without envelope */
+        if (parse_vbucket_config(handle, p) == -1) {
             return -1;
         }
-        server = substitute_localhost_marker(vb, server);
-        if (server == NULL) {
-            vb->errmsg = strdup("Failed to allocate storage for server string during $HOST substitution");
+    } else if (p->locator_state == FIELD_SET) {
+        if (strcmp(p->locator, "vbucket") == 0) {
+            handle->distribution = VBUCKET_DISTRIBUTION_VBUCKET;
+            if (parse_vbucket_config(handle, p) == -1) {
+                return -1;
+            }
+        } else if (strcmp(p->locator, "ketama") == 0) {
+            handle->distribution = VBUCKET_DISTRIBUTION_KETAMA;
+            if (parse_ketama_config(handle, p) == -1) {
+                return -1;
+            }
+        } else if (strcmp(p->locator, "jump") == 0) {
+            handle->distribution = VBUCKET_DISTRIBUTION_JUMP;
+            if (parse_jump_config(handle, p) == -1) {
+                return -1;
+            }
+        } else if (strcmp(p->locator, "maglev") == 0) {
+            handle->distribution = VBUCKET_DISTRIBUTION_MAGLEV;
+            if (parse_maglev_config(handle, p) == -1) {
+                return -1;
+            }
+        }
+    } else {
+        handle->errmsg = strdup("Expected string for nodeLocator");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* the crc32 of the bytes in the low half, their length in the high one */
+static uint64_t fingerprint_value(uint32_t crc, size_t nbytes)
+{
+    return ((uint64_t)nbytes << 32) | (uint32_t)~crc;
+}
+
+/*
+ * the fingerprint covers the document alone, from its first byte to the
+ * nused bytes of data the parser took, and no white space around it
+ */
+static size_t document_span(const char **data, size_t nused)
+{
+    while (nused > 0 && (unsigned char)**data <= ' ') {
+        ++*data;
+        --nused;
+    }
+    while (nused > 0 && (unsigned char)(*data)[nused - 1] <= ' ') {
+        --nused;
+    }
+    return nused;
+}
+
+/* build the config from a document the parser read, ret is how the read ended */
+static int config_parser_done(struct config_parser_st *p, int ret)
+{
+    if (ret < 0) {
+        if (!p->nomem) {
+            p->vb->errmsg = strdup("Failed to parse data. Invalid JSON?");
+        }
+        return -1;
+    }
+    p->vb->fingerprint = fingerprint_value(p->crc, p->nbytes);
+    return parse_config(p->vb, p);
+}
+
+static int parse_from_buffer(VBUCKET_CONFIG_HANDLE handle, const char *data, size_t size)
+{
+    struct config_parser_st parser;
+    const char *start;
+    size_t nused;
+    int ret;
+
+    config_parser_init(&parser, handle);
+    /* like cJSON_Parse(), whatever follows the document is ignored */
+    ret = json_sax_feed(&parser.sax, data, size, &nused);
+    if (ret == 0) {
+        ret = json_sax_finish(&parser.sax);
+        nused = size;
+    }
+    if (ret == 1) {
+        start = data;
+        config_parser_hash(&parser, start, document_span(&start, nused));
+    }
+    ret = config_parser_done(&parser, ret);
+    config_parser_destroy(&parser);
+    return ret;
+}
+
+static int parse_from_memory(VBUCKET_CONFIG_HANDLE handle, const char *data)
+{
+    return parse_from_buffer(handle, data, strlen(data));
+}
+
+/* read a file which can't be mapped, like a pipe, chunk by chunk into the parser */
+static int parse_from_stream(VBUCKET_CONFIG_HANDLE handle, FILE *f, const char *filename)
+{
+    struct config_parser_st parser;
+    size_t nread, nused, total = 0;
+    char msg[1024];
+    const char *start;
+    char *buf;
+    int ret = 0;
+
+    buf = malloc(READ_CHUNK_SIZE);
+    if (buf == NULL) {
+        snprintf(msg, sizeof(msg), "Failed to allocate buffer to read: \"%s\"", filename);
+        handle->errmsg = strdup(msg);
+        return -1;
+    }
+    config_parser_init(&parser, handle);
+    while (ret == 0 && (nread = fread(buf, 1, READ_CHUNK_SIZE, f)) > 0) {
+        total += nread;
+        if (total > MAX_CONFIG_SIZE) {
+            snprintf(msg, sizeof(msg), "File too large: \"%s\"", filename);
+            handle->errmsg = strdup(msg);
+            ret = -2;
+            break;
+        }
+        ret = json_sax_feed(&parser.sax, buf, nread, &nused);
+        start = buf;
+        if (parser.nbytes == 0) {
+            while (start < buf + nread && (unsigned char)*start <= ' ') {
+                ++start;
+            }
+        }
+        config_parser_hash(&parser, start, (ret == 1 ? buf + nused : buf + nread) - start);
+    }
+    if (ret == 0 && ferror(f)) {
+        snprintf(msg, sizeof(msg), "Failed to read entire file: \"%s\": %s",
+                 filename, strerror(errno));
+        handle->errmsg = strdup(msg);
+        ret = -2;
+    }
+    if (ret == 0) {
+        ret = json_sax_finish(&parser.sax);
+    }
+    ret = ret == -2 ? -1 : config_parser_done(&parser, ret);
+    config_parser_destroy(&parser);
+    free(buf);
+    return ret;
+}
+
+static int parse_from_file(VBUCKET_CONFIG_HANDLE handle, const char *filename)
+{
+    char msg[1024];
+    int ret;
+#ifndef _WIN32
+    struct stat st, after;
+    void *data;
+#endif
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        snprintf(msg, sizeof(msg), "Unable to open file \"%s\": %s", filename,
+                 strerror(errno));
+        handle->errmsg = strdup(msg);
+        return -1;
+    }
+#ifndef _WIN32
+    /* the parser reads a regular file straight from its pages */
+    if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        if (st.st_size > MAX_CONFIG_SIZE) {
+            snprintf(msg, sizeof(msg), "File too large: \"%s\"", filename);
+            handle->errmsg = strdup(msg);
+            fclose(f);
             return -1;
         }
-        vb->servers[i].authority = server;
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+        if (data != MAP_FAILED) {
+            ret = parse_from_buffer(handle, data, (size_t)st.st_size);
+            munmap(data, (size_t)st.st_size);
+            /*
+             * a file rewritten in place may have given the parser a mix of
+             * old and new bytes, so what was read only counts if the file
+             * is still the same
+             */
+            if (fstat(fileno(f), &after) != 0 || after.st_size != st.st_size ||
+                after.st_mtime != st.st_mtime) {
+                free(handle->errmsg);
+                snprintf(msg, sizeof(msg), "File changed while parsing: \"%s\"", filename);
+                handle->errmsg = strdup(msg);
+                ret = -1;
+            }
+            fclose(f);
+            return ret;
+        }
+    }
+#endif
+    ret = parse_from_stream(handle, f, filename);
+    fclose(f);
+    return ret;
+}
+
+/* looks for the "rev" of a config, everything else is skipped */
+struct rev_peek_st {
+    int depth;
+    int is_rev;                 /* the next value is the rev */
+    int found;                  /* the rev has been read */
+    int to_end;                 /* skip to the end of the document after it */
+    int64_t rev;
+};
+
+static int peek_value(struct rev_peek_st *peek)
+{
+    /* the first "rev" counts, whatever it is */
+    if (peek->is_rev) {
+        peek->is_rev = 0;
+        peek->found = 1;
+        return peek->to_end ? JSON_SAX_SKIP : -1;
+    }
+    return JSON_SAX_SKIP;
+}
+
+static int peek_start_object(void *ctx)
+{
+    struct rev_peek_st *peek = ctx;
+
+    if (peek->depth == 0) {
+        peek->depth = 1;
+        return 0;
+    }
+    return peek_value(peek);
+}
+
+static int peek_start_array(void *ctx)
+{
+    return peek_value(ctx);
+}
+
+static int peek_end_object(void *ctx)
+{
+    (void)ctx;
+    return 0;
+}
+
+static int peek_key(void *ctx, const char *key, size_t nkey)
+{
+    struct rev_peek_st *peek = ctx;
+
+    peek->is_rev = !peek->found && nkey == 3 && strcasecmp(key, "rev") == 0;
+    return peek->is_rev ? 0 : JSON_SAX_SKIP;
+}
+
+static int peek_string(void *ctx, const char *value, size_t nvalue)
+{
+    (void)value;
+    (void)nvalue;
+    return peek_value(ctx) < 0 ? -1 : 0;
+}
+
+static int peek_number(void *ctx, double value)
+{
+    struct rev_peek_st *peek = ctx;
+
+    if (peek->is_rev && value >= 0 && value < 9e18) {
+        peek->rev = (int64_t)value;
+    }
+    return peek_value(peek) < 0 ? -1 : 0;
+}
+
+static int peek_literal(void *ctx, int literal)
+{
+    (void)literal;
+    return peek_value(ctx) < 0 ? -1 : 0;
+}
+
+static const json_sax_callbacks_t peek_callbacks = {
+    peek_start_object,
+    peek_end_object,
+    peek_start_array,
+    peek_end_object,
+    peek_key,
+    peek_string,
+    peek_number,
+    peek_literal
+};
+
+VBUCKET_CONFIG_HANDLE vbucket_config_create(void)
+{
+    VBUCKET_CONFIG_HANDLE vb = calloc(1, sizeof(struct vbucket_config_st));
+    if (vb) {
+        vb->hash = hash_crc32;
+        vb->hash_iov = hash_crc32_iov;
+        vb->ketama_index_bits = -1;
+        vb->rev = -1;
+    }
+    return vb;
+}
+
+int vbucket_config_parse2(VBUCKET_CONFIG_HANDLE handle,
+                          vbucket_source_t data_source,
+                          const char *data,
+                          const char *peername)
+{
+    handle->localhost = peername;
+    handle->nlocalhost = peername ? strlen(peername) : 0;
+    if (data_source == LIBVBUCKET_SOURCE_FILE) {
+        return parse_from_file(handle, data);
+    } else {
+        return parse_from_memory(handle, data);
+    }
+}
+
+int vbucket_config_parse_buffer(VBUCKET_CONFIG_HANDLE handle,
+                                const void *data,
+                                size_t size,
+                                const char *peername)
+{
+    handle->localhost = peername;
+    handle->nlocalhost = peername ? strlen(peername) : 0;
+    return parse_from_buffer(handle, data, size);
+}
+
+int vbucket_config_peek(const void *data, size_t size,
+                        int64_t *rev, uint64_t *fingerprint)
+{
+    struct rev_peek_st peek;
+    json_sax_t sax;
+    const char *start = data;
+    size_t nused;
+    int ret;
+
+    memset(&peek, 0, sizeof(peek));
+    peek.rev = -1;
+    /* the fingerprint needs the end of the document, the rev alone doesn't */
+    peek.to_end = fingerprint != NULL;
+    json_sax_init(&sax, &peek_callbacks, &peek);
+    ret = json_sax_feed(&sax, data, size, &nused);
+    json_sax_destroy(&sax);
+    if (ret == 0 || (ret < 0 && (peek.to_end || !peek.found))) {
+        return -1;
+    }
+    if (rev != NULL) {
+        *rev = peek.rev;
+    }
+    if (fingerprint != NULL) {
+        nused = document_span(&start, nused);
+        *fingerprint = fingerprint_value(hash_crc32_update(UINT32_MAX, start, nused), nused);
     }
     return 0;
 }
 
-static int get_node_authority(struct vbucket_config_st *vb, cJSON *node, char **out, size_t nbuf)
+int vbucket_config_parse_update(VBUCKET_CONFIG_HANDLE handle,
+                                VBUCKET_CONFIG_HANDLE previous,
+                                vbucket_source_t data_source,
+                                const char *data,
+                                const char *peername)
+{
+    int ret;
+
+    handle->previous = previous;
+    ret = vbucket_config_parse2(handle, data_source, data, peername);
+    handle->previous = NULL;
+    return ret;
+}
+
+int vbucket_config_parse(VBUCKET_CONFIG_HANDLE handle,
+                         vbucket_source_t data_source,
+                         const char *data)
+{
+    return vbucket_config_parse2(handle, data_source, data, "localhost");
+}
+
+const char *vbucket_get_error_message(VBUCKET_CONFIG_HANDLE handle)
 {
-    cJSON *json;
-    char *hostname = NULL, *colon = NULL;
-    int port = -1;
-    char *buf = *out;
+    return handle->errmsg;
+}
 
-    json = cJSON_GetObjectItem(node, "hostname");
-    if (json == NULL || json->type != cJSON_String) {
-        vb->errmsg = strdup("Expected string for node's hostname");
-        return -1;
-    }
-    hostname = json->valuestring;
-    json = cJSON_GetObjectItem(node, "ports");
-    if (json == NULL || json->type != cJSON_Object) {
-        vb->errmsg = strdup("Expected json object for node's ports");
-        return -1;
-    }
-    json = cJSON_GetObjectItem(json, "direct");
-    if (json == NULL || json->type != cJSON_Number) {
-        vb->errmsg = strdup("Expected number for node's direct port");
-        return -1;
+static VBUCKET_CONFIG_HANDLE backwards_compat(vbucket_source_t source, const char *data)
+{
+    VBUCKET_CONFIG_HANDLE ret = vbucket_config_create();
+    if (ret == NULL) {
+        return NULL;
     }
-    port = json->valueint;
 
-    snprintf(buf, nbuf - 7, "%s", hostname);
-    colon = strchr(buf, ':');
-    if (!colon) {
-        colon = buf + strlen(buf);
+    if (vbucket_config_parse(ret, source, data) != 0) {
+        errstr = strdup(ret->errmsg);
+        vbucket_config_destroy(ret);
+        ret = NULL;
     }
-    snprintf(colon, 7, ":%d", port);
 
-    buf = substitute_localhost_marker(vb, buf);
-    if (buf == NULL) {
-        vb->errmsg = strdup("Failed to allocate storage for authority string during $HOST substitution");
-        return -1;
-    }
-    *out = buf;
-    return 0;
+    return ret;
 }
 
-static int lookup_server_struct(struct vbucket_config_st *vb, cJSON *c) {
-    char *authority = NULL;
-    int idx = -1, ii;
+VBUCKET_CONFIG_HANDLE vbucket_config_parse_file(const char *filename)
+{
+    return backwards_compat(LIBVBUCKET_SOURCE_FILE, filename);
+}
 
-    authority = calloc(MAX_AUTHORITY_SIZE, sizeof(char));
-    if (authority == NULL) {
-        vb->errmsg = strdup("Failed to allocate storage for authority string");
-        return -1;
-    }
-    if (get_node_authority(vb, c, &authority, MAX_AUTHORITY_SIZE) < 0) {
-        free(authority);
-        return -1;
-    }
+VBUCKET_CONFIG_HANDLE vbucket_config_parse_string(const char *data)
+{
+    return backwards_compat(LIBVBUCKET_SOURCE_MEMORY, data);
+}
 
-    for (ii = 0; ii < vb->num_servers; ++ii) {
-        if (strcmp(vb->servers[ii].authority, authority) == 0) {
-            idx = ii;
-            break;
-        }
+struct vbucket_config_stream_st {
+    struct config_parser_st parser;
+    VBUCKET_CONFIG_HANDLE vb;   /* the config being read, or NULL */
+    char *peername;
+    vbucket_stream_fn callback;
+    void *cookie;
+    int newlines;               /* trailing run of newlines fed so far */
+    int discard;                /* skipping a bad document up to the separator */
+};
+
+VBUCKET_CONFIG_STREAM vbucket_config_stream_create(const char *peername,
+                                                   vbucket_stream_fn callback,
+                                                   void *cookie)
+{
+    VBUCKET_CONFIG_STREAM stream = calloc(1, sizeof(struct vbucket_config_stream_st));
+
+    if (stream == NULL) {
+        return NULL;
+    }
+    if (peername != NULL && (stream->peername = strdup(peername)) == NULL) {
+        free(stream);
+        return NULL;
     }
+    stream->callback = callback;
+    stream->cookie = cookie;
+    return stream;
+}
 
-    free(authority);
-    return idx;
+/* hand the config read so far to the callback */
+static void stream_done(VBUCKET_CONFIG_STREAM stream, int ret)
+{
+    VBUCKET_CONFIG_HANDLE vb = stream->vb;
+
+    ret = config_parser_done(&stream->parser, ret);
+    config_parser_destroy(&stream->parser);
+    vb->localhost = NULL;
+    vb->nlocalhost = 0;
+    stream->vb = NULL;
+    stream->callback(stream->cookie, vb, ret);
 }
 
-static int update_server_info(struct vbucket_config_st *vb, cJSON *config) {
-    int idx, ii;
-    cJSON *node, *json;
+/* feed the bytes up to and including at most one newline */
+static int stream_feed_line(VBUCKET_CONFIG_STREAM stream, const char *ptr, const char *end)
+{
+    size_t nused;
+    int ret;
 
-    for (ii = 0; ii < cJSON_GetArraySize(config); ++ii) {
-        node = cJSON_GetArrayItem(config, ii);
-        if (node) {
-            if (node->type != cJSON_Object) {
-                vb->errmsg = strdup("Expected json object for nodes array item");
-                return -1;
+    while (ptr < end && !stream->discard) {
+        if (stream->vb == NULL) {
+            while (ptr < end && (unsigned char)*ptr <= ' ') {
+                ++ptr;
             }
-
-            if ((idx = lookup_server_struct(vb, node)) >= 0) {
-                json = cJSON_GetObjectItem(node, "couchApiBase");
-                if (json != NULL) {
-                    char *value = strdup(json->valuestring);
-                    if (value == NULL) {
-                        vb->errmsg = strdup("Failed to allocate storage for couchApiBase string");
-                        return -1;
-                    }
-                    value = substitute_localhost_marker(vb, value);
-                    if (value == NULL) {
-                        vb->errmsg = strdup("Failed to allocate storage for hostname string during $HOST substitution");
-                        return -1;
-                    }
-                    vb->servers[idx].couchdb_api_base = value;
-                }
-                json = cJSON_GetObjectItem(node, "hostname");
-                if (json != NULL) {
-                    char *value = strdup(json->valuestring);
-                    if (value == NULL) {
-                        vb->errmsg = strdup("Failed to allocate storage for hostname string");
-                        return -1;
-                    }
-                    value = substitute_localhost_marker(vb, value);
-                    if (value == NULL) {
-                        vb->errmsg = strdup("Failed to allocate storage for hostname string during $HOST substitution");
-                        return -1;
-                    }
-                    vb->servers[idx].rest_api_authority = value;
-                }
-                json = cJSON_GetObjectItem(node, "thisNode");
-                if (json != NULL && json->type == cJSON_True) {
-                    vb->servers[idx].config_node = 1;
-                }
+            if (ptr == end) {
+                break;
+            }
+            stream->vb = vbucket_config_create();
+            if (stream->vb == NULL) {
+                return -1;
             }
+            stream->vb->localhost = stream->peername;
+            stream->vb->nlocalhost = stream->peername ? strlen(stream->peername) : 0;
+            config_parser_init(&stream->parser, stream->vb);
+        }
+        ret = json_sax_feed(&stream->parser.sax, ptr, end - ptr, &nused);
+        if (ret == 0) {
+            config_parser_hash(&stream->parser, ptr, end - ptr);
+            break;
+        }
+        if (ret > 0) {
+            config_parser_hash(&stream->parser, ptr, nused);
+            ptr += nused;
+        } else {
+            stream->discard = 1;
         }
+        stream_done(stream, ret);
     }
     return 0;
 }
 
-static int populate_buckets(struct vbucket_config_st *vb, cJSON *c, int is_forward)
+int vbucket_config_stream_feed(VBUCKET_CONFIG_STREAM stream, const void *data, size_t size)
 {
-    int i, j;
-    struct vbucket_st *vb_map = NULL;
+    const char *ptr = data, *end = ptr + size, *eol;
 
-    if (is_forward) {
-        if (!(vb->fvbuckets = vb_map = calloc(vb->num_vbuckets, sizeof(struct vbucket_st)))) {
-            vb->errmsg = strdup("Failed to allocate storage for forward vbucket map");
-            return -1;
-        }
-    } else {
-        if (!(vb->vbuckets = vb_map = calloc(vb->num_vbuckets, sizeof(struct vbucket_st)))) {
-            vb->errmsg = strdup("Failed to allocate storage for vbucket map");
-            return -1;
+    while (ptr < end) {
+        eol = memchr(ptr, '\n', end - ptr);
+        if (eol == NULL) {
+            stream->newlines = 0;
+            return stream_feed_line(stream, ptr, end);
         }
-    }
-
-    for (i = 0; i < vb->num_vbuckets; ++i) {
-        cJSON *jBucket = cJSON_GetArrayItem(c, i);
-        if (jBucket == NULL || jBucket->type != cJSON_Array ||
-            cJSON_GetArraySize(jBucket) != vb->num_replicas + 1) {
-            vb->errmsg = strdup("Expected array of arrays each with numReplicas + 1 ints for vBucketMap");
+        stream->newlines = eol == ptr ? stream->newlines + 1 : 1;
+        if (stream_feed_line(stream, ptr, eol + 1) != 0) {
             return -1;
         }
-        for (j = 0; j < vb->num_replicas + 1; ++j) {
-            cJSON *jServerId = cJSON_GetArrayItem(jBucket, j);
-            if (jServerId == NULL || jServerId->type != cJSON_Number ||
-                jServerId->valueint < -1 || jServerId->valueint >= vb->num_servers) {
-                vb->errmsg = strdup("Server ID must be >= -1 and < num_servers");
-                return -1;
+        ptr = eol + 1;
+        if (stream->newlines == 4) {
+            /* the separator ends a document, whether it is complete or not */
+            if (stream->vb != NULL) {
+                stream_done(stream, json_sax_finish(&stream->parser.sax));
             }
-            vb_map[i].servers[j] = jServerId->valueint;
+            stream->discard = 0;
+            stream->newlines = 0;
         }
     }
     return 0;
 }
 
-static int parse_vbucket_config(VBUCKET_CONFIG_HANDLE vb, cJSON *c)
+void vbucket_config_stream_destroy(VBUCKET_CONFIG_STREAM stream)
 {
-    cJSON *json, *config;
+    if (stream == NULL) {
+        return;
+    }
+    if (stream->vb != NULL) {
+        config_parser_destroy(&stream->parser);
+        vbucket_config_destroy(stream->vb);
+    }
+    free(stream->peername);
+    free(stream);
+}
 
-    config = cJSON_GetObjectItem(c, "vBucketServerMap");
-    if (config == NULL || config->type != cJSON_Object) {
-        /* seems like config without envelop, try to parse it */
-        config = c;
+/*
+ * The slot of the lower bound from where a search fell off the tree:
+ * undo the right turns taken after the last left turn. No left turn at
+ * all leaves slot 0, which rolls back to the first point.
+ */
+static uint32_t eytzinger_slot(uint32_t kk)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return kk >> __builtin_ffs(~kk);
+#else
+    while (kk & 1) {
+        kk >>= 1;
     }
+    return kk >> 1;
+#endif
+}
 
-    json = cJSON_GetObjectItem(config, "numReplicas");
-    if (json == NULL || json->type != cJSON_Number ||
-        json->valueint > MAX_REPLICAS) {
-        vb->errmsg = strdup("Expected number <= " STRINGIFY(MAX_REPLICAS) " for numReplicas");
-        return -1;
+static uint32_t ketama_search_slot(VBUCKET_CONFIG_HANDLE vb, uint32_t digest)
+{
+    const uint32_t *points = vb->search_points;
+    uint32_t kk = 1, nn = (uint32_t)vb->num_continuum;
+
+    assert(points);
+    /* find the server with the first point at or after the digest. The
+     * compare only picks the child, so the loop has no data dependent
+     * branch, and the cache line four levels down is fetched early */
+    while (kk <= nn) {
+        prefetch(points + kk * (CACHE_LINE_SIZE / sizeof(uint32_t)));
+        kk = 2 * kk + (points[kk] < digest);
     }
-    vb->num_replicas = json->valueint;
+    return eytzinger_slot(kk);
+}
 
-    json = cJSON_GetObjectItem(config, "serverList");
-    if (json == NULL || json->type != cJSON_Array) {
-        vb->errmsg = strdup("Expected array for serverList");
-        return -1;
+static int ketama_search(VBUCKET_CONFIG_HANDLE vb, uint32_t digest)
+{
+    return vb->search_servers[ketama_search_slot(vb, digest)];
+}
+
+/* the slice ends at a point at or after the digest, or at the end of
+ * the continuum */
+static int ketama_scan(VBUCKET_CONFIG_HANDLE vb, uint32_t entry, uint32_t digest)
+{
+    while (entry < (uint32_t)vb->num_continuum &&
+           vb->continuum[entry].point < digest) {
+        ++entry;
     }
-    vb->num_servers = cJSON_GetArraySize(json);
-    if (vb->num_servers == 0) {
-        vb->errmsg = strdup("Empty serverList");
-        return -1;
+    if (entry == (uint32_t)vb->num_continuum) {
+        entry = 0;
     }
-    if (populate_servers(vb, json) != 0) {
-        return -1;
+    return vb->continuum[entry].index;
+}
+
+static int ketama_lookup(VBUCKET_CONFIG_HANDLE vb, uint32_t digest)
+{
+    if (vb->ketama_index) {
+        uint32_t entry = vb->ketama_index[digest >> vb->ketama_index_shift];
+        if (entry & KETAMA_INDEX_DIRECT) {
+            return (int)(entry & ~KETAMA_INDEX_DIRECT);
+        }
+        if (entry != KETAMA_INDEX_SEARCH) {
+            return ketama_scan(vb, entry, digest);
+        }
     }
-    /* optionally update server info using envelop (couchdb_api_base etc.) */
-    json = cJSON_GetObjectItem(c, "nodes");
-    if (json) {
-        if (json->type != cJSON_Array) {
-            vb->errmsg = strdup("Expected array for nodes");
-            return -1;
+    return ketama_search(vb, digest);
+}
+
+/*
+ * ketama_lookup() of up to MAP_BATCH_SIZE digests. Every step is done
+ * for all the digests before the next one, so the cache misses of the
+ * different lookups overlap instead of following one another: first the
+ * index entries, then the continuum points they scan from and then the
+ * search, which walks all the trees down a level at a time. The lookups
+ * of one level are independent, so they need no prefetching to overlap.
+ */
+static void ketama_lookup_batch(VBUCKET_CONFIG_HANDLE vb, const uint32_t *digests,
+                                int *servers, int ndigests)
+{
+    const uint32_t *points = vb->search_points;
+    uint32_t kk[MAP_BATCH_SIZE], keys[MAP_BATCH_SIZE], entries[MAP_BATCH_SIZE];
+    uint32_t nn = (uint32_t)vb->num_continuum;
+    int scans[MAP_BATCH_SIZE], searches[MAP_BATCH_SIZE];
+    int nscans = 0, nsearches = 0, ii, jj, depth, level;
+
+    if (vb->ketama_index) {
+        for (ii = 0; ii < ndigests; ++ii) {
+            prefetch(vb->ketama_index + (digests[ii] >> vb->ketama_index_shift));
         }
-        if (update_server_info(vb, json) != 0) {
-            return -1;
+        for (ii = 0; ii < ndigests; ++ii) {
+            entries[ii] = vb->ketama_index[digests[ii] >> vb->ketama_index_shift];
+            if (entries[ii] & KETAMA_INDEX_DIRECT) {
+                servers[ii] = (int)(entries[ii] & ~KETAMA_INDEX_DIRECT);
+            } else if (entries[ii] != KETAMA_INDEX_SEARCH) {
+                prefetch(vb->continuum + entries[ii]);
+                scans[nscans++] = ii;
+            } else {
+                searches[nsearches++] = ii;
+            }
+        }
+        for (jj = 0; jj < nscans; ++jj) {
+            ii = scans[jj];
+            servers[ii] = ketama_scan(vb, entries[ii], digests[ii]);
+        }
+    } else {
+        for (ii = 0; ii < ndigests; ++ii) {
+            searches[nsearches++] = ii;
         }
     }
 
-    json = cJSON_GetObjectItem(config, "vBucketMap");
-    if (json == NULL || json->type != cJSON_Array) {
-        vb->errmsg = strdup("Expected array for vBucketMap");
-        return -1;
+    if (nsearches == 0) {
+        return;
     }
-    vb->num_vbuckets = cJSON_GetArraySize(json);
-    if (vb->num_vbuckets == 0 || (vb->num_vbuckets & (vb->num_vbuckets - 1)) != 0) {
-        vb->errmsg = strdup("Number of vBuckets must be a power of two > 0 and <= " STRINGIFY(MAX_VBUCKETS));
-        return -1;
+    assert(points);
+    /* every search goes down the full levels of the tree, then some take
+     * one more step into the last, partial level */
+    depth = 0;
+    while (((uint32_t)2 << depth) - 1 <= nn) {
+        ++depth;
     }
-    vb->mask = vb->num_vbuckets - 1;
-    if (populate_buckets(vb, json, 0) != 0) {
-        return -1;
+    for (jj = 0; jj < nsearches; ++jj) {
+        keys[jj] = digests[searches[jj]];
+        kk[jj] = 1;
     }
-
-    /* vbucket forward map could possibly be null */
-    json = cJSON_GetObjectItem(config, "vBucketMapForward");
-    if (json) {
-        if (json->type != cJSON_Array) {
-            vb->errmsg = strdup("Expected array for vBucketMapForward");
-            return -1;
+    for (level = 0; level < depth; ++level) {
+        for (jj = 0; jj < nsearches; ++jj) {
+            kk[jj] = 2 * kk[jj] + (points[kk[jj]] < keys[jj]);
         }
-        if (populate_buckets(vb, json, 1) !=0) {
-            return -1;
+    }
+    for (jj = 0; jj < nsearches; ++jj) {
+        if (kk[jj] <= nn) {
+            kk[jj] = 2 * kk[jj] + (points[kk[jj]] < keys[jj]);
         }
     }
+    for (jj = 0; jj < nsearches; ++jj) {
+        servers[searches[jj]] = vb->search_servers[eytzinger_slot(kk[jj])];
+    }
+}
 
-    return 0;
+uint32_t vbucket_hash_key(VBUCKET_CONFIG_HANDLE vb, const void *key, size_t nkey)
+{
+    return vb->hash(key, nkey);
 }
 
-static int server_cmp(const void *s1, const void *s2)
+uint32_t vbucket_hash_keyv(VBUCKET_CONFIG_HANDLE vb,
+                           const vbucket_iovec_t *iov, int niov)
 {
-    return strcmp(((const struct server_st *)s1)->authority,
-                  ((const struct server_st *)s2)->authority);
+    return vb->hash_iov(iov, niov);
 }
 
-static int parse_ketama_config(VBUCKET_CONFIG_HANDLE vb, cJSON *config)
+static int is_ejected(VBUCKET_CONFIG_HANDLE vb, int server)
 {
-    cJSON *json, *node, *hostname;
-    char *buf;
-    int ii;
+    return (atomic_load_64(&vb->ejected[server / 64]) >> (server % 64)) & 1;
+}
 
-    json = cJSON_GetObjectItem(config, "nodes");
-    if (json == NULL || json->type != cJSON_Array) {
-        vb->errmsg = strdup("Expected array for nodes");
-        return -1;
+/*
+ * The server a key of an ejected server goes to: the first live one
+ * clockwise on the continuum, which is the server the key would map to
+ * if the ejected servers were left out of the config.
+ */
+static int ketama_live_server(VBUCKET_CONFIG_HANDLE vb, uint32_t digest, int server)
+{
+    int lo = 0, hi = vb->num_continuum, ii, next;
+
+    if (vb->search_fallbacks) {
+        const int32_t *fallbacks = vb->search_fallbacks +
+            ketama_search_slot(vb, digest) * vb->ketama_fallbacks;
+        for (ii = 0; ii < vb->ketama_fallbacks && fallbacks[ii] >= 0; ++ii) {
+            if (!is_ejected(vb, fallbacks[ii])) {
+                return fallbacks[ii];
+            }
+        }
     }
 
-    vb->num_servers = cJSON_GetArraySize(json);
-    if (vb->num_servers == 0) {
-        vb->errmsg = strdup("Empty serverList");
-        return -1;
-    }
-    vb->servers = calloc(vb->num_servers, sizeof(struct server_st));
-    for (ii = 0; ii < vb->num_servers; ++ii) {
-        node = cJSON_GetArrayItem(json, ii);
-        if (node == NULL || node->type != cJSON_Object) {
-            vb->errmsg = strdup("Expected object for nodes array item");
-            return -1;
-        }
-        buf = calloc(MAX_AUTHORITY_SIZE, sizeof(char));
-        if (buf == NULL) {
-            vb->errmsg = strdup("Failed to allocate storage for node authority");
-            return -1;
-        }
-        if (get_node_authority(vb, node, &buf, MAX_AUTHORITY_SIZE) < 0) {
-            return -1;
-        }
-        vb->servers[ii].authority = buf;
-        hostname = cJSON_GetObjectItem(node, "hostname");
-        if (hostname == NULL || hostname->type != cJSON_String) {
-            vb->errmsg = strdup("Expected string for node's hostname");
-            return -1;
-        }
-        buf = strdup(hostname->valuestring);
-        if (buf == NULL) {
-            vb->errmsg = strdup("Failed to allocate storage for hostname string");
-            return -1;
+    /* walk the continuum from the first point at or after the digest */
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (vb->continuum[mid].point < digest) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
-        buf = substitute_localhost_marker(vb, buf);
-        if (buf == NULL) {
-            vb->errmsg = strdup("Failed to allocate storage for hostname string during $HOST substitution");
-            return -1;
+    }
+    for (ii = 1; ii < vb->num_continuum; ++ii) {
+        next = vb->continuum[(lo + ii) % vb->num_continuum].index;
+        if (!is_ejected(vb, next)) {
+            return next;
         }
-        vb->servers[ii].rest_api_authority = buf;
     }
-    qsort(vb->servers, vb->num_servers, sizeof(struct server_st), server_cmp);
-
-    update_ketama_continuum(vb);
-    return 0;
+    return server;
 }
 
-static int parse_cjson(VBUCKET_CONFIG_HANDLE handle, cJSON *config)
+int vbucket_map_hashed(VBUCKET_CONFIG_HANDLE vb, uint32_t hash,
+                       int *vbucket_id, int *server_idx)
 {
-    cJSON *json;
+    int vbucket = 0;
 
-    /* set optional credentials */
-    json = cJSON_GetObjectItem(config, "name");
-    if (json != NULL && json->type == cJSON_String && strcmp(json->valuestring, "default") != 0) {
-        handle->user = strdup(json->valuestring);
+    switch (vb->distribution) {
+    case VBUCKET_DISTRIBUTION_KETAMA:
+        *server_idx = ketama_lookup(vb, hash);
+        if (atomic_load_int(&vb->num_ejected) > 0 && is_ejected(vb, *server_idx)) {
+            *server_idx = ketama_live_server(vb, hash, *server_idx);
+        }
+        break;
+    case VBUCKET_DISTRIBUTION_JUMP:
+        *server_idx = jump_consistent_hash(hash, vb->num_servers);
+        break;
+    case VBUCKET_DISTRIBUTION_MAGLEV:
+        /* scale the hash to the table instead of dividing by its size */
+        *server_idx = vb->maglev_table[((uint64_t)hash * vb->maglev_size) >> 32];
+        break;
+    default:
+        vbucket = hash & vb->mask;
+        *server_idx = vbucket_get_master(vb, vbucket);
     }
-    json = cJSON_GetObjectItem(config, "saslPassword");
-    if (json != NULL && json->type == cJSON_String) {
-        handle->password = strdup(json->valuestring);
+    if (vbucket_id) {
+        *vbucket_id = vbucket;
     }
+    return 0;
+}
 
-    /* by default it uses vbucket distribution to map keys to servers */
-    handle->distribution = VBUCKET_DISTRIBUTION_VBUCKET;
+#ifdef HAVE_ATOMICS
+static __thread uint32_t key_cache_stripe;  /* stripe + 1, 0 until picked */
+static uint32_t key_cache_next_stripe;
 
-    json = cJSON_GetObjectItem(config, "nodeLocator");
-    if (json == NULL) {
-        /* special case: it migth be config without envelope */
-        if (parse_vbucket_config(handle, config) == -1) {
+static struct key_cache_stats_st *key_cache_stats(struct key_cache_st *cache)
+{
+    if (key_cache_stripe == 0) {
+        key_cache_stripe = atomic_incr_int(&key_cache_next_stripe) % KEY_CACHE_STRIPES + 1;
+    }
+    return cache->stats + key_cache_stripe - 1;
+}
+#else
+/* without thread locals all threads count in the first stripe */
+static struct key_cache_stats_st *key_cache_stats(struct key_cache_st *cache)
+{
+    return cache->stats;
+}
+#endif
+
+/* the key as zero padded words, or -1 if it is too long to be cached */
+static int key_cache_pack(const vbucket_iovec_t *iov, int niov, uint64_t *words)
+{
+    size_t nkey = 0;
+    int ii;
+
+    memset(words, 0, KEY_CACHE_MAX_KEY);
+    for (ii = 0; ii < niov; ++ii) {
+        if (iov[ii].iov_len > KEY_CACHE_MAX_KEY - nkey) {
             return -1;
         }
-    } else if (json->type == cJSON_String) {
-        if (strcmp(json->valuestring, "vbucket") == 0) {
-            handle->distribution = VBUCKET_DISTRIBUTION_VBUCKET;
-            if (parse_vbucket_config(handle, config) == -1) {
-                return -1;
-            }
-        } else if (strcmp(json->valuestring, "ketama") == 0) {
-            handle->distribution = VBUCKET_DISTRIBUTION_KETAMA;
-            if (parse_ketama_config(handle, config) == -1) {
-                return -1;
-            }
+        memcpy((char *)words + nkey, iov[ii].iov_base, iov[ii].iov_len);
+        nkey += iov[ii].iov_len;
+    }
+    return (int)nkey;
+}
+
+/* look the key up in its slot, returns the server + 1 or 0 for a miss */
+static int key_cache_get(struct key_cache_slot_st *slot, const uint64_t *words,
+                         int nkey, uint32_t *digest)
+{
+    uint64_t state = atomic_load_acquire_64(&slot->state);
+    int ii, nwords = (nkey + 7) / 8;
+
+    if ((state >> 32) & 1 || ((state >> 24) & 0xff) != (uint64_t)nkey ||
+        (state & 0xffff) == 0) {
+        return 0;
+    }
+    for (ii = 0; ii < nwords; ++ii) {
+        if (atomic_load_64(&slot->key[ii]) != words[ii]) {
+            return 0;
         }
-    } else {
-        handle->errmsg = strdup("Expected string for nodeLocator");
-        return -1;
     }
+    *digest = (uint32_t)atomic_load_64(&slot->digest);
+    /* what was read only counts if no writer came in meanwhile */
+    atomic_fence_acquire();
+    if (atomic_load_64(&slot->state) != state) {
+        return 0;
+    }
+    return (int)(state & 0xffff);
+}
 
-    return 0;
+static void key_cache_put(struct key_cache_slot_st *slot, const uint64_t *words,
+                          int nkey, uint32_t digest, int server)
+{
+    uint64_t state = atomic_load_64(&slot->state);
+    uint64_t seq = state >> 32;
+    int ii, nwords = (nkey + 7) / 8;
+
+    if ((seq & 1) ||
+        !atomic_cas_acquire_64(&slot->state, state, (seq + 1) << 32)) {
+        return;
+    }
+    atomic_store_64(&slot->digest, (uint64_t)digest);
+    for (ii = 0; ii < nwords; ++ii) {
+        atomic_store_64(&slot->key[ii], words[ii]);
+    }
+    atomic_store_release_64(&slot->state, ((seq + 2) << 32) |
+                            ((uint64_t)nkey << 24) | (uint64_t)(server + 1));
 }
 
-static int parse_from_memory(VBUCKET_CONFIG_HANDLE handle, const char *data)
+static int key_cache_map(VBUCKET_CONFIG_HANDLE vb, const vbucket_iovec_t *iov,
+                         int niov, int *vbucket_id, int *server_idx)
 {
-    int ret;
-    cJSON *c = cJSON_Parse(data);
-    if (c == NULL) {
-        handle->errmsg = strdup("Failed to parse data. Invalid JSON?");
-        return -1;
+    struct key_cache_st *cache = vb->key_cache;
+    struct key_cache_stats_st *stats = key_cache_stats(cache);
+    struct key_cache_slot_st *slot;
+    uint64_t words[KEY_CACHE_MAX_KEY / 8];
+    uint32_t digest;
+    int nkey, server;
+
+    nkey = key_cache_pack(iov, niov, words);
+    if (nkey < 0) {
+        atomic_incr_64(&stats->misses);
+        return vbucket_map_hashed(vb, vb->hash_iov(iov, niov),
+                                  vbucket_id, server_idx);
+    }
+    if (vbucket_id) {
+        *vbucket_id = 0;
+    }
+    slot = cache->slots + (hash_fnv1a((const char *)words, nkey) & cache->mask);
+    server = key_cache_get(slot, words, nkey, &digest) - 1;
+    if (server >= 0) {
+        atomic_incr_64(&stats->hits);
+    } else {
+        atomic_incr_64(&stats->misses);
+        digest = vb->hash_iov(iov, niov);
+        server = ketama_lookup(vb, digest);
+        key_cache_put(slot, words, nkey, digest, server);
+    }
+    /* the cache holds servers before ejection, so it stays valid */
+    if (atomic_load_int(&vb->num_ejected) > 0 && is_ejected(vb, server)) {
+        server = ketama_live_server(vb, digest, server);
     }
+    *server_idx = server;
+    return 0;
+}
 
-    ret = parse_cjson(handle, c);
+int vbucket_map(VBUCKET_CONFIG_HANDLE vb, const void *key, size_t nkey,
+                int *vbucket_id, int *server_idx)
+{
+    if (vb->key_cache) {
+        vbucket_iovec_t iov;
+        iov.iov_base = key;
+        iov.iov_len = nkey;
+        return key_cache_map(vb, &iov, 1, vbucket_id, server_idx);
+    }
+    return vbucket_map_hashed(vb, vbucket_hash_key(vb, key, nkey),
+                              vbucket_id, server_idx);
+}
 
-    cJSON_Delete(c);
-    return ret;
+int vbucket_mapv(VBUCKET_CONFIG_HANDLE vb, const vbucket_iovec_t *iov,
+                 int niov, int *vbucket_id, int *server_idx)
+{
+    if (vb->key_cache) {
+        return key_cache_map(vb, iov, niov, vbucket_id, server_idx);
+    }
+    return vbucket_map_hashed(vb, vbucket_hash_keyv(vb, iov, niov),
+                              vbucket_id, server_idx);
 }
 
-static int do_read_file(FILE *fp, char *data, size_t size)
+int vbucket_config_enable_key_cache(VBUCKET_CONFIG_HANDLE vb, size_t nslots)
 {
-    size_t offset = 0;
-    size_t nread;
+    struct key_cache_st *cache;
+    size_t size = 1;
 
-    do {
-        nread = fread(data + offset, 1, size, fp);
-        if (nread != (size_t)-1 && nread != 0) {
-            offset += nread;
-            size -= nread;
-        } else {
-            return -1;
-        }
-    } while (size > 0);
+    if (vb->distribution != VBUCKET_DISTRIBUTION_KETAMA ||
+        vb->num_servers > MAX_KEY_CACHE_SERVERS || vb->key_cache ||
+        nslots == 0 || nslots > 0x80000000UL) {
+        return -1;
+    }
+    while (size < nslots) {
+        size <<= 1;
+    }
 
+    cache = calloc(1, sizeof(struct key_cache_st));
+    if (cache == NULL) {
+        return -1;
+    }
+    cache->slots_mem = calloc(size + 1, sizeof(struct key_cache_slot_st));
+    cache->stats_mem = calloc(KEY_CACHE_STRIPES + 1, sizeof(struct key_cache_stats_st));
+    if (cache->slots_mem == NULL || cache->stats_mem == NULL) {
+        free(cache->slots_mem);
+        free(cache->stats_mem);
+        free(cache);
+        return -1;
+    }
+    cache->slots = (struct key_cache_slot_st *)
+        (((uintptr_t)cache->slots_mem + CACHE_LINE_SIZE - 1) &
+         ~(uintptr_t)(CACHE_LINE_SIZE - 1));
+    cache->stats = (struct key_cache_stats_st *)
+        (((uintptr_t)cache->stats_mem + CACHE_LINE_SIZE - 1) &
+         ~(uintptr_t)(CACHE_LINE_SIZE - 1));
+    cache->mask = (uint32_t)(size - 1);
+    vb->key_cache = cache;
     return 0;
 }
 
-static int parse_from_file(VBUCKET_CONFIG_HANDLE handle, const char *filename)
+int vbucket_config_set_ketama_index_bits(VBUCKET_CONFIG_HANDLE vb, int bits)
 {
-    long size;
-    char *data;
-    int ret;
-    FILE *f = fopen(filename, "rb");
-    if (f == NULL) {
-        char msg[1024];
-        snprintf(msg, sizeof(msg), "Unable to open file \"%s\": %s", filename,
-                 strerror(errno));
-        handle->errmsg = strdup(msg);
+    int old_bits = vb->ketama_index_bits;
+
+    if (bits > KETAMA_INDEX_MAX_BITS) {
         return -1;
     }
-    fseek(f, 0, SEEK_END);
-    size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    if (size > MAX_CONFIG_SIZE) {
-        char msg[1024];
-        snprintf(msg, sizeof(msg), "File too large: \"%s\"", filename);
-        handle->errmsg = strdup(msg);
-        fclose(f);
+    vb->ketama_index_bits = bits < 0 ? -1 : bits;
+    if (vb->distribution == VBUCKET_DISTRIBUTION_KETAMA &&
+        update_ketama_index(vb) != 0) {
+        vb->ketama_index_bits = old_bits;
         return -1;
     }
-    data = calloc(size+1, sizeof(char));
-    if (data == NULL) {
-        char msg[1024];
-        snprintf(msg, sizeof(msg), "Failed to allocate buffer to read: \"%s\"", filename);
-        handle->errmsg = strdup(msg);
-        fclose(f);
+    return 0;
+}
+
+int vbucket_config_set_build_threads(VBUCKET_CONFIG_HANDLE vb, int nthreads,
+                                     vbucket_executor_fn executor, void *cookie)
+{
+    if (nthreads < 1 || nthreads > MAX_BUILD_THREADS) {
         return -1;
     }
-    if (do_read_file(f, data, size) == -1) {
-        char msg[1024];
-        snprintf(msg, sizeof(msg), "Failed to read entire file: \"%s\": %s",
-                 filename, strerror(errno));
-        handle->errmsg = strdup(msg);
-        fclose(f);
-        free(data);
+#ifdef _WIN32
+    if (executor == NULL && nthreads > 1) {
         return -1;
     }
-
-    fclose(f);
-    ret = parse_from_memory(handle, data);
-    free(data);
-    return ret;
+#endif
+    vb->build_threads = nthreads;
+    vb->build_executor = executor;
+    vb->build_cookie = cookie;
+    return 0;
 }
 
-VBUCKET_CONFIG_HANDLE vbucket_config_create(void)
+int vbucket_config_set_ketama_fallbacks(VBUCKET_CONFIG_HANDLE vb, int nfallbacks)
 {
-    return calloc(1, sizeof(struct vbucket_config_st));
-}
+    int old_fallbacks = vb->ketama_fallbacks;
 
-int vbucket_config_parse2(VBUCKET_CONFIG_HANDLE handle,
-                          vbucket_source_t data_source,
-                          const char *data,
-                          const char *peername)
-{
-    handle->localhost = peername;
-    handle->nlocalhost = peername ? strlen(peername) : 0;
-    if (data_source == LIBVBUCKET_SOURCE_FILE) {
-        return parse_from_file(handle, data);
-    } else {
-        return parse_from_memory(handle, data);
+    if (nfallbacks < 0 || nfallbacks > MAX_KETAMA_FALLBACKS) {
+        return -1;
+    }
+    vb->ketama_fallbacks = nfallbacks;
+    if (vb->distribution == VBUCKET_DISTRIBUTION_KETAMA && vb->continuum &&
+        update_ketama_search(vb) != 0) {
+        /* the old search arrays are still in place */
+        vb->ketama_fallbacks = old_fallbacks;
+        return -1;
     }
+    return 0;
 }
 
-int vbucket_config_parse(VBUCKET_CONFIG_HANDLE handle,
-                         vbucket_source_t data_source,
-                         const char *data)
+int vbucket_get_ketama_fallbacks(VBUCKET_CONFIG_HANDLE vb, uint32_t hash,
+                                 int *servers, int nservers)
 {
-    return vbucket_config_parse2(handle, data_source, data, "localhost");
+    const int32_t *fallbacks;
+    int ii;
+
+    if (vb->distribution != VBUCKET_DISTRIBUTION_KETAMA ||
+        vb->search_fallbacks == NULL) {
+        return -1;
+    }
+    fallbacks = vb->search_fallbacks +
+        ketama_search_slot(vb, hash) * vb->ketama_fallbacks;
+    for (ii = 0; ii < nservers && ii < vb->ketama_fallbacks; ++ii) {
+        if (fallbacks[ii] < 0) {
+            break;
+        }
+        servers[ii] = fallbacks[ii];
+    }
+    return ii;
 }
 
-const char *vbucket_get_error_message(VBUCKET_CONFIG_HANDLE handle)
+int vbucket_get_ketama_fallback(VBUCKET_CONFIG_HANDLE vb, uint32_t hash, int n)
 {
-    return handle->errmsg;
+    if (vb->distribution != VBUCKET_DISTRIBUTION_KETAMA ||
+        vb->search_fallbacks == NULL || n < 0 || n >= vb->ketama_fallbacks) {
+        return -1;
+    }
+    return vb->search_fallbacks[ketama_search_slot(vb, hash) * vb->ketama_fallbacks + n];
 }
 
-static VBUCKET_CONFIG_HANDLE backwards_compat(vbucket_source_t source, const char *data)
+int vbucket_ketama_eject(VBUCKET_CONFIG_HANDLE vb, int server_idx)
 {
-    VBUCKET_CONFIG_HANDLE ret = vbucket_config_create();
-    if (ret == NULL) {
-        return NULL;
-    }
+    uint64_t bit;
 
-    if (vbucket_config_parse(ret, source, data) != 0) {
-        errstr = strdup(ret->errmsg);
-        vbucket_config_destroy(ret);
-        ret = NULL;
+    if (vb->distribution != VBUCKET_DISTRIBUTION_KETAMA ||
+        server_idx < 0 || server_idx >= vb->num_servers) {
+        return -1;
     }
-
-    return ret;
+    bit = (uint64_t)1 << (server_idx % 64);
+    if (atomic_or_64(&vb->ejected[server_idx / 64], bit) & bit) {
+        return 0;
+    }
+    /* never eject the last live server */
+    if (atomic_add_int(&vb->num_ejected, 1) >= vb->num_servers) {
+        atomic_and_64(&vb->ejected[server_idx / 64], ~bit);
+        atomic_add_int(&vb->num_ejected, -1);
+        return -1;
+    }
+    return 0;
 }
 
-VBUCKET_CONFIG_HANDLE vbucket_config_parse_file(const char *filename)
+int vbucket_ketama_restore(VBUCKET_CONFIG_HANDLE vb, int server_idx)
 {
-    return backwards_compat(LIBVBUCKET_SOURCE_FILE, filename);
+    uint64_t bit;
+
+    if (vb->distribution != VBUCKET_DISTRIBUTION_KETAMA ||
+        server_idx < 0 || server_idx >= vb->num_servers) {
+        return -1;
+    }
+    bit = (uint64_t)1 << (server_idx % 64);
+    if (atomic_and_64(&vb->ejected[server_idx / 64], ~bit) & bit) {
+        atomic_add_int(&vb->num_ejected, -1);
+    }
+    return 0;
 }
 
-VBUCKET_CONFIG_HANDLE vbucket_config_parse_string(const char *data)
+int vbucket_ketama_is_ejected(VBUCKET_CONFIG_HANDLE vb, int server_idx)
 {
-    return backwards_compat(LIBVBUCKET_SOURCE_MEMORY, data);
+    if (vb->distribution == VBUCKET_DISTRIBUTION_KETAMA &&
+        server_idx >= 0 && server_idx < vb->num_servers) {
+        return is_ejected(vb, server_idx);
+    }
+    return 0;
 }
 
-int vbucket_map(VBUCKET_CONFIG_HANDLE vb, const void *key, size_t nkey,
-                int *vbucket_id, int *server_idx)
+int vbucket_config_get_key_cache_stats(VBUCKET_CONFIG_HANDLE vb,
+                                       uint64_t *hits, uint64_t *misses)
 {
-    uint32_t digest, mid, prev;
-    struct continuum_item_st *beginp, *endp, *midp, *highp, *lowp;
-
-    if (vb->distribution == VBUCKET_DISTRIBUTION_KETAMA) {
-        assert(vb->continuum);
-        if (vbucket_id) {
-            *vbucket_id = 0;
-        }
-        digest = hash_ketama(key, nkey);
-        beginp = lowp = vb->continuum;
-        endp = highp = vb->continuum + vb->num_continuum;
-
-        /* divide and conquer array search to find server with next biggest
-         * point after what this key hashes to */
-        while (1)
-        {
-            /* pick the middle point */
-            midp = lowp + (highp - lowp) / 2;
-
-            if (midp == endp) {
-                /* if at the end, roll back to zeroth */
-                *server_idx = beginp->index;
-                break;
-            }
-
-            mid = midp->point;
-            prev = (midp == beginp) ? 0 : (midp-1)->point;
-
-            if (digest <= mid && digest > prev) {
-                /* we found nearest server */
-                *server_idx = midp->index;
-                break;
-            }
-
-            /* adjust the limits */
-            if (mid < digest) {
-                lowp = midp + 1;
-            } else {
-                highp = midp - 1;
-            }
-
-            if (lowp > highp) {
-                *server_idx = beginp->index;
-                break;
-            }
+    if (vb->key_cache) {
+        int ii;
+        *hits = *misses = 0;
+        for (ii = 0; ii < KEY_CACHE_STRIPES; ++ii) {
+            *hits += atomic_load_64(&vb->key_cache->stats[ii].hits);
+            *misses += atomic_load_64(&vb->key_cache->stats[ii].misses);
         }
-    } else {
-        *vbucket_id = vbucket_get_vbucket_by_key(vb, key, nkey);
-        *server_idx = vbucket_get_master(vb, *vbucket_id);
+        return 0;
     }
-    return 0;
+    *hits = *misses = 0;
+    return -1;
 }
 
 
@@ -761,12 +3083,127 @@ const char *vbucket_config_get_password(VBUCKET_CONFIG_HANDLE vb) {
     return vb->password;
 }
 
+int64_t vbucket_config_get_rev(VBUCKET_CONFIG_HANDLE vb) {
+    return vb->rev;
+}
+
+uint64_t vbucket_config_get_fingerprint(VBUCKET_CONFIG_HANDLE vb) {
+    return vb->fingerprint;
+}
+
 int vbucket_get_vbucket_by_key(VBUCKET_CONFIG_HANDLE vb, const void *key, size_t nkey) {
-    /* call crc32 directly here it could be changed to some more general
-     * function when vbucket distribution will support multiple hashing
-     * algorithms */
-    uint32_t digest = hash_crc32(key, nkey);
-    return digest & vb->mask;
+    return vb->hash(key, nkey) & vb->mask;
+}
+
+int vbucket_get_vbucket_by_keyv(VBUCKET_CONFIG_HANDLE vb,
+                                const vbucket_iovec_t *iov, int niov) {
+    return vb->hash_iov(iov, niov) & vb->mask;
+}
+
+int vbucket_map_hashes(VBUCKET_CONFIG_HANDLE vb, const uint32_t *hashes,
+                       size_t n, int *vbucket_ids, int *server_idxs)
+{
+    int servers[MAP_BATCH_SIZE];
+    size_t ii, jj, nbatch;
+    int vbucket, server;
+
+    if (vb->distribution != VBUCKET_DISTRIBUTION_KETAMA) {
+        for (ii = 0; ii < n; ++ii) {
+            vbucket_map_hashed(vb, hashes[ii], &vbucket, &server);
+            if (vbucket_ids) {
+                vbucket_ids[ii] = vbucket;
+            }
+            if (server_idxs) {
+                server_idxs[ii] = server;
+            }
+        }
+        return 0;
+    }
+
+    for (ii = 0; ii < n; ii += nbatch) {
+        nbatch = n - ii < MAP_BATCH_SIZE ? n - ii : MAP_BATCH_SIZE;
+        ketama_lookup_batch(vb, hashes + ii, servers, (int)nbatch);
+        for (jj = 0; jj < nbatch; ++jj) {
+            if (atomic_load_int(&vb->num_ejected) > 0 && is_ejected(vb, servers[jj])) {
+                servers[jj] = ketama_live_server(vb, hashes[ii + jj], servers[jj]);
+            }
+            if (vbucket_ids) {
+                vbucket_ids[ii + jj] = 0;
+            }
+            if (server_idxs) {
+                server_idxs[ii + jj] = servers[jj];
+            }
+        }
+    }
+    return 0;
+}
+
+int vbucket_get_vbuckets_by_keys(VBUCKET_CONFIG_HANDLE vb,
+                                 const void * const *keys,
+                                 const size_t *nkeys,
+                                 size_t n,
+                                 int *vbucket_ids,
+                                 int *server_idxs) {
+    uint32_t digests[MAP_BATCH_SIZE];
+    size_t ii, jj, nbatch;
+
+    for (ii = 0; ii < n; ii += nbatch) {
+        nbatch = n - ii < MAP_BATCH_SIZE ? n - ii : MAP_BATCH_SIZE;
+        if (vb->hash == hash_crc32) {
+            hash_crc32_multi((const char * const *)keys + ii, nkeys + ii,
+                             nbatch, digests);
+        } else if (vb->hash == hash_crc32_wide) {
+            hash_crc32_wide_multi((const char * const *)keys + ii, nkeys + ii,
+                                  nbatch, digests);
+        } else if (vb->hash == hash_ketama) {
+            hash_ketama_multi((const char * const *)keys + ii, nkeys + ii,
+                              nbatch, digests);
+        } else {
+            for (jj = 0; jj < nbatch; ++jj) {
+                digests[jj] = vb->hash(keys[ii + jj], nkeys[ii + jj]);
+            }
+        }
+        vbucket_map_hashes(vb, digests, nbatch,
+                           vbucket_ids ? vbucket_ids + ii : NULL,
+                           server_idxs ? server_idxs + ii : NULL);
+    }
+    return 0;
+}
+
+int vbucket_generate_key(VBUCKET_CONFIG_HANDLE vb, int vbucket,
+                         const char *prefix, size_t nprefix,
+                         char *buf, size_t nbuf) {
+    uint32_t mask, value;
+    size_t nkey = nprefix + HASH_CRC32_SUFFIX_LENGTH;
+
+    if (vb->distribution != VBUCKET_DISTRIBUTION_VBUCKET ||
+        vbucket < 0 || vbucket >= vb->num_vbuckets || nbuf < nkey) {
+        return -1;
+    }
+
+    /* the vbucket id is a few bits of the crc, see crc32.c */
+    if (vb->hash == hash_crc32) {
+        if (vbucket > 0x7fff) {
+            /* never reached by the 15 bit hash */
+            return -1;
+        }
+        mask = (uint32_t)(vb->mask & 0x7fff) << 16;
+        value = (uint32_t)vbucket << 16;
+    } else if (vb->hash == hash_crc32_wide) {
+        mask = ((uint32_t)vb->mask << 16) | ((uint32_t)vb->mask >> 16);
+        value = ((uint32_t)vbucket << 16) | ((uint32_t)vbucket >> 16);
+    } else {
+        return -1;
+    }
+
+    memmove(buf, prefix, nprefix);
+    if (hash_crc32_suffix(buf, nprefix, mask, value, buf + nprefix) != 0) {
+        return -1;
+    }
+    if (nbuf > nkey) {
+        buf[nkey] = '\0';
+    }
+    return (int)nkey;
 }
 
 int vbucket_get_master(VBUCKET_CONFIG_HANDLE vb, int vbucket) {
@@ -805,6 +3242,64 @@ int vbucket_found_incorrect_master(VBUCKET_CONFIG_HANDLE vb, int vbucket,
     return rv;
 }
 
+int vbucket_config_get_server_shares(VBUCKET_CONFIG_HANDLE vb, double *shares)
+{
+    int i, nreachable;
+
+    for (i = 0; i < vb->num_servers; ++i) {
+        shares[i] = 0;
+    }
+
+    if (vb->distribution == VBUCKET_DISTRIBUTION_KETAMA) {
+        /* every point owns the arc from the previous point (exclusive) to
+         * itself, the first one also owns the wrap around arc */
+        if (vb->num_continuum == 0) {
+            return -1;
+        }
+        shares[vb->continuum[0].index] +=
+            (double)vb->continuum[0].point + 1 +
+            (4294967296.0 - 1 - vb->continuum[vb->num_continuum - 1].point);
+        for (i = 1; i < vb->num_continuum; ++i) {
+            shares[vb->continuum[i].index] +=
+                (double)(vb->continuum[i].point - vb->continuum[i - 1].point);
+        }
+        for (i = 0; i < vb->num_servers; ++i) {
+            shares[i] /= 4294967296.0;
+        }
+        return 0;
+    }
+    if (vb->distribution == VBUCKET_DISTRIBUTION_JUMP) {
+        for (i = 0; i < vb->num_servers; ++i) {
+            shares[i] = 1.0 / vb->num_servers;
+        }
+        return 0;
+    }
+    if (vb->distribution == VBUCKET_DISTRIBUTION_MAGLEV) {
+        /* slots are reached in proportion to their width, which differs
+         * by at most one in 2^32 / maglev_size */
+        for (i = 0; i < (int)vb->maglev_size; ++i) {
+            shares[vb->maglev_table[i]] += 1.0 / vb->maglev_size;
+        }
+        return 0;
+    }
+
+    if (vb->num_vbuckets == 0) {
+        return -1;
+    }
+    /* the 15 bit crc never reaches the upper vbuckets of larger maps */
+    nreachable = vb->num_vbuckets;
+    if (vb->hash == hash_crc32 && nreachable > 0x8000) {
+        nreachable = 0x8000;
+    }
+    for (i = 0; i < nreachable; ++i) {
+        int master = vb->vbuckets[i].servers[0];
+        if (master >= 0) {
+            shares[master] += 1.0 / nreachable;
+        }
+    }
+    return 0;
+}
+
 static void compute_vb_list_diff(VBUCKET_CONFIG_HANDLE from,
                                  VBUCKET_CONFIG_HANDLE to,
                                  char **out) {
@@ -892,3 +3387,252 @@ void vbucket_free_diff(VBUCKET_CONFIG_DIFF *diff) {
     free_array_helper(diff->servers_removed);
     free(diff);
 }
+
+static int authority_cmp(const void *s1, const void *s2)
+{
+    return strcmp((*(struct server_st * const *)s1)->authority,
+                  (*(struct server_st * const *)s2)->authority);
+}
+
+/*
+ * The index in "to" of every server of "from" with the same authority,
+ * -1 for the servers that are gone.
+ */
+static int *match_servers(VBUCKET_CONFIG_HANDLE from, VBUCKET_CONFIG_HANDLE to)
+{
+    struct server_st **sfrom, **sto;
+    int *match, ii, jj, cmp;
+
+    match = malloc((from->num_servers + 1) * sizeof(int));
+    sfrom = malloc((from->num_servers + 1) * sizeof(struct server_st *));
+    sto = malloc((to->num_servers + 1) * sizeof(struct server_st *));
+    if (match == NULL || sfrom == NULL || sto == NULL) {
+        free(match);
+        free(sfrom);
+        free(sto);
+        return NULL;
+    }
+    for (ii = 0; ii < from->num_servers; ++ii) {
+        sfrom[ii] = from->servers + ii;
+        match[ii] = -1;
+    }
+    for (jj = 0; jj < to->num_servers; ++jj) {
+        sto[jj] = to->servers + jj;
+    }
+    qsort(sfrom, from->num_servers, sizeof(struct server_st *), authority_cmp);
+    qsort(sto, to->num_servers, sizeof(struct server_st *), authority_cmp);
+
+    ii = jj = 0;
+    while (ii < from->num_servers && jj < to->num_servers) {
+        cmp = strcmp(sfrom[ii]->authority, sto[jj]->authority);
+        if (cmp == 0) {
+            match[sfrom[ii] - from->servers] = (int)(sto[jj] - to->servers);
+        }
+        if (cmp <= 0) {
+            ++ii;
+        }
+        if (cmp >= 0) {
+            ++jj;
+        }
+    }
+    free(sfrom);
+    free(sto);
+    return match;
+}
+
+static int server_moved(const int *match, int from_server, int to_server)
+{
+    if (from_server < 0 || to_server < 0) {
+        return from_server != to_server;
+    }
+    return match[from_server] != to_server;
+}
+
+/*
+ * A hash picks its vbucket with its low bits, so all the residues modulo
+ * the larger map are equally likely, up to what the 15 bit crc reaches.
+ */
+static double vbucket_remap_fraction(VBUCKET_CONFIG_HANDLE from,
+                                     VBUCKET_CONFIG_HANDLE to,
+                                     const int *match)
+{
+    int nn = from->num_vbuckets > to->num_vbuckets ?
+        from->num_vbuckets : to->num_vbuckets;
+    int ii, moved = 0;
+
+    if (from->hash == hash_crc32 && nn > 0x8000) {
+        nn = 0x8000;
+    }
+    for (ii = 0; ii < nn; ++ii) {
+        moved += server_moved(match, vbucket_get_master(from, ii & from->mask),
+                              vbucket_get_master(to, ii & to->mask));
+    }
+    return (double)moved / nn;
+}
+
+/* the server of the digests up to the continuum point ii */
+static int ketama_arc_owner(VBUCKET_CONFIG_HANDLE vb, int ii, uint32_t digest)
+{
+    int server = vb->continuum[ii % vb->num_continuum].index;
+
+    if (atomic_load_int(&vb->num_ejected) > 0 && is_ejected(vb, server)) {
+        server = ketama_live_server(vb, digest, server);
+    }
+    return server;
+}
+
+/*
+ * Walk both continua in order: between two consecutive points of either
+ * one every digest has the same server in each, the owner of the next
+ * point of that continuum.
+ */
+static double ketama_remap_fraction(VBUCKET_CONFIG_HANDLE from,
+                                    VBUCKET_CONFIG_HANDLE to,
+                                    const int *match)
+{
+    const struct continuum_item_st *cfrom = from->continuum, *cto = to->continuum;
+    const uint64_t end = (uint64_t)1 << 32;
+    uint64_t lo = 0, hi, moved = 0;
+    int ii = 0, jj = 0;
+
+    if (from->num_continuum == 0 || to->num_continuum == 0) {
+        return from->num_continuum == to->num_continuum ? 0 : 1;
+    }
+    while (ii < from->num_continuum || jj < to->num_continuum) {
+        hi = ii < from->num_continuum ? cfrom[ii].point : end;
+        if (jj < to->num_continuum && cto[jj].point < hi) {
+            hi = cto[jj].point;
+        }
+        if (server_moved(match, ketama_arc_owner(from, ii, (uint32_t)hi),
+                         ketama_arc_owner(to, jj, (uint32_t)hi))) {
+            moved += hi - lo + 1;
+        }
+        lo = hi + 1;
+        while (ii < from->num_continuum && cfrom[ii].point == hi) {
+            ++ii;
+        }
+        while (jj < to->num_continuum && cto[jj].point == hi) {
+            ++jj;
+        }
+    }
+    /* the digests after the last points wrap around to the first ones */
+    if (lo < end && server_moved(match, ketama_arc_owner(from, 0, 0xffffffff),
+                                 ketama_arc_owner(to, 0, 0xffffffff))) {
+        moved += end - lo;
+    }
+    return (double)moved / end;
+}
+
+/* the same walk over the hash ranges of the maglev slots */
+static double maglev_remap_fraction(VBUCKET_CONFIG_HANDLE from,
+                                    VBUCKET_CONFIG_HANDLE to,
+                                    const int *match)
+{
+    const uint64_t end = (uint64_t)1 << 32;
+    uint64_t lo = 0, hi, end_from, end_to, moved = 0;
+    uint32_t ii = 0, jj = 0;
+
+    if (from->maglev_size == 0 || to->maglev_size == 0) {
+        return from->maglev_size == to->maglev_size ? 0 : 1;
+    }
+    while (lo < end) {
+        /* slot ii takes the hashes from ceil(ii * 2^32 / size) on */
+        end_from = (((uint64_t)(ii + 1) << 32) + from->maglev_size - 1) / from->maglev_size;
+        end_to = (((uint64_t)(jj + 1) << 32) + to->maglev_size - 1) / to->maglev_size;
+        hi = end_from < end_to ? end_from : end_to;
+        if (server_moved(match, (int)from->maglev_table[ii], (int)to->maglev_table[jj])) {
+            moved += hi - lo;
+        }
+        lo = hi;
+        if (end_from == hi) {
+            ++ii;
+        }
+        if (end_to == hi) {
+            ++jj;
+        }
+    }
+    return (double)moved / end;
+}
+
+/*
+ * Unlike the walks above this is an estimate: the jump points of a key
+ * depend on the whole LCG chain, so the exact count would take all 2^32
+ * hashes. Going from n to m > n buckets a key stays in its bucket with
+ * probability n / m, so every bucket below n that keeps its server keeps
+ * 1 / m of the keys. Going from m to n is the same in reverse.
+ */
+static double jump_estimate_remap_fraction(VBUCKET_CONFIG_HANDLE from,
+                                  VBUCKET_CONFIG_HANDLE to,
+                                  const int *match)
+{
+    int nn = from->num_servers < to->num_servers ? from->num_servers : to->num_servers;
+    int mm = from->num_servers + to->num_servers - nn;
+    int ii, kept = 0;
+
+    if (mm == 0) {
+        return 0;
+    }
+    for (ii = 0; ii < nn; ++ii) {
+        kept += match[ii] == ii;
+    }
+    return 1 - (double)kept / mm;
+}
+
+int vbucket_config_get_remap_fraction(VBUCKET_CONFIG_HANDLE from,
+                                      VBUCKET_CONFIG_HANDLE to,
+                                      double *fraction)
+{
+    int *match;
+
+    if (from->distribution != to->distribution || from->hash != to->hash) {
+        return -1;
+    }
+    match = match_servers(from, to);
+    if (match == NULL) {
+        return -1;
+    }
+    switch (from->distribution) {
+    case VBUCKET_DISTRIBUTION_KETAMA:
+        *fraction = ketama_remap_fraction(from, to, match);
+        break;
+    case VBUCKET_DISTRIBUTION_JUMP:
+        *fraction = jump_estimate_remap_fraction(from, to, match);
+        break;
+    case VBUCKET_DISTRIBUTION_MAGLEV:
+        *fraction = maglev_remap_fraction(from, to, match);
+        break;
+    default:
+        *fraction = vbucket_remap_fraction(from, to, match);
+    }
+    free(match);
+    return 0;
+}
+
+int vbucket_config_count_remapped_keys(VBUCKET_CONFIG_HANDLE from,
+                                       VBUCKET_CONFIG_HANDLE to,
+                                       const void * const *keys,
+                                       const size_t *nkeys,
+                                       size_t n,
+                                       size_t *nmoved)
+{
+    int servers_from[MAP_BATCH_SIZE], servers_to[MAP_BATCH_SIZE];
+    size_t ii, jj, nbatch;
+    int *match = match_servers(from, to);
+
+    if (match == NULL) {
+        return -1;
+    }
+    *nmoved = 0;
+    for (ii = 0; ii < n; ii += nbatch) {
+        nbatch = n - ii < MAP_BATCH_SIZE ? n - ii : MAP_BATCH_SIZE;
+        vbucket_get_vbuckets_by_keys(from, keys + ii, nkeys + ii, nbatch,
+                                     NULL, servers_from);
+        vbucket_get_vbuckets_by_keys(to, keys + ii, nkeys + ii, nbatch,
+                                     NULL, servers_to);
+        for (jj = 0; jj < nbatch; ++jj) {
+            *nmoved += server_moved(match, servers_from[jj], servers_to[jj]);
+        }
+    }
+    free(match);
+    return 0;
+}
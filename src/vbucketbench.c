@@ -0,0 +1,258 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libvbucket/vbucket.h>
+
+#define DEFAULT_LOOKUPS (4 * 1048576)
+#define PARSE_SERVERS 16
+#define PARSE_REPLICAS 2
+
+static void usage(void) {
+    printf("vbucketbench map [-l lookups] (mapfile | nodes)\n");
+    printf("vbucketbench parse [-r rounds] [vbuckets ...]\n\n");
+    printf("  map times mapping random key hashes one at a time with\n");
+    printf("  vbucket_map_hashed() and in batches with vbucket_map_hashes(),\n");
+    printf("  for ketama configs with and without the continuum index.\n");
+    printf("  Instead of a mapfile a number of ketama nodes can be given.\n\n");
+    printf("  parse times parsing vbucket maps with a forward map of the given\n");
+    printf("  sizes, 1024, 16384 and 65536 vbuckets by default, and peeking\n");
+    printf("  at their rev and fingerprint with vbucket_config_peek().\n\n");
+    printf("  Examples:\n");
+    printf("    ./vbucketbench map file.json\n\n");
+    printf("    ./vbucketbench map -l 1000000 500\n\n");
+    printf("    ./vbucketbench parse -r 10 4096\n");
+    exit(1);
+}
+
+static double elapsed_ns(clock_t start, size_t n) {
+    return (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / n;
+}
+
+/* a ketama config of nnodes made up nodes */
+static VBUCKET_CONFIG_HANDLE ketama_config(int nnodes) {
+    VBUCKET_CONFIG_HANDLE vb;
+    size_t size = 64 + (size_t)nnodes * 80, len;
+    char *config = malloc(size);
+    int i;
+
+    if (config == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate config\n");
+        exit(1);
+    }
+    len = snprintf(config, size, "{\"nodeLocator\": \"ketama\", \"nodes\": [");
+    for (i = 0; i < nnodes; ++i) {
+        len += snprintf(config + len, size - len,
+                        "%s{\"hostname\": \"10.0.%d.%d:8091\", "
+                        "\"ports\": {\"direct\": 11210}}",
+                        i > 0 ? ", " : "", i / 256, i % 256);
+    }
+    snprintf(config + len, size - len, "]}");
+    vb = vbucket_config_parse_string(config);
+    free(config);
+    return vb;
+}
+
+static void bench_map(VBUCKET_CONFIG_HANDLE vb, const uint32_t *hashes,
+                      int *scalar, int *batched, size_t n, const char *what) {
+    double scalar_ns, batched_ns;
+    clock_t start;
+    size_t i;
+
+    start = clock();
+    for (i = 0; i < n; ++i) {
+        vbucket_map_hashed(vb, hashes[i], NULL, &scalar[i]);
+    }
+    scalar_ns = elapsed_ns(start, n);
+
+    start = clock();
+    vbucket_map_hashes(vb, hashes, n, NULL, batched);
+    batched_ns = elapsed_ns(start, n);
+
+    if (memcmp(scalar, batched, n * sizeof(int)) != 0) {
+        fprintf(stderr, "ERROR: batched lookups differ from scalar ones\n");
+        exit(1);
+    }
+    printf("%-14s scalar: %6.1f ns  batched: %6.1f ns  speedup: %.2fx\n",
+           what, scalar_ns, batched_ns, scalar_ns / batched_ns);
+}
+
+static void map_command(int argc, char **argv) {
+    VBUCKET_CONFIG_HANDLE vb;
+    size_t n = DEFAULT_LOOKUPS, i;
+    uint32_t *hashes, x = 2463534242U;
+    int *scalar, *batched;
+    char *end;
+    int argi = 0, nnodes;
+
+    if (argi + 1 < argc && strcmp(argv[argi], "-l") == 0) {
+        n = strtoul(argv[argi + 1], NULL, 10);
+        argi += 2;
+    }
+    if (argi >= argc || n == 0) {
+        usage();
+    }
+
+    nnodes = (int)strtol(argv[argi], &end, 10);
+    if (*end == '\0' && nnodes > 0) {
+        vb = ketama_config(nnodes);
+    } else {
+        vb = vbucket_config_parse_file(argv[argi]);
+    }
+    if (vb == NULL) {
+        fprintf(stderr, "ERROR: vbucket_config_parse_file error: %s\n", vbucket_get_error());
+        exit(1);
+    }
+
+    hashes = malloc(n * sizeof(uint32_t));
+    scalar = malloc(n * sizeof(int));
+    batched = malloc(n * sizeof(int));
+    if (hashes == NULL || scalar == NULL || batched == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate %lu lookups\n", (unsigned long)n);
+        exit(1);
+    }
+    for (i = 0; i < n; ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        hashes[i] = x;
+    }
+
+    printf("servers: %d lookups: %lu\n", vbucket_config_get_num_servers(vb),
+           (unsigned long)n);
+    if (vbucket_config_get_distribution_type(vb) == VBUCKET_DISTRIBUTION_KETAMA) {
+        bench_map(vb, hashes, scalar, batched, n, "with index");
+        vbucket_config_set_ketama_index_bits(vb, 0);
+        bench_map(vb, hashes, scalar, batched, n, "without index");
+    } else {
+        bench_map(vb, hashes, scalar, batched, n, "vbucket");
+    }
+
+    free(hashes);
+    free(scalar);
+    free(batched);
+    vbucket_config_destroy(vb);
+}
+
+static void append_map(char *config, size_t *len, size_t size, int nvbuckets, int shift) {
+    int i, j;
+
+    for (i = 0; i < nvbuckets; ++i) {
+        *len += snprintf(config + *len, size - *len, "%s[", i > 0 ? "," : "");
+        for (j = 0; j <= PARSE_REPLICAS; ++j) {
+            *len += snprintf(config + *len, size - *len, "%s%d", j > 0 ? "," : "",
+                             (i + j + shift) % PARSE_SERVERS);
+        }
+        *len += snprintf(config + *len, size - *len, "]");
+    }
+}
+
+/* a vbucket map of nvbuckets with a forward map */
+static char *vbucket_config(int nvbuckets) {
+    size_t size = 256 + (size_t)PARSE_SERVERS * 32 + (size_t)nvbuckets * 64, len;
+    char *config = malloc(size);
+    int i;
+
+    if (config == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate config\n");
+        exit(1);
+    }
+    len = snprintf(config, size, "{\"rev\": 1, \"hashAlgorithm\": \"CRC\", "
+                   "\"numReplicas\": %d, \"serverList\": [", PARSE_REPLICAS);
+    for (i = 0; i < PARSE_SERVERS; ++i) {
+        len += snprintf(config + len, size - len, "%s\"10.0.0.%d:11210\"",
+                        i > 0 ? ", " : "", i);
+    }
+    len += snprintf(config + len, size - len, "], \"vBucketMap\": [");
+    append_map(config, &len, size, nvbuckets, 0);
+    len += snprintf(config + len, size - len, "], \"vBucketMapForward\": [");
+    append_map(config, &len, size, nvbuckets, 1);
+    snprintf(config + len, size - len, "]}");
+    return config;
+}
+
+static void parse_command(int argc, char **argv) {
+    static const char *default_sizes[] = { "1024", "16384", "65536" };
+    const char **sizes = default_sizes;
+    VBUCKET_CONFIG_HANDLE vb;
+    int nsizes = 3, rounds = 20, argi = 0, nvbuckets, i, r;
+    uint64_t fingerprint;
+    int64_t rev;
+    clock_t start;
+    double ms, peek_us;
+    size_t nconfig;
+    char *config;
+
+    if (argi + 1 < argc && strcmp(argv[argi], "-r") == 0) {
+        rounds = atoi(argv[argi + 1]);
+        argi += 2;
+    }
+    if (rounds < 1) {
+        usage();
+    }
+    if (argi < argc) {
+        sizes = (const char **)argv + argi;
+        nsizes = argc - argi;
+    }
+
+    for (i = 0; i < nsizes; ++i) {
+        nvbuckets = atoi(sizes[i]);
+        if (nvbuckets < 1) {
+            usage();
+        }
+        config = vbucket_config(nvbuckets);
+        nconfig = strlen(config);
+        start = clock();
+        for (r = 0; r < rounds; ++r) {
+            vb = vbucket_config_parse_string(config);
+            if (vb == NULL) {
+                fprintf(stderr, "ERROR: vbucket_config_parse_string error: %s\n",
+                        vbucket_get_error());
+                exit(1);
+            }
+            vbucket_config_destroy(vb);
+        }
+        ms = (double)(clock() - start) / CLOCKS_PER_SEC * 1e3 / rounds;
+
+        start = clock();
+        for (r = 0; r < rounds * 10; ++r) {
+            if (vbucket_config_peek(config, nconfig, &rev, &fingerprint) != 0) {
+                fprintf(stderr, "ERROR: vbucket_config_peek failed\n");
+                exit(1);
+            }
+        }
+        peek_us = (double)(clock() - start) / CLOCKS_PER_SEC * 1e6 / (rounds * 10);
+        printf("vbuckets: %6d  bytes: %8lu  parse: %8.3f ms  per vbucket: %6.1f ns"
+               "  peek: %8.1f us\n", nvbuckets, (unsigned long)nconfig, ms,
+               ms * 1e6 / nvbuckets, peek_us);
+        free(config);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "map") == 0) {
+        map_command(argc - 2, argv + 2);
+    } else if (argc > 1 && strcmp(argv[1], "parse") == 0) {
+        parse_command(argc - 2, argv + 2);
+    } else {
+        usage();
+    }
+    return 0;
+}
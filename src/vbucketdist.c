@@ -0,0 +1,353 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include <libvbucket/vbucket.h>
+
+#define CHUNK_SIZE (16 * 1048576)
+#define BATCH_SIZE 64
+#define MAX_THREADS 64
+#define KEY_MAX_LENGTH 250      /* the longest key memcached takes */
+
+struct worker_st {
+    VBUCKET_CONFIG_HANDLE vb;
+    const char *begin;          /* whole lines of the current chunk */
+    const char *end;
+    unsigned long long *vbucket_counts;
+    unsigned long long *server_counts;
+    unsigned long long nkeys;
+    unsigned long long nlong;   /* lines too long to be keys */
+#ifndef _WIN32
+    pthread_t tid;
+    int running;                /* tid is counting the chunk */
+#endif
+};
+
+static void *count_keys(void *arg) {
+    struct worker_st *w = arg;
+    const void *keys[BATCH_SIZE];
+    size_t nkeys[BATCH_SIZE];
+    int vbuckets[BATCH_SIZE], servers[BATCH_SIZE];
+    const char *p = w->begin, *eol;
+    int n, i;
+
+    while (p < w->end) {
+        for (n = 0; n < BATCH_SIZE && p < w->end; p = eol + 1) {
+            eol = memchr(p, '\n', w->end - p);
+            if (eol == NULL) {
+                eol = w->end;
+            }
+            keys[n] = p;
+            nkeys[n] = eol - p;
+            if (nkeys[n] > 0 && p[nkeys[n] - 1] == '\r') {
+                --nkeys[n];
+            }
+            if (nkeys[n] > KEY_MAX_LENGTH) {
+                ++w->nlong;
+            } else if (nkeys[n] > 0) {
+                ++n;
+            }
+        }
+        vbucket_get_vbuckets_by_keys(w->vb, keys, nkeys, n, vbuckets, servers);
+        for (i = 0; i < n; ++i) {
+            ++w->vbucket_counts[vbuckets[i]];
+            if (servers[i] >= 0) {
+                ++w->server_counts[servers[i]];
+            }
+        }
+        w->nkeys += n;
+    }
+    return NULL;
+}
+
+/*
+ * split the chunk at line boundaries and start counting it on all the
+ * workers, count_chunk_wait() returns when they are done. The caller
+ * reads the next chunk into another buffer in the meantime.
+ */
+static void count_chunk_start(struct worker_st *workers, int nthreads,
+                              const char *data, size_t size) {
+    const char *p = data, *end = data + size;
+    int i;
+
+    for (i = 0; i < nthreads; ++i) {
+        const char *stop = (i == nthreads - 1) ? end : p + (end - p) / (nthreads - i);
+        while (stop < end && *stop != '\n') {
+            ++stop;
+        }
+        workers[i].begin = p;
+        workers[i].end = stop;
+        p = stop < end ? stop + 1 : end;
+    }
+
+    for (i = 0; i < nthreads; ++i) {
+#ifndef _WIN32
+        workers[i].running =
+            pthread_create(&workers[i].tid, NULL, count_keys, &workers[i]) == 0;
+        if (!workers[i].running) {
+            count_keys(&workers[i]);
+        }
+#else
+        count_keys(&workers[i]);
+#endif
+    }
+}
+
+static void count_chunk_wait(struct worker_st *workers, int nthreads) {
+#ifndef _WIN32
+    int i;
+
+    for (i = 0; i < nthreads; ++i) {
+        if (workers[i].running) {
+            pthread_join(workers[i].tid, NULL);
+            workers[i].running = 0;
+        }
+    }
+#else
+    (void)workers;
+    (void)nthreads;
+#endif
+}
+
+static void print_summary(const char *what, const unsigned long long *counts, int n) {
+    double mean, var = 0;
+    unsigned long long total = 0, min = (unsigned long long)-1, max = 0;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        total += counts[i];
+        if (counts[i] < min) {
+            min = counts[i];
+        }
+        if (counts[i] > max) {
+            max = counts[i];
+        }
+    }
+    mean = (double)total / n;
+    for (i = 0; i < n; ++i) {
+        var += (counts[i] - mean) * (counts[i] - mean);
+    }
+    var /= n;
+
+    printf("%s: %d min: %llu max: %llu mean: %.2f max/mean: %.4f cv: %.4f\n",
+           what, n, min, max, mean, mean > 0 ? max / mean : 0,
+           mean > 0 ? sqrt(var) / mean : 0);
+}
+
+int main(int argc, char **argv) {
+    VBUCKET_CONFIG_HANDLE vb = NULL;
+    struct worker_st workers[MAX_THREADS];
+    unsigned long long *vbucket_counts, *server_counts, nkeys = 0, nlong = 0;
+    double *shares;
+    int num_vbuckets, num_servers, nthreads = 1, verbose = 0;
+    int argi = 1, i, t, cur = 0, counting = 0, skipping = 0;
+    size_t nread, carry = 0;
+    char *buf[2], *eol;
+    FILE *fp;
+
+#ifndef _WIN32
+    nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    while (argi < argc && argv[argi][0] == '-' && argv[argi][1] != '\0') {
+        if (strcmp(argv[argi], "-t") == 0 && argi + 1 < argc) {
+            nthreads = atoi(argv[argi + 1]);
+            argi += 2;
+        } else if (strcmp(argv[argi], "-v") == 0) {
+            verbose = 1;
+            ++argi;
+        } else {
+            break;
+        }
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    } else if (nthreads > MAX_THREADS) {
+        nthreads = MAX_THREADS;
+    }
+
+    if (argc - argi < 2) {
+        printf("vbucketdist [-t threads] [-v] mapfile keyfile\n\n");
+        printf("  vbucketdist maps every line of keyfile with the vBucketServerMap\n");
+        printf("  JSON mapfile and reports how evenly the keys spread across the\n");
+        printf("  vbuckets and servers, next to the share of the hash space each\n");
+        printf("  server owns. Use -v to list the count of every vbucket.\n");
+        printf("  Lines longer than %d bytes aren't keys and are skipped.\n",
+               KEY_MAX_LENGTH);
+        printf("  You may use '-' instead for the keyfile to specify stdin.\n\n");
+        printf("  Examples:\n");
+        printf("    ./vbucketdist file.json keys.txt\n\n");
+        printf("    ./vbucketdist -t 4 file.json - < keys.txt\n");
+        exit(1);
+    }
+
+    vb = vbucket_config_parse_file(argv[argi]);
+    if (vb == NULL) {
+        fprintf(stderr, "ERROR: vbucket_config_parse_file error: %s\n", vbucket_get_error());
+        exit(1);
+    }
+
+    if (strcmp("-", argv[argi + 1]) == 0) {
+        fp = stdin;
+    } else if ((fp = fopen(argv[argi + 1], "rb")) == NULL) {
+        fprintf(stderr, "ERROR: cannot open key file \"%s\"\n", argv[argi + 1]);
+        exit(1);
+    }
+
+    num_servers = vbucket_config_get_num_servers(vb);
+    num_vbuckets = vbucket_config_get_num_vbuckets(vb);
+    if (num_vbuckets == 0) {
+        num_vbuckets = 1;
+    }
+    for (t = 0; t < nthreads; ++t) {
+        workers[t].vb = vb;
+        workers[t].nkeys = 0;
+        workers[t].nlong = 0;
+#ifndef _WIN32
+        workers[t].running = 0;
+#endif
+        workers[t].vbucket_counts = calloc(num_vbuckets, sizeof(unsigned long long));
+        workers[t].server_counts = calloc(num_servers, sizeof(unsigned long long));
+        if (workers[t].vbucket_counts == NULL || workers[t].server_counts == NULL) {
+            fprintf(stderr, "ERROR: failed to allocate counters\n");
+            exit(1);
+        }
+    }
+
+    /* the workers count one buffer while the next chunk is read into the other */
+    for (i = 0; i < 2; ++i) {
+        buf[i] = malloc(CHUNK_SIZE);
+        if (buf[i] == NULL) {
+            fprintf(stderr, "ERROR: failed to allocate read buffer\n");
+            exit(1);
+        }
+    }
+    /* count whole lines of every chunk, keep the partial line for later */
+    while ((nread = fread(buf[cur] + carry, 1, CHUNK_SIZE - carry, fp)) > 0 || carry > 0) {
+        size_t size = carry + nread, whole = size;
+        if (skipping) {
+            /* drop the rest of a line that didn't fit in a chunk */
+            eol = memchr(buf[cur], '\n', size);
+            if (eol == NULL) {
+                carry = 0;
+                continue;
+            }
+            skipping = 0;
+            size -= eol + 1 - buf[cur];
+            memmove(buf[cur], eol + 1, size);
+            whole = size;
+        }
+        if (nread > 0) {
+            while (whole > 0 && buf[cur][whole - 1] != '\n') {
+                --whole;
+            }
+            if (whole == 0) {
+                carry = size;
+                if (size == CHUNK_SIZE) {
+                    /* far too long for a key, skip to the next line */
+                    ++nlong;
+                    skipping = 1;
+                    carry = 0;
+                }
+                continue;
+            }
+        }
+        /* the other buffer is free once the previous chunk is counted */
+        if (counting) {
+            count_chunk_wait(workers, nthreads);
+        }
+        carry = size - whole;
+        memcpy(buf[!cur], buf[cur] + whole, carry);
+        count_chunk_start(workers, nthreads, buf[cur], whole);
+        counting = 1;
+        cur = !cur;
+    }
+    if (counting) {
+        count_chunk_wait(workers, nthreads);
+    }
+    free(buf[0]);
+    free(buf[1]);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+
+    vbucket_counts = workers[0].vbucket_counts;
+    server_counts = workers[0].server_counts;
+    for (t = 0; t < nthreads; ++t) {
+        nkeys += workers[t].nkeys;
+        nlong += workers[t].nlong;
+        if (t > 0) {
+            for (i = 0; i < num_vbuckets; ++i) {
+                vbucket_counts[i] += workers[t].vbucket_counts[i];
+            }
+            for (i = 0; i < num_servers; ++i) {
+                server_counts[i] += workers[t].server_counts[i];
+            }
+            free(workers[t].vbucket_counts);
+            free(workers[t].server_counts);
+        }
+    }
+
+    shares = calloc(num_servers, sizeof(double));
+    vbucket_config_get_server_shares(vb, shares);
+
+    if (nlong > 0) {
+        fprintf(stderr, "WARNING: skipped %llu lines longer than %d bytes\n",
+                nlong, KEY_MAX_LENGTH);
+    }
+    printf("keys: %llu\n", nkeys);
+    switch (vbucket_config_get_distribution_type(vb)) {
+    case VBUCKET_DISTRIBUTION_KETAMA:
+        printf("distribution: ketama\n");
+        break;
+    case VBUCKET_DISTRIBUTION_JUMP:
+        printf("distribution: jump\n");
+        break;
+    case VBUCKET_DISTRIBUTION_MAGLEV:
+        printf("distribution: maglev\n");
+        break;
+    default:
+        printf("distribution: vbucket\n");
+    }
+    print_summary("servers", server_counts, num_servers);
+    if (vbucket_config_get_distribution_type(vb) == VBUCKET_DISTRIBUTION_VBUCKET) {
+        print_summary("vbuckets", vbucket_counts, num_vbuckets);
+    }
+    for (i = 0; i < num_servers; ++i) {
+        printf("server: %s keys: %llu share: %.4f hash space: %.4f\n",
+               vbucket_config_get_server(vb, i), server_counts[i],
+               nkeys > 0 ? (double)server_counts[i] / nkeys : 0, shares[i]);
+    }
+    if (verbose && vbucket_config_get_distribution_type(vb) == VBUCKET_DISTRIBUTION_VBUCKET) {
+        for (i = 0; i < num_vbuckets; ++i) {
+            printf("vBucketId: %d keys: %llu\n", i, vbucket_counts[i]);
+        }
+    }
+
+    free(shares);
+    free(vbucket_counts);
+    free(server_counts);
+    vbucket_config_destroy(vb);
+
+    return 0;
+}
@@ -22,6 +22,54 @@
 #include <libvbucket/vbucket.h>
 
 size_t MAX_KEY_SIZE = 14;
+#define MAX_GENERATED_KEY_SIZE 32
+
+/*
+ * Hash algorithms vbucket_generate_key() can't invert are handled by
+ * hashing "key_%010d" strings until every vbucket got enough of them.
+ */
+static int search_keys(VBUCKET_CONFIG_HANDLE vb, int num_vbuckets,
+                       int num_keys_per_vbucket, int num_keys_to_generate) {
+    char ***keys;
+    int *nkeys;
+    int i, j, v, total;
+    char *key;
+
+    /* allocate memory and set each key to null since strdup will allocate that */
+    keys = malloc(sizeof(char**) * num_vbuckets);
+    nkeys = calloc(num_vbuckets, sizeof(int));
+    for (i = 0; i < num_vbuckets; i++) {
+        keys[i] = calloc(num_keys_per_vbucket, sizeof(char*));
+    }
+
+    /* generate keys and copy them to the keys structure */
+    key = malloc(sizeof(char) * (MAX_KEY_SIZE+1));
+    for (i = 0; i < num_keys_to_generate; i++) {
+        snprintf(key, MAX_KEY_SIZE + 1, "key_%010d", i);
+        v = vbucket_get_vbucket_by_key(vb, key, strlen(key));
+        if (nkeys[v] < num_keys_per_vbucket) {
+            keys[v][nkeys[v]++] = strdup(key);
+        }
+    }
+    free(key);
+
+    /* print out <key> <vbucket> and count up total keys
+       so we can check that every vbucket has the correct
+       number of keys */
+    total = 0;
+    for (i = 0; i < num_vbuckets; i++) {
+        for (j = 0 ; j < nkeys[i] ; j++) {
+            printf("%s %d\n", keys[i][j], i);
+            free(keys[i][j]);
+            total++;
+        }
+        free(keys[i]);
+    }
+    free(keys);
+    free(nkeys);
+
+    return total;
+}
 
 int main(int argc, char **argv) {
     VBUCKET_CONFIG_HANDLE vb = NULL;
@@ -29,17 +77,19 @@ int main(int argc, char **argv) {
     int num_keys_per_vbucket;
     int num_keys_to_generate;
     int num_vbuckets;
-    char *** keys;
-    int i, j, v, k, total;
-    char *key;
+    int v, k, nprefix, nkey, total;
+    char key[MAX_GENERATED_KEY_SIZE];
 
-    if (argc < 4) {
-        printf("vbucketkeygen mapfile <keys per vbucket> <keys to generate>\n\n");
+    if (argc < 3) {
+        printf("vbucketkeygen mapfile <keys per vbucket> [<keys to generate>]\n\n");
         printf("  vbucketkeygen will output a list of keys that equally\n");
         printf("    distribute amongst every vbucket.\n\n");
         printf("  vbucketkeygen expects a vBucketServerMap JSON mapfile, and\n");
         printf("  will print the keyname and vBucketId.\n");
         printf("  You may use '-' instead for the filename to specify stdin.\n\n");
+        printf("  Keys are built directly for every vbucket when the map uses\n");
+        printf("  a CRC hash, otherwise up to <keys to generate> candidate keys\n");
+        printf("  are hashed to find them.\n\n");
         printf("  Examples:\n");
         printf("    ./vbucketkeygen file.json 10 10000\n\n");
         printf("    curl http://HOST:8091/pools/default/buckets/default | \\\n");
@@ -68,41 +118,25 @@ int main(int argc, char **argv) {
 
     rval = 0;
     num_keys_per_vbucket = atoi(argv[2]);
-    num_keys_to_generate = atoi(argv[3]);
+    num_keys_to_generate = argc > 3 ? atoi(argv[3]) : 0;
     num_vbuckets = vbucket_config_get_num_vbuckets(vb);
 
-    /* allocate memory and set each key to null since strdup will allocate that */
-    keys = malloc(sizeof(char***) * num_vbuckets);
-    for (i = 0; i < num_vbuckets; i++) {
-        keys[i] = malloc(sizeof(char**) * num_keys_per_vbucket);
-    }
-    for (i = 0; i < num_vbuckets; i++) {
-        for (j = 0 ; j < num_keys_per_vbucket ; j++) {
-            keys[i][j] = 0;
-        }
-    }
-
-    /* generate keys and copy them to the keys structure */
-    key = malloc(sizeof(char) * (MAX_KEY_SIZE+1));
-    for (i = 0; i < num_keys_to_generate; i++) {
-        snprintf(key, MAX_KEY_SIZE + 1, "key_%010d", i);
-        v = vbucket_get_vbucket_by_key(vb, key, strlen(key));
-        for (k = 0; k < num_keys_per_vbucket; k++) {
-            if (keys[v][k] == 0) {
-                keys[v][k] = strdup(key);
-                break;
-            }
-        }
-    }
-
-    /* print out <key> <vbucket> and count up total keys
-       so we can check that every vbucket has the correct
-       number of keys */
     total = 0;
-    for (i = 0; i < num_vbuckets; i++) {
-        for (j = 0 ; j < num_keys_per_vbucket ; j++) {
-            if (keys[i][j] != 0) {
-                printf("%s %d\n", keys[i][j], i);
+    if (vbucket_generate_key(vb, 0, "key_", 4, key, sizeof(key)) < 0) {
+        total = search_keys(vb, num_vbuckets, num_keys_per_vbucket,
+                            num_keys_to_generate);
+    } else {
+        for (v = 0; v < num_vbuckets; v++) {
+            for (k = 0; k < num_keys_per_vbucket; k++) {
+                nprefix = snprintf(key, sizeof(key), "key_%010d_",
+                                   v * num_keys_per_vbucket + k);
+                nkey = vbucket_generate_key(vb, v, key, nprefix,
+                                            key, sizeof(key));
+                if (nkey < 0) {
+                    /* the vbucket isn't reachable with this hash */
+                    break;
+                }
+                printf("%s %d\n", key, v);
                 total++;
             }
         }
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <strings.h>
+#include <unistd.h>
 
 #include <libvbucket/vbucket.h>
 
@@ -294,6 +295,987 @@ static void testConfigCouchApiBase(void)
     assert(strcmp(vbucket_config_get_server(vb, 2), "192.168.2.123:12004") == 0);
 }
 
+static void testMapKeys(const char *fname)
+{
+    VBUCKET_CONFIG_HANDLE vb = vbucket_config_parse_file(configPath(fname));
+    char buffer[1000][160];
+    const void *keys[1000];
+    size_t nkeys[1000];
+    int vbuckets[1000], servers[1000];
+    int i, j, v, m;
+
+    assert(vb);
+    for (i = 0; i < 1000; ++i) {
+        nkeys[i] = i % 150;
+        for (j = 0; j < (int)nkeys[i]; ++j) {
+            buffer[i][j] = (char)('a' + (i * 7 + j) % 26);
+        }
+        keys[i] = buffer[i];
+    }
+
+    assert(vbucket_get_vbuckets_by_keys(vb, keys, nkeys, 1000, vbuckets, servers) == 0);
+    for (i = 0; i < 1000; ++i) {
+        assert(vbucket_map(vb, keys[i], nkeys[i], &v, &m) == 0);
+        if (vbucket_config_get_distribution_type(vb) == VBUCKET_DISTRIBUTION_VBUCKET) {
+            assert(vbuckets[i] == v);
+        }
+        assert(servers[i] == m);
+    }
+
+    vbucket_config_destroy(vb);
+}
+
+static void testMapHashed(const char *fname)
+{
+    VBUCKET_CONFIG_HANDLE vb = vbucket_config_parse_file(configPath(fname));
+    const struct key_st *k;
+    int i = 0, v, m, hv, hm;
+    uint32_t hash;
+
+    assert(vb);
+    while ((k = &keys[i++])->key != NULL) {
+        hash = vbucket_hash_key(vb, k->key, strlen(k->key));
+        assert(vbucket_map(vb, k->key, strlen(k->key), &v, &m) == 0);
+        assert(vbucket_map_hashed(vb, hash, &hv, &hm) == 0);
+        assert(v == hv);
+        assert(m == hm);
+    }
+
+    vbucket_config_destroy(vb);
+}
+
+static void testMapIovec(const char *fname)
+{
+    VBUCKET_CONFIG_HANDLE vb = vbucket_config_parse_file(configPath(fname));
+    const struct key_st *k;
+    vbucket_iovec_t iov[3];
+    size_t nkey;
+    int i = 0, v, m, iv, im;
+
+    assert(vb);
+    while ((k = &keys[i++])->key != NULL) {
+        nkey = strlen(k->key);
+        iov[0].iov_base = k->key;
+        iov[0].iov_len = nkey / 3;
+        iov[1].iov_base = k->key + iov[0].iov_len;
+        iov[1].iov_len = 0;
+        iov[2].iov_base = k->key + iov[0].iov_len;
+        iov[2].iov_len = nkey - iov[0].iov_len;
+
+        assert(vbucket_map(vb, k->key, nkey, &v, &m) == 0);
+        assert(vbucket_mapv(vb, iov, 3, &iv, &im) == 0);
+        assert(v == iv);
+        assert(m == im);
+        assert(vbucket_hash_keyv(vb, iov, 3) == vbucket_hash_key(vb, k->key, nkey));
+        assert(vbucket_get_vbucket_by_keyv(vb, iov, 3) ==
+               vbucket_get_vbucket_by_key(vb, k->key, nkey));
+    }
+
+    vbucket_config_destroy(vb);
+}
+
+static void testHashAlgorithm(void)
+{
+    VBUCKET_CONFIG_HANDLE vb;
+    const struct key_st *k;
+    uint32_t hash;
+
+    vb = vbucket_config_parse_string("{\"hashAlgorithm\": \"MURMUR3\", "
+                                     "\"numReplicas\": 0, "
+                                     "\"serverList\": [\"server1:11211\"], "
+                                     "\"vBucketMap\": [[0], [0], [0], [0]]}");
+    assert(vb);
+    assert(vbucket_hash_key(vb, "hello", 5) == 0x248bfa47);
+    assert(vbucket_get_vbucket_by_key(vb, "hello", 5) == (0x248bfa47 & 3));
+    vbucket_config_destroy(vb);
+
+    vb = vbucket_config_parse_string("{\"nodeLocator\": \"ketama\", "
+                                     "\"hashAlgorithm\": \"fnv1a\", "
+                                     "\"nodes\": [{\"hostname\": \"h1:8091\", "
+                                     "\"ports\": {\"direct\": 11210}}]}");
+    assert(vb);
+    assert(vbucket_hash_key(vb, "hello", 5) == 0x4f9f2cab);
+    vbucket_config_destroy(vb);
+
+    vb = vbucket_config_parse_string("{\"hashAlgorithm\": \"crc-wide\", "
+                                     "\"numReplicas\": 0, "
+                                     "\"serverList\": [\"server1:11211\"], "
+                                     "\"vBucketMap\": [[0], [0], [0], [0]]}");
+    assert(vb);
+    for (k = keys; k->key != NULL; ++k) {
+        assert(vbucket_get_vbucket_by_key(vb, k->key, strlen(k->key)) == k->vbucket);
+    }
+    vbucket_config_destroy(vb);
+
+    /* typos and hashes the locator can't use are errors */
+    vb = vbucket_config_create();
+    assert(vbucket_config_parse(vb, LIBVBUCKET_SOURCE_MEMORY,
+                                "{\"hashAlgorithm\": \"murmer3\", "
+                                "\"numReplicas\": 0, "
+                                "\"serverList\": [\"server1:11211\"], "
+                                "\"vBucketMap\": [[0], [0], [0], [0]]}") != 0);
+    assert(strcmp(vbucket_get_error_message(vb),
+                  "Unknown hashAlgorithm: \"murmer3\"") == 0);
+    vbucket_config_destroy(vb);
+
+    vb = vbucket_config_create();
+    assert(vbucket_config_parse(vb, LIBVBUCKET_SOURCE_MEMORY,
+                                "{\"hashAlgorithm\": \"md5\", "
+                                "\"numReplicas\": 0, "
+                                "\"serverList\": [\"server1:11211\"], "
+                                "\"vBucketMap\": [[0], [0], [0], [0]]}") != 0);
+    assert(strcmp(vbucket_get_error_message(vb),
+                  "hashAlgorithm \"md5\" can't be used with this nodeLocator") == 0);
+    vbucket_config_destroy(vb);
+
+    vb = vbucket_config_create();
+    assert(vbucket_config_parse(vb, LIBVBUCKET_SOURCE_MEMORY,
+                                "{\"hashAlgorithm\": [\"md5\"], "
+                                "\"numReplicas\": 0, "
+                                "\"serverList\": [\"server1:11211\"], "
+                                "\"vBucketMap\": [[0], [0], [0], [0]]}") != 0);
+    assert(strcmp(vbucket_get_error_message(vb),
+                  "Expected string for hashAlgorithm") == 0);
+    vbucket_config_destroy(vb);
+
+    /* the "CRC" older ketama configs carry leaves them on their default */
+    vb = vbucket_config_parse_string("{\"nodeLocator\": \"ketama\", "
+                                     "\"nodes\": [{\"hostname\": \"h1:8091\", "
+                                     "\"ports\": {\"direct\": 11210}}]}");
+    assert(vb);
+    hash = vbucket_hash_key(vb, "hello", 5);
+    vbucket_config_destroy(vb);
+    vb = vbucket_config_parse_string("{\"nodeLocator\": \"ketama\", "
+                                     "\"hashAlgorithm\": \"CRC\", "
+                                     "\"nodes\": [{\"hostname\": \"h1:8091\", "
+                                     "\"ports\": {\"direct\": 11210}}]}");
+    assert(vb);
+    assert(vbucket_hash_key(vb, "hello", 5) == hash);
+    vbucket_config_destroy(vb);
+}
+
+static void testGenerateKey(void)
+{
+    VBUCKET_CONFIG_HANDLE vb = vbucket_config_parse_file(configPath("config"));
+    char key[32];
+    int i, nkey;
+
+    assert(vb);
+    for (i = 0; i < vbucket_config_get_num_vbuckets(vb); ++i) {
+        nkey = vbucket_generate_key(vb, i, "user:", 5, key, sizeof(key));
+        assert(nkey == 13);
+        assert(strncmp(key, "user:", 5) == 0);
+        assert(strlen(key) == 13);
+        assert(vbucket_get_vbucket_by_key(vb, key, nkey) == i);
+    }
+    assert(vbucket_generate_key(vb, 4, "user:", 5, key, sizeof(key)) == -1);
+    assert(vbucket_generate_key(vb, 0, "user:", 5, key, 12) == -1);
+    vbucket_config_destroy(vb);
+
+    vb = vbucket_config_parse_file(configPath("ketama-eight-nodes"));
+    assert(vb);
+    assert(vbucket_generate_key(vb, 0, "user:", 5, key, sizeof(key)) == -1);
+    vbucket_config_destroy(vb);
+}
+
+static void testKeyCache(void)
+{
+    VBUCKET_CONFIG_HANDLE vb = vbucket_config_parse_file(configPath("ketama-eight-nodes"));
+    VBUCKET_CONFIG_HANDLE cached = vbucket_config_parse_file(configPath("ketama-eight-nodes"));
+    uint64_t hits, misses;
+    vbucket_iovec_t iov[2];
+    char key[80];
+    int i, pass, nkey, m, cm;
+
+    assert(vb);
+    assert(cached);
+    assert(vbucket_config_get_key_cache_stats(cached, &hits, &misses) == -1);
+    assert(vbucket_config_enable_key_cache(cached, 1000) == 0);
+    assert(vbucket_config_enable_key_cache(cached, 1000) == -1);
+
+    for (pass = 0; pass < 3; ++pass) {
+        for (i = 0; i < 100; ++i) {
+            nkey = snprintf(key, sizeof(key), "hot%d", i);
+            assert(vbucket_map(vb, key, nkey, NULL, &m) == 0);
+            assert(vbucket_map(cached, key, nkey, NULL, &cm) == 0);
+            assert(m == cm);
+        }
+    }
+    assert(vbucket_config_get_key_cache_stats(cached, &hits, &misses) == 0);
+    assert(hits + misses == 300);
+    assert(hits >= 200);
+    vbucket_config_destroy(cached);
+
+    /* keys which share the only slot, too long ones and ejected servers */
+    cached = vbucket_config_parse_file(configPath("ketama-eight-nodes"));
+    assert(cached);
+    assert(vbucket_config_enable_key_cache(cached, 1) == 0);
+    assert(vbucket_ketama_eject(vb, 3) == 0);
+    assert(vbucket_ketama_eject(cached, 3) == 0);
+    for (pass = 0; pass < 2; ++pass) {
+        for (i = 0; i < 500; ++i) {
+            nkey = snprintf(key, sizeof(key), "%0*d", 1 + i % 60, i);
+            iov[0].iov_base = key;
+            iov[0].iov_len = nkey / 2;
+            iov[1].iov_base = key + nkey / 2;
+            iov[1].iov_len = nkey - nkey / 2;
+            assert(vbucket_map(vb, key, nkey, NULL, &m) == 0);
+            assert(vbucket_map(cached, key, nkey, NULL, &cm) == 0);
+            assert(m == cm && m != 3);
+            assert(vbucket_mapv(cached, iov, 2, NULL, &cm) == 0);
+            assert(m == cm);
+        }
+    }
+    assert(vbucket_config_get_key_cache_stats(cached, &hits, &misses) == 0);
+    assert(hits + misses == 2000);
+    assert(hits >= 500);
+
+    vbucket_config_destroy(vb);
+    vbucket_config_destroy(cached);
+
+    vb = vbucket_config_parse_file(configPath("config"));
+    assert(vb);
+    assert(vbucket_config_enable_key_cache(vb, 1000) == -1);
+    vbucket_config_destroy(vb);
+}
+
+static void testKetamaIndex(void)
+{
+    VBUCKET_CONFIG_HANDLE vb = vbucket_config_parse_file(configPath("ketama-eight-nodes"));
+    VBUCKET_CONFIG_HANDLE plain = vbucket_config_parse_file(configPath("ketama-eight-nodes"));
+    int bits[] = { 1, 6, 12, 24, -1 };
+    char key[16];
+    size_t b;
+    int i, nkey, m, pm;
+
+    assert(vb);
+    assert(plain);
+    assert(vbucket_config_set_ketama_index_bits(plain, 0) == 0);
+    assert(vbucket_config_set_ketama_index_bits(vb, 25) == -1);
+
+    for (b = 0; b < sizeof(bits) / sizeof(bits[0]); ++b) {
+        assert(vbucket_config_set_ketama_index_bits(vb, bits[b]) == 0);
+        for (i = 0; i < 10000; ++i) {
+            nkey = snprintf(key, sizeof(key), "key%d", i);
+            assert(vbucket_map(vb, key, nkey, NULL, &m) == 0);
+            assert(vbucket_map(plain, key, nkey, NULL, &pm) == 0);
+            assert(m == pm);
+        }
+    }
+
+    vbucket_config_destroy(vb);
+    vbucket_config_destroy(plain);
+}
+
+static void testKetamaWeights(void)
+{
+    VBUCKET_CONFIG_HANDLE vb, same;
+    double shares[2];
+    char key[16];
+    int i, nkey, m, sm;
+
+    vb = vbucket_config_parse_string("{\"nodeLocator\": \"ketama\", \"nodes\": ["
+                                     "{\"hostname\": \"h1:8091\", \"weight\": 64, "
+                                     "\"ports\": {\"direct\": 11210}}, "
+                                     "{\"hostname\": \"h2:8091\", \"weight\": 256, "
+                                     "\"ports\": {\"direct\": 11210}}]}");
+    assert(vb);
+    assert(vbucket_config_get_server_shares(vb, shares) == 0);
+    assert(shares[0] > 0.1 && shares[0] < 0.3);
+    assert(shares[1] > 0.7 && shares[1] < 0.9);
+    vbucket_config_destroy(vb);
+
+    /* equal weights keep the unweighted continuum */
+    vb = vbucket_config_parse_string("{\"nodeLocator\": \"ketama\", \"nodes\": ["
+                                     "{\"hostname\": \"h1:8091\", \"weight\": 3, "
+                                     "\"ports\": {\"direct\": 11210}}, "
+                                     "{\"hostname\": \"h2:8091\", \"weight\": 3, "
+                                     "\"ports\": {\"direct\": 11210}}]}");
+    same = vbucket_config_parse_string("{\"nodeLocator\": \"ketama\", \"nodes\": ["
+                                       "{\"hostname\": \"h1:8091\", "
+                                       "\"ports\": {\"direct\": 11210}}, "
+                                       "{\"hostname\": \"h2:8091\", "
+                                       "\"ports\": {\"direct\": 11210}}]}");
+    assert(vb);
+    assert(same);
+    for (i = 0; i < 1000; ++i) {
+        nkey = snprintf(key, sizeof(key), "key%d", i);
+        assert(vbucket_map(vb, key, nkey, NULL, &m) == 0);
+        assert(vbucket_map(same, key, nkey, NULL, &sm) == 0);
+        assert(m == sm);
+    }
+    vbucket_config_destroy(vb);
+    vbucket_config_destroy(same);
+
+    vb = vbucket_config_create();
+    assert(vbucket_config_parse(vb, LIBVBUCKET_SOURCE_MEMORY,
+                                "{\"nodeLocator\": \"ketama\", \"nodes\": ["
+                                "{\"hostname\": \"h1:8091\", \"weight\": -1, "
+                                "\"ports\": {\"direct\": 11210}}]}") != 0);
+    assert(strcmp(vbucket_get_error_message(vb),
+                  "Expected non-negative number for node's weight") == 0);
+    vbucket_config_destroy(vb);
+}
+
+static void testParseUpdate(void)
+{
+    const char *before = "{\"nodeLocator\": \"ketama\", \"nodes\": ["
+        "{\"hostname\": \"h1:8091\", \"ports\": {\"direct\": 11210}}, "
+        "{\"hostname\": \"h2:8091\", \"ports\": {\"direct\": 11210}}, "
+        "{\"hostname\": \"h4:8091\", \"ports\": {\"direct\": 11210}}]}";
+    const char *after = "{\"nodeLocator\": \"ketama\", \"nodes\": ["
+        "{\"hostname\": \"h4:8091\", \"ports\": {\"direct\": 11210}}, "
+        "{\"hostname\": \"h3:8091\", \"ports\": {\"direct\": 11210}}, "
+        "{\"hostname\": \"h1:8091\", \"ports\": {\"direct\": 11210}}]}";
+    VBUCKET_CONFIG_HANDLE prev = vbucket_config_create();
+    VBUCKET_CONFIG_HANDLE vb = vbucket_config_create();
+    VBUCKET_CONFIG_HANDLE full = vbucket_config_create();
+    char key[16];
+    int i, nkey, m, fm;
+
+    assert(vbucket_config_parse(prev, LIBVBUCKET_SOURCE_MEMORY, before) == 0);
+    assert(vbucket_config_parse_update(vb, prev, LIBVBUCKET_SOURCE_MEMORY,
+                                       after, "localhost") == 0);
+    assert(vbucket_config_parse(full, LIBVBUCKET_SOURCE_MEMORY, after) == 0);
+    for (i = 0; i < 10000; ++i) {
+        nkey = snprintf(key, sizeof(key), "key%d", i);
+        assert(vbucket_map(vb, key, nkey, NULL, &m) == 0);
+        assert(vbucket_map(full, key, nkey, NULL, &fm) == 0);
+        assert(m == fm);
+    }
+    vbucket_config_destroy(prev);
+    vbucket_config_destroy(vb);
+    vbucket_config_destroy(full);
+
+    /* a vbucket config has no continuum to reuse */
+    prev = vbucket_config_parse_file(configPath("config"));
+    vb = vbucket_config_create();
+    assert(prev);
+    assert(vbucket_config_parse_update(vb, prev, LIBVBUCKET_SOURCE_MEMORY,
+                                       after, "localhost") == 0);
+    assert(vbucket_config_get_num_servers(vb) == 3);
+    vbucket_config_destroy(prev);
+    vbucket_config_destroy(vb);
+}
+
+static int executed;
+
+static void run_tasks(void *cookie, vbucket_task_fn task, void *const *args, int ntasks)
+{
+    int i;
+
+    assert(cookie == &executed);
+    for (i = ntasks - 1; i >= 0; --i) {
+        task(args[i]);
+        ++executed;
+    }
+}
+
+static void testParallelBuild(void)
+{
+    VBUCKET_CONFIG_HANDLE serial = vbucket_config_parse_file(configPath("ketama-eight-nodes"));
+    VBUCKET_CONFIG_HANDLE vb;
+    char key[16];
+    int i, pass, nkey, m, sm;
+
+    assert(serial);
+    for (pass = 0; pass < 2; ++pass) {
+        vb = vbucket_config_create();
+        assert(vb);
+        assert(vbucket_config_set_build_threads(vb, 0, NULL, NULL) == -1);
+        assert(vbucket_config_set_build_threads(vb, 4, pass ? run_tasks : NULL,
+                                                &executed) == 0);
+        assert(vbucket_config_parse(vb, LIBVBUCKET_SOURCE_FILE,
+                                    configPath("ketama-eight-nodes")) == 0);
+        for (i = 0; i < 10000; ++i) {
+            nkey = snprintf(key, sizeof(key), "key%d", i);
+            assert(vbucket_map(vb, key, nkey, NULL, &m) == 0);
+            assert(vbucket_map(serial, key, nkey, NULL, &sm) == 0);
+            assert(m == sm);
+        }
+        vbucket_config_destroy(vb);
+    }
+    assert(executed > 0);
+    vbucket_config_destroy(serial);
+}
+
+static VBUCKET_CONFIG_HANDLE parseNodes(const char *locator, int first, int nnodes)
+{
+    char config[4096];
+    int i, len;
+
+    len = snprintf(config, sizeof(config),
+                   "{\"nodeLocator\": \"%s\", \"nodes\": [", locator);
+    for (i = first; i < first + nnodes; ++i) {
+        len += snprintf(config + len, sizeof(config) - len,
+                        "%s{\"hostname\": \"h%d:8091\", \"ports\": {\"direct\": 11210}}",
+                        i > first ? ", " : "", i);
+    }
+    snprintf(config + len, sizeof(config) - len, "]}");
+    return vbucket_config_parse_string(config);
+}
+
+static void testJumpAndMaglev(void)
+{
+    const char *locators[] = { "jump", "maglev" };
+    VBUCKET_CONFIG_HANDLE vb, grown;
+    int counts[10];
+    double shares[10];
+    char key[16];
+    int l, i, nkey, m, gm, moved, shuffled;
+
+    for (l = 0; l < 2; ++l) {
+        vb = parseNodes(locators[l], 0, 10);
+        grown = parseNodes(locators[l], 0, 11);
+        assert(vb);
+        assert(grown);
+        assert(vbucket_config_get_distribution_type(vb) ==
+               (l ? VBUCKET_DISTRIBUTION_MAGLEV : VBUCKET_DISTRIBUTION_JUMP));
+        assert(vbucket_config_get_server_shares(vb, shares) == 0);
+        for (i = 0; i < 10; ++i) {
+            assert(shares[i] > 0.099 && shares[i] < 0.101);
+        }
+
+        memset(counts, 0, sizeof(counts));
+        for (i = 0, moved = 0, shuffled = 0; i < 100000; ++i) {
+            nkey = snprintf(key, sizeof(key), "key%d", i);
+            assert(vbucket_map(vb, key, nkey, NULL, &m) == 0);
+            assert(vbucket_map(grown, key, nkey, NULL, &gm) == 0);
+            assert(m >= 0 && m < 10);
+            ++counts[m];
+            /* maglev sorts the servers by name, so compare names */
+            if (strcmp(vbucket_config_get_server(vb, m),
+                       vbucket_config_get_server(grown, gm)) != 0) {
+                if (strcmp(vbucket_config_get_server(grown, gm), "h10:11210") == 0) {
+                    ++moved;
+                } else {
+                    /* maglev moves a few keys between the old servers */
+                    assert(l == 1);
+                    ++shuffled;
+                }
+            }
+        }
+        for (i = 0; i < 10; ++i) {
+            assert(counts[i] > 9000 && counts[i] < 11000);
+        }
+        /* about an eleventh of the keys move to the new server */
+        assert(moved > 8000 && moved < 10500);
+        assert(shuffled < 1000);
+        vbucket_config_destroy(vb);
+        vbucket_config_destroy(grown);
+    }
+}
+
+static void testKetamaFallbacks(void)
+{
+    VBUCKET_CONFIG_HANDLE vb = parseNodes("ketama", 0, 10);
+    VBUCKET_CONFIG_HANDLE shrunk = parseNodes("ketama", 0, 9);
+    int fallbacks[8];
+    char key[16];
+    int i, j, nkey, m, sm, checked = 0;
+    uint32_t hash;
+
+    assert(vb);
+    assert(shrunk);
+    assert(vbucket_get_ketama_fallback(vb, 0, 0) == -1);
+    assert(vbucket_config_set_ketama_fallbacks(vb, 9) == -1);
+    assert(vbucket_config_set_ketama_fallbacks(vb, 3) == 0);
+
+    for (i = 0; i < 10000; ++i) {
+        nkey = snprintf(key, sizeof(key), "key%d", i);
+        hash = vbucket_hash_key(vb, key, nkey);
+        assert(vbucket_map_hashed(vb, hash, NULL, &m) == 0);
+        assert(vbucket_get_ketama_fallbacks(vb, hash, fallbacks, 8) == 3);
+        for (j = 0; j < 3; ++j) {
+            assert(vbucket_get_ketama_fallback(vb, hash, j) == fallbacks[j]);
+            assert(fallbacks[j] != m);
+        }
+        assert(fallbacks[0] != fallbacks[1] && fallbacks[1] != fallbacks[2] &&
+               fallbacks[0] != fallbacks[2]);
+        assert(vbucket_get_ketama_fallback(vb, hash, 3) == -1);
+
+        /* keys of a removed server move to their first fallback */
+        if (strcmp(vbucket_config_get_server(vb, m), "h9:11210") == 0) {
+            assert(vbucket_map(shrunk, key, nkey, NULL, &sm) == 0);
+            assert(strcmp(vbucket_config_get_server(shrunk, sm),
+                          vbucket_config_get_server(vb, fallbacks[0])) == 0);
+            ++checked;
+        }
+    }
+    assert(checked > 0);
+    vbucket_config_destroy(vb);
+    vbucket_config_destroy(shrunk);
+}
+
+static void testKetamaEject(void)
+{
+    VBUCKET_CONFIG_HANDLE vb = parseNodes("ketama", 0, 10);
+    VBUCKET_CONFIG_HANDLE without = parseNodes("ketama", 1, 9);
+    char key[16];
+    int i, pass, nkey, m, wm, ejected = -1;
+
+    assert(vb);
+    assert(without);
+    for (i = 0; i < 10; ++i) {
+        if (strcmp(vbucket_config_get_server(vb, i), "h0:11210") == 0) {
+            ejected = i;
+        }
+    }
+    assert(vbucket_ketama_eject(vb, 10) == -1);
+    assert(vbucket_ketama_eject(vb, ejected) == 0);
+    assert(vbucket_ketama_eject(vb, ejected) == 0);
+    assert(vbucket_ketama_is_ejected(vb, ejected));
+
+    /* the keys of h0 go where they would go without it, whether they
+     * are found through the fallbacks, the continuum or the cache */
+    for (pass = 0; pass < 3; ++pass) {
+        if (pass == 1) {
+            assert(vbucket_config_set_ketama_fallbacks(vb, 2) == 0);
+        } else if (pass == 2) {
+            assert(vbucket_config_enable_key_cache(vb, 1024) == 0);
+        }
+        for (i = 0; i < 10000; ++i) {
+            nkey = snprintf(key, sizeof(key), "key%d", i);
+            assert(vbucket_map(vb, key, nkey, NULL, &m) == 0);
+            assert(vbucket_map(without, key, nkey, NULL, &wm) == 0);
+            assert(strcmp(vbucket_config_get_server(vb, m),
+                          vbucket_config_get_server(without, wm)) == 0);
+        }
+    }
+
+    assert(vbucket_ketama_restore(vb, ejected) == 0);
+    assert(!vbucket_ketama_is_ejected(vb, ejected));
+    for (i = 0; i < 10000; ++i) {
+        nkey = snprintf(key, sizeof(key), "key%d", i);
+        assert(vbucket_map(vb, key, nkey, NULL, &m) == 0);
+        if (m == ejected) {
+            break;
+        }
+    }
+    assert(i < 10000);
+
+    /* one server always stays */
+    for (i = 0; i < 9; ++i) {
+        assert(vbucket_ketama_eject(vb, i) == 0);
+    }
+    assert(vbucket_ketama_eject(vb, 9) == -1);
+    assert(vbucket_map(vb, "key", 3, NULL, &m) == 0);
+    assert(m == 9);
+
+    vbucket_config_destroy(vb);
+    vbucket_config_destroy(without);
+}
+
+static void testMapHashes(void)
+{
+    VBUCKET_CONFIG_HANDLE vb = parseNodes("ketama", 0, 50);
+    uint32_t hashes[1000], x = 2463534242U;
+    int servers[1000], pass, i, m;
+
+    assert(vb);
+    for (i = 0; i < 1000; ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        hashes[i] = x;
+    }
+    /* the same servers as one at a time, with and without the index
+     * and with a server ejected */
+    for (pass = 0; pass < 3; ++pass) {
+        if (pass == 1) {
+            assert(vbucket_config_set_ketama_index_bits(vb, 0) == 0);
+        } else if (pass == 2) {
+            assert(vbucket_ketama_eject(vb, 7) == 0);
+        }
+        assert(vbucket_map_hashes(vb, hashes, 1000, NULL, servers) == 0);
+        for (i = 0; i < 1000; ++i) {
+            assert(vbucket_map_hashed(vb, hashes[i], NULL, &m) == 0);
+            assert(servers[i] == m);
+            assert(pass < 2 || m != 7);
+        }
+    }
+    vbucket_config_destroy(vb);
+}
+
+static void testRemapFraction(void)
+{
+    const char *locators[] = { "ketama", "jump", "maglev" };
+    VBUCKET_CONFIG_HANDLE vb, grown, without;
+    char keys[20000][16];
+    const void *kp[20000];
+    size_t nkeys[20000], nmoved;
+    double fraction;
+    int l, i;
+
+    for (i = 0; i < 20000; ++i) {
+        nkeys[i] = snprintf(keys[i], sizeof(keys[i]), "key%d", i);
+        kp[i] = keys[i];
+    }
+    /* adding one server to ten moves about a tenth of the keys, and the
+     * sample agrees with the hash space */
+    for (l = 0; l < 3; ++l) {
+        vb = parseNodes(locators[l], 0, 10);
+        grown = parseNodes(locators[l], 0, 11);
+        assert(vb);
+        assert(grown);
+        assert(vbucket_config_get_remap_fraction(vb, vb, &fraction) == 0);
+        assert(fraction == 0);
+        assert(vbucket_config_get_remap_fraction(vb, grown, &fraction) == 0);
+        assert(fraction > 0.03 && fraction < 0.2);
+        assert(vbucket_config_count_remapped_keys(vb, grown, kp, nkeys,
+                                                  20000, &nmoved) == 0);
+        assert(fraction - nmoved / 20000.0 < 0.01);
+        assert(nmoved / 20000.0 - fraction < 0.01);
+        vbucket_config_destroy(vb);
+        vbucket_config_destroy(grown);
+    }
+
+    /* the keys of an ejected server are where they'd be without it */
+    vb = parseNodes("ketama", 0, 10);
+    without = parseNodes("ketama", 1, 9);
+    assert(vb);
+    assert(without);
+    assert(vbucket_config_get_remap_fraction(vb, without, &fraction) == 0);
+    assert(fraction > 0);
+    for (i = 0; i < 10; ++i) {
+        if (strcmp(vbucket_config_get_server(vb, i), "h0:11210") == 0) {
+            assert(vbucket_ketama_eject(vb, i) == 0);
+        }
+    }
+    assert(vbucket_config_get_remap_fraction(vb, without, &fraction) == 0);
+    assert(fraction == 0);
+
+    grown = parseNodes("jump", 0, 10);
+    assert(grown);
+    assert(vbucket_config_get_remap_fraction(vb, grown, &fraction) == -1);
+    vbucket_config_destroy(without);
+
+    /* jump only estimates: one bucket in eleven is new */
+    without = parseNodes("jump", 0, 11);
+    assert(without);
+    assert(vbucket_config_get_remap_fraction(grown, without, &fraction) == 0);
+    assert(fraction == 1 - 10 / 11.0);
+    vbucket_config_destroy(vb);
+    vbucket_config_destroy(without);
+    vbucket_config_destroy(grown);
+
+    /* reordering the servers moves nothing */
+    vb = vbucket_config_parse_file(configPath("ketama-eight-nodes"));
+    without = vbucket_config_parse_file(configPath("ketama-ordered-eight-nodes"));
+    assert(vb);
+    assert(without);
+    assert(vbucket_config_get_remap_fraction(vb, without, &fraction) == 0);
+    assert(fraction == 0);
+    vbucket_config_destroy(vb);
+    vbucket_config_destroy(without);
+
+    vb = vbucket_config_parse_file(configPath("config-diff1"));
+    without = vbucket_config_parse_file(configPath("config-diff2"));
+    assert(vb);
+    assert(without);
+    assert(vbucket_config_get_remap_fraction(vb, vb, &fraction) == 0);
+    assert(fraction == 0);
+    assert(vbucket_config_get_remap_fraction(vb, without, &fraction) == 0);
+    assert(fraction == 0.5);
+    vbucket_config_destroy(vb);
+    vbucket_config_destroy(without);
+}
+
+static void testServerShares(void)
+{
+    VBUCKET_CONFIG_HANDLE vb = vbucket_config_parse_file(configPath("config"));
+    double shares[8], total = 0;
+    int i;
+
+    assert(vb);
+    assert(vbucket_config_get_server_shares(vb, shares) == 0);
+    assert(shares[0] == 0.25);
+    assert(shares[1] == 0.5);
+    assert(shares[2] == 0.25);
+    vbucket_config_destroy(vb);
+
+    vb = vbucket_config_parse_file(configPath("ketama-eight-nodes"));
+    assert(vb);
+    assert(vbucket_config_get_num_servers(vb) == 8);
+    assert(vbucket_config_get_server_shares(vb, shares) == 0);
+    for (i = 0; i < 8; ++i) {
+        assert(shares[i] > 0.05 && shares[i] < 0.2);
+        total += shares[i];
+    }
+    assert(total > 0.999999 && total < 1.000001);
+    vbucket_config_destroy(vb);
+}
+
+static void testParseStreaming(void)
+{
+    VBUCKET_CONFIG_HANDLE vb;
+
+    /* keys in any order, unknown values skipped, the first of a key wins */
+    vb = vbucket_config_parse_string("{\"vBucketMap\": [[1, 0], [0, -1]], "
+                                     "\"rev\": {\"x\": [1, {\"y\": \"z\"}]}, "
+                                     "\"serverList\": [\"s\\u00e9rver1:11211\", "
+                                     "\"s\\/2:11210\"], "
+                                     "\"numReplicas\\u0000\": 2, "
+                                     "\"NumReplicas\": 1, \"numReplicas\": 3, "
+                                     "\"hashAlgorithm\": \"CRC\"}");
+    assert(vb);
+    assert(vbucket_config_get_num_replicas(vb) == 1);
+    assert(vbucket_config_get_num_vbuckets(vb) == 2);
+    assert(strcmp(vbucket_config_get_server(vb, 0), "s\xc3\xa9rver1:11211") == 0);
+    assert(strcmp(vbucket_config_get_server(vb, 1), "s/2:11210") == 0);
+    assert(vbucket_get_master(vb, 0) == 1);
+    assert(vbucket_get_replica(vb, 0, 0) == 0);
+    assert(vbucket_get_replica(vb, 1, 0) == -1);
+    vbucket_config_destroy(vb);
+
+    vb = vbucket_config_create();
+    assert(vbucket_config_parse(vb, LIBVBUCKET_SOURCE_MEMORY,
+                                "{\"numReplicas\": 1, "
+                                "\"serverList\": [\"s1:11211\"], "
+                                "\"vBucketMap\": [[0, -1], [0]]}") != 0);
+    assert(strcmp(vbucket_get_error_message(vb),
+                  "Expected array of arrays each with numReplicas + 1 ints for vBucketMap") == 0);
+    vbucket_config_destroy(vb);
+
+    vb = vbucket_config_create();
+    assert(vbucket_config_parse(vb, LIBVBUCKET_SOURCE_MEMORY,
+                                "{\"vBucketServerMap\": \"none\", "
+                                "\"numReplicas\": 0, "
+                                "\"serverList\": [\"s1:11211\"], "
+                                "\"vBucketMap\": [[0], [0]]}") != 0);
+    assert(strcmp(vbucket_get_error_message(vb),
+                  "Expected object for vBucketServerMap") == 0);
+    vbucket_config_destroy(vb);
+
+    /* numbers out of the range of int */
+    vb = vbucket_config_create();
+    assert(vbucket_config_parse(vb, LIBVBUCKET_SOURCE_MEMORY,
+                                "{\"numReplicas\": 0, "
+                                "\"serverList\": [\"s1:11211\"], "
+                                "\"vBucketMap\": [[0], [1e300]]}") != 0);
+    assert(strcmp(vbucket_get_error_message(vb),
+                  "Server ID must be >= -1 and < num_servers") == 0);
+    vbucket_config_destroy(vb);
+
+    vb = vbucket_config_create();
+    assert(vbucket_config_parse(vb, LIBVBUCKET_SOURCE_MEMORY,
+                                "{\"numReplicas\": -1e300, "
+                                "\"serverList\": [\"s1:11211\"], "
+                                "\"vBucketMap\": [[0], [0]]}") != 0);
+    assert(strcmp(vbucket_get_error_message(vb),
+                  "Expected number <= 4 for numReplicas") == 0);
+    vbucket_config_destroy(vb);
+
+    vb = vbucket_config_create();
+    assert(vbucket_config_parse(vb, LIBVBUCKET_SOURCE_MEMORY,
+                                "{\"nodeLocator\": \"ketama\", \"nodes\": ["
+                                "{\"hostname\": \"h1:8091\", "
+                                "\"ports\": {\"direct\": 1e20}}]}") != 0);
+    assert(strcmp(vbucket_get_error_message(vb),
+                  "Expected number for node's direct port") == 0);
+    vbucket_config_destroy(vb);
+
+    vb = vbucket_config_create();
+    assert(vbucket_config_parse(vb, LIBVBUCKET_SOURCE_MEMORY,
+                                "{\"numReplicas\": 0, "
+                                "\"serverList\": [\"s1:11211\"], "
+                                "\"vBucketMap\": [[0], [0]") != 0);
+    assert(strcmp(vbucket_get_error_message(vb),
+                  "Failed to parse data. Invalid JSON?") == 0);
+    vbucket_config_destroy(vb);
+}
+
+static void testParseBufferAndPipe(void)
+{
+    const char *config = "{\"numReplicas\": 0, \"serverList\": [\"$HOST:11211\"], "
+        "\"vBucketMap\": [[0], [0]]}";
+    char data[256], path[64];
+    VBUCKET_CONFIG_HANDLE vb;
+    size_t n = strlen(config);
+    int fds[2];
+
+    /* not zero terminated, with a second document right behind */
+    memcpy(data, config, n);
+    memcpy(data + n, config, n);
+    vb = vbucket_config_create();
+    assert(vbucket_config_parse_buffer(vb, data, n, "10.0.0.1") == 0);
+    assert(vbucket_config_get_num_vbuckets(vb) == 2);
+    assert(strcmp(vbucket_config_get_server(vb, 0), "10.0.0.1:11211") == 0);
+    vbucket_config_destroy(vb);
+
+    vb = vbucket_config_create();
+    assert(vbucket_config_parse_buffer(vb, data, n - 1, NULL) != 0);
+    assert(strcmp(vbucket_get_error_message(vb),
+                  "Failed to parse data. Invalid JSON?") == 0);
+    vbucket_config_destroy(vb);
+
+    /* a pipe can't be mapped, it is read in chunks */
+    assert(pipe(fds) == 0);
+    assert(write(fds[1], config, n) == (ssize_t)n);
+    close(fds[1]);
+    snprintf(path, sizeof(path), "/dev/fd/%d", fds[0]);
+    vb = vbucket_config_parse_file(path);
+    close(fds[0]);
+    assert(vb);
+    assert(vbucket_config_get_num_vbuckets(vb) == 2);
+    assert(strcmp(vbucket_config_get_server(vb, 0), "localhost:11211") == 0);
+    vbucket_config_destroy(vb);
+}
+
+static void testConfigPeek(void)
+{
+    const char *config = "{\"rev\": 42, \"numReplicas\": 0, "
+        "\"serverList\": [\"s1:11211\"], \"vBucketMap\": [[0], [0]]}";
+    char data[8192], path[64];
+    VBUCKET_CONFIG_HANDLE vb;
+    uint64_t fingerprint, other;
+    int64_t rev;
+    size_t n;
+    FILE *fp;
+    int fds[2];
+
+    snprintf(data, sizeof(data), "\n %s\n\n\n\n", config);
+    assert(vbucket_config_peek(data, strlen(data), &rev, &fingerprint) == 0);
+    assert(rev == 42);
+    vb = vbucket_config_parse_string(config);
+    assert(vb);
+    assert(vbucket_config_get_rev(vb) == 42);
+    assert(vbucket_config_get_fingerprint(vb) == fingerprint);
+    vbucket_config_destroy(vb);
+
+    /* without a fingerprint the rev is all that is read */
+    assert(vbucket_config_peek("{\"rev\": 43, broken", 18, &rev, NULL) == 0);
+    assert(rev == 43);
+    assert(vbucket_config_peek("{\"rev\": 43, broken", 18, &rev, &other) == -1);
+    assert(vbucket_config_peek("{\"rev\": 43, ", 12, &rev, &other) == -1);
+
+    /* only the document counts, not what follows it */
+    snprintf(data, sizeof(data), "%s }trailing", config);
+    assert(vbucket_config_peek(data, strlen(data), &rev, &other) == 0);
+    assert(rev == 42 && other == fingerprint);
+    vb = vbucket_config_create();
+    assert(vb);
+    assert(vbucket_config_parse_buffer(vb, data, strlen(data), NULL) == 0);
+    assert(vbucket_config_get_fingerprint(vb) == fingerprint);
+    vbucket_config_destroy(vb);
+
+    /* a change anywhere shows in the fingerprint */
+    snprintf(data, sizeof(data), "%s", config);
+    data[strlen(data) - 4] = '1';
+    assert(vbucket_config_peek(data, strlen(data), &rev, &other) == 0);
+    assert(rev == 42 && other != fingerprint);
+
+    /* only the top level rev counts */
+    assert(vbucket_config_peek("{\"vBucketServerMap\": {\"rev\": 5}, \"REV\": 6}",
+                               42, &rev, NULL) == 0);
+    assert(rev == 6);
+    assert(vbucket_config_peek("{\"vBucketServerMap\": {\"rev\": 5}}", 32,
+                               &rev, NULL) == 0);
+    assert(rev == -1);
+    assert(vbucket_config_peek("{\"rev\": 7, \"rev\": 8}", 20, &rev, &other) == 0);
+    assert(rev == 7);
+    assert(vbucket_config_peek("{\"name\": [1, ", 13, &rev, NULL) == -1);
+    assert(vbucket_config_peek("}", 1, &rev, NULL) == -1);
+
+    /* mapped and streamed files get the fingerprint of their bytes */
+    fp = fopen(configPath("config"), "rb");
+    assert(fp);
+    n = fread(data, 1, sizeof(data), fp);
+    fclose(fp);
+    assert(vbucket_config_peek(data, n, &rev, &fingerprint) == 0);
+    assert(rev == -1);
+    vb = vbucket_config_parse_file(configPath("config"));
+    assert(vb);
+    assert(vbucket_config_get_rev(vb) == -1);
+    assert(vbucket_config_get_fingerprint(vb) == fingerprint);
+    vbucket_config_destroy(vb);
+
+    assert(pipe(fds) == 0);
+    assert(write(fds[1], data, n) == (ssize_t)n);
+    close(fds[1]);
+    snprintf(path, sizeof(path), "/dev/fd/%d", fds[0]);
+    vb = vbucket_config_parse_file(path);
+    close(fds[0]);
+    assert(vb);
+    assert(vbucket_config_get_fingerprint(vb) == fingerprint);
+    vbucket_config_destroy(vb);
+}
+
+struct stream_result_st {
+    int nconfigs;
+    int status[4];
+    int num_servers[4];
+    uint64_t fingerprint[4];
+};
+
+static void streamCallback(void *cookie, VBUCKET_CONFIG_HANDLE config, int status)
+{
+    struct stream_result_st *r = cookie;
+
+    assert(r->nconfigs < 4);
+    r->status[r->nconfigs] = status;
+    r->num_servers[r->nconfigs] = status == 0 ? vbucket_config_get_num_servers(config) : -1;
+    r->fingerprint[r->nconfigs] = vbucket_config_get_fingerprint(config);
+    if (status != 0) {
+        assert(strcmp(vbucket_get_error_message(config),
+                      "Failed to parse data. Invalid JSON?") == 0);
+    }
+    ++r->nconfigs;
+    vbucket_config_destroy(config);
+}
+
+static void testConfigStream(void)
+{
+    static const size_t chunks[] = { 1, 3, 4096 };
+    const char *ketama = "{\"nodeLocator\": \"ketama\", \"nodes\": ["
+        "{\"hostname\": \"$HOST:8091\", \"ports\": {\"direct\": 11210}}]}";
+    VBUCKET_CONFIG_STREAM stream;
+    struct stream_result_st result;
+    uint64_t fingerprint;
+    char data[8192];
+    size_t ndata, off, n;
+    FILE *fp;
+    int i;
+
+    /* a config from a file, a cut off one, a broken one and a ketama one */
+    fp = fopen(configPath("config"), "rb");
+    assert(fp);
+    ndata = fread(data, 1, 4096, fp);
+    fclose(fp);
+    ndata += snprintf(data + ndata, sizeof(data) - ndata,
+                      "\n\n\n\n{\"numReplicas\": 1, \"serverList\": [\"s:1\"\n\n\n\n"
+                      "\n{\"numReplicas\" 1} and more\n\n\n\n%s\n\n\n\n", ketama);
+    assert(ndata < sizeof(data));
+    assert(vbucket_config_peek(ketama, strlen(ketama), NULL, &fingerprint) == 0);
+
+    for (i = 0; i < 3; ++i) {
+        memset(&result, 0, sizeof(result));
+        stream = vbucket_config_stream_create("10.0.0.1", streamCallback, &result);
+        assert(stream);
+        for (off = 0; off < ndata; off += n) {
+            n = ndata - off < chunks[i] ? ndata - off : chunks[i];
+            assert(vbucket_config_stream_feed(stream, data + off, n) == 0);
+        }
+        assert(result.nconfigs == 4);
+        assert(result.status[0] == 0 && result.num_servers[0] == 3);
+        assert(result.status[1] == -1);
+        assert(result.status[2] == -1);
+        assert(result.status[3] == 0 && result.num_servers[3] == 1);
+        assert(result.fingerprint[3] == fingerprint);
+        vbucket_config_stream_destroy(stream);
+    }
+
+    /* a config is reported when it ends, not with the separator */
+    memset(&result, 0, sizeof(result));
+    stream = vbucket_config_stream_create(NULL, streamCallback, &result);
+    assert(stream);
+    assert(vbucket_config_stream_feed(stream, ketama, strlen(ketama)) == 0);
+    assert(result.nconfigs == 1 && result.status[0] == 0);
+    assert(vbucket_config_stream_feed(stream, "\n\n\n\n{\"nodeLoc", 13) == 0);
+    assert(result.nconfigs == 1);
+    vbucket_config_stream_destroy(stream);
+}
+
 int main(int argc, char **argv)
 {
     char buffer[1024];
@@ -315,5 +1297,28 @@ int main(int argc, char **argv)
   testConfigUserPassword();
   testConfigCouchApiBase();
   testConfigDiffKetamaSame();
+  testMapKeys("config");
+  testMapKeys("ketama-eight-nodes");
+  testMapHashed("config");
+  testMapHashed("ketama-eight-nodes");
+  testMapIovec("config");
+  testMapIovec("ketama-eight-nodes");
+  testHashAlgorithm();
+  testGenerateKey();
+  testKeyCache();
+  testKetamaIndex();
+  testKetamaWeights();
+  testParseUpdate();
+  testParallelBuild();
+  testJumpAndMaglev();
+  testKetamaFallbacks();
+  testKetamaEject();
+  testMapHashes();
+  testRemapFraction();
+  testServerShares();
+  testParseStreaming();
+  testConfigStream();
+  testParseBufferAndPipe();
+  testConfigPeek();
   exit(EXIT_SUCCESS);
 }
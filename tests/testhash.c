@@ -0,0 +1,235 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#undef NDEBUG
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* pull in the kernels directly so each of them can be checked */
+#include "src/crc32.c"
+#include "macros.h"
+
+#define NBUF 1024
+
+static void test_crc32_check_value(void) {
+    const char *check = "123456789";
+
+    assert(~hash_crc32_update(UINT32_MAX, check, strlen(check)) == 0xcbf43926);
+    assert(hash_crc32(check, strlen(check)) == ((0xcbf43926 >> 16) & 0x7fff));
+}
+
+static void test_crc32_kernels(void) {
+    unsigned char buf[NBUF + 8];
+    uint32_t expected;
+    size_t len, off;
+
+    srand(0xdeadbeef);
+    for (len = 0; len < sizeof(buf); ++len) {
+        buf[len] = (unsigned char)rand();
+    }
+
+    for (off = 0; off < 8; ++off) {
+        for (len = 0; len <= NBUF; ++len) {
+            expected = crc32_bytewise(UINT32_MAX, buf + off, len);
+            assert(crc32_slice8(UINT32_MAX, buf + off, len) == expected);
+#ifdef HAVE_CRC32_PCLMUL
+            if (cpu_has_pclmul()) {
+                assert(crc32_pclmul(UINT32_MAX, buf + off, len) == expected);
+            }
+#endif
+#ifdef HAVE_CRC32_ARMV8
+            assert(crc32_armv8(UINT32_MAX, buf + off, len) == expected);
+#endif
+            assert(hash_crc32_update(UINT32_MAX, (char *)buf + off, len) == expected);
+            assert(hash_crc32((char *)buf + off, len) == (((~expected) >> 16) & 0x7fff));
+        }
+    }
+}
+
+static void test_crc32_multi(void) {
+    char buf[NBUF];
+    const char *keys[NBUF / 4];
+    size_t nkeys[NBUF / 4];
+    uint32_t result[NBUF / 4];
+    size_t ii;
+
+    for (ii = 0; ii < sizeof(buf); ++ii) {
+        buf[ii] = (char)rand();
+    }
+    for (ii = 0; ii < NBUF / 4; ++ii) {
+        keys[ii] = buf + ii;
+        nkeys[ii] = (ii * 13) % (NBUF - ii);
+    }
+
+    hash_crc32_multi(keys, nkeys, NBUF / 4, result);
+    for (ii = 0; ii < NBUF / 4; ++ii) {
+        assert(result[ii] == hash_crc32(keys[ii], nkeys[ii]));
+    }
+    hash_crc32_wide_multi(keys, nkeys, NBUF / 4, result);
+    for (ii = 0; ii < NBUF / 4; ++ii) {
+        assert(result[ii] == hash_crc32_wide(keys[ii], nkeys[ii]));
+    }
+}
+
+static void test_crc32_wide(void) {
+    char key[16];
+    vbucket_iovec_t iov[2];
+    uint32_t wide;
+    int ii, nkey, upper = 0;
+
+    for (ii = 0; ii < 65536; ++ii) {
+        nkey = snprintf(key, sizeof(key), "key_%d", ii);
+        wide = hash_crc32_wide(key, nkey);
+        /* compatible with the 15 bit hash on maps up to 32768 vbuckets */
+        assert((wide & 0x7fff) == hash_crc32(key, nkey));
+        iov[0].iov_base = key;
+        iov[0].iov_len = 3;
+        iov[1].iov_base = key + 3;
+        iov[1].iov_len = nkey - 3;
+        assert(hash_crc32_wide_iov(iov, 2) == wide);
+        upper += (wide & 0x8000) != 0;
+    }
+    /* and the upper half of a 65536 vbucket map gets its share */
+    assert(upper > 32768 - 1024 && upper < 32768 + 1024);
+}
+
+struct hash_vector_st {
+    const char *key;
+    uint32_t fnv1a;
+    uint32_t murmur3;
+};
+
+static const struct hash_vector_st vectors[] = {
+    { "", 0x811c9dc5, 0x00000000 },
+    { "a", 0xe40c292c, 0x3c2569b2 },
+    { "foobar", 0xbf9cf968, 0xa4c4d4bd },
+    { "hello", 0x4f9f2cab, 0x248bfa47 },
+    { "The quick brown fox jumps over the lazy dog", 0x048fff90, 0x2e4ff723 },
+    { NULL, 0, 0 }
+};
+
+static void test_hash_vectors(void) {
+    const struct hash_vector_st *v;
+    vbucket_iovec_t iov[3];
+    size_t nkey, split;
+
+    for (v = vectors; v->key != NULL; ++v) {
+        nkey = strlen(v->key);
+        assert(hash_fnv1a(v->key, nkey) == v->fnv1a);
+        assert(hash_murmur3(v->key, nkey) == v->murmur3);
+
+        /* every way to split the key in three must give the same hash */
+        for (split = 0; split <= nkey; ++split) {
+            iov[0].iov_base = v->key;
+            iov[0].iov_len = split / 2;
+            iov[1].iov_base = v->key + split / 2;
+            iov[1].iov_len = split - split / 2;
+            iov[2].iov_base = v->key + split;
+            iov[2].iov_len = nkey - split;
+            assert(hash_fnv1a_iov(iov, 3) == v->fnv1a);
+            assert(hash_murmur3_iov(iov, 3) == v->murmur3);
+            assert(hash_crc32_iov(iov, 3) == hash_crc32(v->key, nkey));
+        }
+    }
+}
+
+struct md5_vector_st {
+    const char *key;
+    const char *digest;
+};
+
+static const struct md5_vector_st md5_vectors[] = {
+    { "", "d41d8cd98f00b204e9800998ecf8427e" },
+    { "a", "0cc175b9c0f1b6a831c399e269772661" },
+    { "abc", "900150983cd24fb0d6963f7d28e17f72" },
+    { "message digest", "f96b697d7cb7938d525a2f31aaf161d0" },
+    { "12345678901234567890123456789012345678901234567890123456789012345678901234567890",
+      "57edf4a22be3c955ac49da2e2107b67a" },
+    { NULL, NULL }
+};
+
+static void test_md5_vectors(void) {
+    const struct md5_vector_st *v;
+    unsigned char digest[16];
+    char hex[33];
+    hash_md5_ctx_t ctx;
+    size_t nkey, ii;
+
+    for (v = md5_vectors; v->key != NULL; ++v) {
+        nkey = strlen(v->key);
+        hash_md5(v->key, nkey, digest);
+        for (ii = 0; ii < 16; ++ii) {
+            snprintf(hex + ii * 2, 3, "%02x", digest[ii]);
+        }
+        assert(strcmp(hex, v->digest) == 0);
+
+        /* feed it byte by byte */
+        hash_md5_ctx_init(&ctx);
+        for (ii = 0; ii < nkey; ++ii) {
+            hash_md5_ctx_update(&ctx, v->key + ii, 1);
+        }
+        memset(hex, 0, sizeof(hex));
+        hash_md5_ctx_final(&ctx, (unsigned char *)hex);
+        assert(memcmp(hex, digest, 16) == 0);
+    }
+}
+
+static void test_md5_multi(void) {
+    char buf[NBUF];
+    const char *keys[NBUF / 4];
+    size_t nkeys[NBUF / 4];
+    unsigned char result[NBUF / 4][16];
+    unsigned char digest[16];
+    size_t ii;
+
+    for (ii = 0; ii < sizeof(buf); ++ii) {
+        buf[ii] = (char)rand();
+    }
+    for (ii = 0; ii < NBUF / 4; ++ii) {
+        keys[ii] = buf + ii;
+        /* mostly short keys with different block counts, some long ones */
+        nkeys[ii] = ii % 17 == 0 ? ii * 2 : ii % 130;
+    }
+
+    hash_md5_multi(keys, nkeys, NBUF / 4, result);
+    for (ii = 0; ii < NBUF / 4; ++ii) {
+        hash_md5(keys[ii], nkeys[ii], digest);
+        assert(memcmp(result[ii], digest, 16) == 0);
+    }
+
+    /* only keys short enough for the vector lanes, and a partial group */
+    for (ii = 0; ii < NBUF / 4; ++ii) {
+        nkeys[ii] = ii % 120;
+    }
+    hash_md5_multi(keys, nkeys, NBUF / 4 - 3, result);
+    for (ii = 0; ii < NBUF / 4 - 3; ++ii) {
+        hash_md5(keys[ii], nkeys[ii], digest);
+        assert(memcmp(result[ii], digest, 16) == 0);
+    }
+}
+
+static void test_crc32_suffix(void) {
+    char key[32];
+    uint32_t value;
+    size_t nprefix = strlen("prefix-");
+
+    memcpy(key, "prefix-", nprefix);
+    /* every id of a 65536 vbucket map is reachable */
+    for (value = 0; value < 65536; ++value) {
+        assert(hash_crc32_suffix(key, nprefix, 0xffff0000, value << 16,
+                                 key + nprefix) == 0);
+        assert((hash_crc32_wide(key, nprefix + HASH_CRC32_SUFFIX_LENGTH) & 0xffff) == value);
+    }
+}
+
+int main(void) {
+    test_crc32_check_value();
+    test_crc32_kernels();
+    test_crc32_multi();
+    test_crc32_wide();
+    test_crc32_suffix();
+    test_hash_vectors();
+    test_md5_vectors();
+    test_md5_multi();
+    exit(EXIT_SUCCESS);
+}
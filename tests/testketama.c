@@ -36,7 +36,7 @@ int main(void) {
     const char *host;
     char buffer[FILENAME_MAX];
     char key[NKEY];
-    int idx, i, len, ff;
+    int idx, i, len, ff, cached;
     VBUCKET_CONFIG_HANDLE vb;
     unsigned char checksum[16];
     unsigned char expected[16];
@@ -44,29 +44,35 @@ int main(void) {
 
     if (root != NULL) {
         for (ff = 0; test_cases[ff] != NULL; ++ff) {
-            snprintf(buffer, FILENAME_MAX, "%s/tests/config/%s", root, test_cases[ff]);
-            fprintf(stderr, "Running ketama test for: %s\n", test_cases[ff]);
-            vb = vbucket_config_create();
-            assert(vbucket_config_parse(vb, LIBVBUCKET_SOURCE_FILE, buffer) == 0);
-            /* check if it conforms to libketama results */
-            snprintf(buffer, FILENAME_MAX,"%s/tests/config/%s.md5sum", root, test_cases[ff]);
-            read_checksum(buffer, expected);
-            memset(checksum, 0, 16);
-            ctx = NULL;
+            for (cached = 0; cached < 2; ++cached) {
+                snprintf(buffer, FILENAME_MAX, "%s/tests/config/%s", root, test_cases[ff]);
+                fprintf(stderr, "Running ketama test for: %s%s\n", test_cases[ff],
+                        cached ? " (with key cache)" : "");
+                vb = vbucket_config_create();
+                assert(vbucket_config_parse(vb, LIBVBUCKET_SOURCE_FILE, buffer) == 0);
+                if (cached) {
+                    assert(vbucket_config_enable_key_cache(vb, 4096) == 0);
+                }
+                /* check if it conforms to libketama results */
+                snprintf(buffer, FILENAME_MAX,"%s/tests/config/%s.md5sum", root, test_cases[ff]);
+                read_checksum(buffer, expected);
+                memset(checksum, 0, 16);
+                ctx = NULL;
 
-            for (i = 0; i < 1000000; i++) {
-                len = snprintf(key, NKEY, "%d", i);
-                vbucket_map(vb, key, len, NULL, &idx);
-                host = vbucket_config_get_server(vb, idx);
-                ctx = hash_md5_update(ctx, host, strlen(host));
-            }
-            hash_md5_final(ctx, checksum);
+                for (i = 0; i < 1000000; i++) {
+                    len = snprintf(key, NKEY, "%d", i);
+                    vbucket_map(vb, key, len, NULL, &idx);
+                    host = vbucket_config_get_server(vb, idx);
+                    ctx = hash_md5_update(ctx, host, strlen(host));
+                }
+                hash_md5_final(ctx, checksum);
 
-            for (i = 0; i < 16; i++) {
-                assert(checksum[i] == expected[i]);
-            }
+                for (i = 0; i < 16; i++) {
+                    assert(checksum[i] == expected[i]);
+                }
 
-            vbucket_config_destroy(vb);
+                vbucket_config_destroy(vb);
+            }
         }
     }
 